@@ -0,0 +1,176 @@
+#include "precomp.h"
+
+#pragma region resuming
+// a job that resumes a coroutine; it deletes itself first, the coroutine may run for as long as it likes
+class ResumeJob : public Job
+{
+public:
+	ResumeJob(std::coroutine_handle<> handle) : m_Handle(handle) {}
+	void Main() override
+	{
+		std::coroutine_handle<> handle = m_Handle;
+		delete this;
+		handle.resume();
+	}
+protected:
+	std::coroutine_handle<> m_Handle;
+};
+
+// Spawn wants a count to take its jobs off, nothing waits on this one
+static std::atomic<int64_t> s_ResumeJobs{ 0 };
+
+static void ResumeOnWorker(std::coroutine_handle<> handle)
+{
+	s_ResumeJobs.fetch_add(1, std::memory_order_relaxed);
+	JobManager::GetJobManager()->Spawn(new ResumeJob(handle), &s_ResumeJobs);
+}
+
+void ResumeOnJobs::await_suspend(std::coroutine_handle<> handle)
+{
+	ResumeOnWorker(handle);
+}
+
+void HelpJobsUntil(const std::atomic<bool>& done)
+{
+	JobManager* jobManager = JobManager::GetJobManager();
+	while (!done.load(std::memory_order_acquire))
+		if (!jobManager->RunJob()) std::this_thread::yield();
+}
+#pragma endregion
+
+#pragma region async io
+// one thread for everything a coroutine waits on outside the CPU: file reads run here one at a time (so the workers
+// never block on the disk), conditions are polled every ASYNC_POLL_INTERVAL while any are pending. whatever is done
+// goes back to the workers
+class AsyncIo
+{
+public:
+	static AsyncIo& Get()
+	{
+		static AsyncIo io;
+		return io;
+	}
+	// step runs on the I/O thread until it returns true, then handle is resumed on a worker
+	void Post(std::function<bool()> step, std::coroutine_handle<> handle)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_Lock);
+			m_Incoming.push_back({ std::move(step), handle });
+		}
+		m_Signal.notify_one();
+	}
+protected:
+	AsyncIo() : m_Thread(&AsyncIo::ThreadLoop, this) {}
+	~AsyncIo()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_Lock);
+			m_Stop = true;
+		}
+		m_Signal.notify_one();
+		m_Thread.join();
+	}
+	struct Request
+	{
+		std::function<bool()> step;
+		std::coroutine_handle<> handle;
+	};
+	void ThreadLoop()
+	{
+		JobManager::GetJobManager()->PlaceBackgroundThread();
+		std::vector<Request> pending;
+		while (1)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_Lock);
+				auto wake = [this] { return m_Stop || !m_Incoming.empty(); };
+				if (pending.empty()) m_Signal.wait(lock, wake);
+				else m_Signal.wait_for(lock, ASYNC_POLL_INTERVAL, wake);
+				if (m_Stop) return;
+				for (Request& request : m_Incoming) pending.push_back(std::move(request));
+				m_Incoming.clear();
+			}
+			for (size_t i = 0; i < pending.size();)
+				if (pending[i].step())
+				{
+					ResumeOnWorker(pending[i].handle);
+					pending[i] = std::move(pending.back());
+					pending.pop_back();
+				}
+				else i++;
+		}
+	}
+	std::mutex m_Lock;
+	std::condition_variable m_Signal;
+	std::vector<Request> m_Incoming;
+	bool m_Stop = false;
+	std::thread m_Thread;							// last, it starts on members that exist
+};
+
+void ReadFileAsync::await_suspend(std::coroutine_handle<> handle)
+{
+	AsyncIo::Get().Post([this] {
+		std::ifstream file(m_Path, std::ios::ate | std::ios::binary);
+		if (file.is_open())
+		{
+			m_Data.resize((size_t)file.tellg());
+			file.seekg(0);
+			file.read(m_Data.data(), m_Data.size());
+			m_Read = true;
+		}
+		return true;
+	}, handle);
+}
+
+std::vector<char> ReadFileAsync::await_resume()
+{
+	if (!m_Read)
+		throw std::runtime_error("failed to open file!");
+	return std::move(m_Data);
+}
+
+void WaitAsync::await_suspend(std::coroutine_handle<> handle)
+{
+	AsyncIo::Get().Post(m_Ready, handle);
+}
+#pragma endregion
+
+#pragma region when all
+struct WhenAllState
+{
+	std::atomic<size_t> remaining;
+	std::coroutine_handle<> waiting;
+};
+
+static DetachedTask RunForWhenAll(Task<void>& task, WhenAllState& state)
+{
+	co_await ResumeOnJobs();
+	try { co_await task; }
+	catch (...) {}									// kept in the task, WhenAll rethrows it
+	if (state.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		state.waiting.resume();
+}
+
+// one count more than there are tasks, so the last task cannot resume WhenAll before all of them have started
+struct WhenAllAwaiter
+{
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		state.waiting = handle;
+		state.remaining.store(tasks.size() + 1, std::memory_order_relaxed);
+		for (Task<void>& task : tasks) RunForWhenAll(task, state);
+		return state.remaining.fetch_sub(1, std::memory_order_acq_rel) > 1;
+	}
+	void await_resume() const noexcept {}
+	std::vector<Task<void>>& tasks;
+	WhenAllState& state;
+};
+
+Task<void> WhenAll(std::vector<Task<void>> tasks)
+{
+	WhenAllState state;
+	co_await WhenAllAwaiter{ tasks, state };
+	for (Task<void>& task : tasks) co_await task;	// all done, this only rethrows
+}
+#pragma endregion
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+// coroutine tasks on the job system. a Task starts when it is first awaited and resumes its awaiter when it is done;
+// ResumeOnJobs moves the coroutine to a job manager worker, ReadFileAsync and WaitAsync park it on the async I/O thread
+// until the file is read or the condition (a GPU fence, say) holds, after which it goes back to the workers.
+// from plain code a task is run with SyncWait, which helps the job manager while it waits
+template <class T> class Task;
+
+class TaskPromiseBase
+{
+public:
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept { return false; }
+		template <class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+		{
+			std::coroutine_handle<> continuation = handle.promise().m_Continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { m_Exception = std::current_exception(); }
+	std::coroutine_handle<> m_Continuation;			// the coroutine awaiting this one
+	std::exception_ptr m_Exception;
+};
+
+template <class T>
+class TaskPromise : public TaskPromiseBase
+{
+public:
+	Task<T> get_return_object();
+	void return_value(T value) { m_Value.emplace(std::move(value)); }
+	T GetResult()
+	{
+		if (m_Exception) std::rethrow_exception(m_Exception);
+		return std::move(*m_Value);
+	}
+	std::optional<T> m_Value;
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase
+{
+public:
+	Task<void> get_return_object();
+	void return_void() {}
+	void GetResult() { if (m_Exception) std::rethrow_exception(m_Exception); }
+};
+
+template <class T = void>
+class Task
+{
+public:
+	typedef TaskPromise<T> promise_type;
+	Task() = default;
+	explicit Task(std::coroutine_handle<promise_type> handle) : m_Handle(handle) {}
+	Task(Task&& other) noexcept : m_Handle(other.m_Handle) { other.m_Handle = nullptr; }
+	Task& operator=(Task&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (m_Handle) m_Handle.destroy();
+			m_Handle = other.m_Handle;
+			other.m_Handle = nullptr;
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() { if (m_Handle) m_Handle.destroy(); }
+	// awaiting starts the task on the awaiting thread and continues the awaiter where the task ends
+	bool await_ready() const noexcept { return !m_Handle || m_Handle.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		m_Handle.promise().m_Continuation = awaiting;
+		return m_Handle;
+	}
+	// the value, or the exception the task ended with
+	T await_resume() { return m_Handle.promise().GetResult(); }
+protected:
+	std::coroutine_handle<promise_type> m_Handle;
+};
+
+template <class T>
+Task<T> TaskPromise<T>::get_return_object() { return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this)); }
+inline Task<void> TaskPromise<void>::get_return_object() { return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this)); }
+
+// fire and forget: runs right away and frees itself at the end, exceptions must not leave it
+struct DetachedTask
+{
+	struct promise_type
+	{
+		DetachedTask get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+// co_await ResumeOnJobs(): continues on a job manager worker (or whichever thread is helping it)
+struct ResumeOnJobs
+{
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> handle);
+	void await_resume() const noexcept {}
+};
+
+// co_await ReadFileAsync(path): the whole file, read on the async I/O thread; throws like readFile() when it cannot be opened
+class ReadFileAsync
+{
+public:
+	explicit ReadFileAsync(std::string path) : m_Path(std::move(path)) {}
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> handle);
+	std::vector<char> await_resume();
+protected:
+	std::string m_Path;
+	std::vector<char> m_Data;
+	bool m_Read = false;
+};
+
+// co_await WaitAsync(ready): resumes once ready() returns true, which the async I/O thread polls. ready has to be
+// thread safe and cheap (a fence status, a timeline value)
+class WaitAsync
+{
+public:
+	explicit WaitAsync(std::function<bool()> ready) : m_Ready(std::move(ready)) {}
+	bool await_ready() { return m_Ready(); }
+	void await_suspend(std::coroutine_handle<> handle);
+	void await_resume() const noexcept {}
+protected:
+	std::function<bool()> m_Ready;
+};
+
+// runs every task, each from a worker, and ends when all of them have; rethrows the first exception in task order
+Task<void> WhenAll(std::vector<Task<void>> tasks);
+
+// runs jobs on the calling thread until done is set
+void HelpJobsUntil(const std::atomic<bool>& done);
+
+template <class T>
+DetachedTask SignalWhenDone(Task<T>& task, std::atomic<bool>& done)
+{
+	try { co_await task; }
+	catch (...) {}									// kept in the task, SyncWait rethrows it
+	done.store(true, std::memory_order_release);
+}
+
+// runs task from plain code: starts it on the calling thread and helps the job manager until it is done
+template <class T>
+T SyncWait(Task<T> task)
+{
+	std::atomic<bool> done{ false };
+	SignalWhenDone(task, done);
+	HelpJobsUntil(done);
+	return task.await_resume();
+}
@@ -0,0 +1,688 @@
+#include "precomp.h"
+#include "texture.h"
+
+#include <bit>
+#include <cfloat>
+#include <climits>
+
+#pragma region block helpers
+// the 16 texels of a 4x4 block as channel planes (r, g, b, a), texels outside the image repeat the edge
+struct BlockPixels {
+	alignas(64) int32_t c[4][16];
+};
+
+static void LoadBlock(const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t bx, uint32_t by, BlockPixels& block) {
+	for (uint32_t i = 0; i < 16; i++) {
+		uint32_t x = std::min(bx * 4 + (i & 3), width - 1), y = std::min(by * 4 + (i >> 2), height - 1);
+		const uint8_t* texel = pixels + ((size_t)y * width + x) * 4;
+		for (int c = 0; c < 4; c++) block.c[c][i] = texel[c];
+	}
+}
+
+static void StoreBlock(const uint8_t decoded[16][4], uint32_t width, uint32_t height, uint32_t bx, uint32_t by, uint8_t* pixels) {
+	for (uint32_t i = 0; i < 16; i++) {
+		uint32_t x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+		if (x < width && y < height) memcpy(pixels + ((size_t)y * width + x) * 4, decoded[i], 4);
+	}
+}
+
+// principal axis fit of the texels in mask: endpoints receive the extremes of their projection onto the axis
+static void FitLine(const BlockPixels& block, uint32_t mask, float endpoints[2][4]) {
+	float mean[4] = {}, count = 0.0f;
+	for (int i = 0; i < 16; i++)
+		if (mask >> i & 1) {
+			for (int c = 0; c < 4; c++) mean[c] += (float)block.c[c][i];
+			count += 1.0f;
+		}
+	for (int c = 0; c < 4; c++) mean[c] /= count;
+
+	float cov[4][4] = {};
+	for (int i = 0; i < 16; i++)
+		if (mask >> i & 1)
+			for (int a = 0; a < 4; a++) {
+				float da = block.c[a][i] - mean[a];
+				for (int b = a; b < 4; b++) cov[a][b] += da * (block.c[b][i] - mean[b]);
+			}
+	for (int a = 0; a < 4; a++)
+		for (int b = 0; b < a; b++) cov[a][b] = cov[b][a];
+
+	// power iteration from the row of the channel with the largest variance
+	int start = 0;
+	for (int c = 1; c < 4; c++) if (cov[c][c] > cov[start][start]) start = c;
+	float axis[4] = { cov[start][0], cov[start][1], cov[start][2], cov[start][3] };
+	for (int it = 0; it < 8; it++) {
+		float next[4], scale = 0.0f;
+		for (int a = 0; a < 4; a++) {
+			next[a] = cov[a][0] * axis[0] + cov[a][1] * axis[1] + cov[a][2] * axis[2] + cov[a][3] * axis[3];
+			scale = std::max(scale, std::abs(next[a]));
+		}
+		if (scale == 0.0f) break;
+		for (int a = 0; a < 4; a++) axis[a] = next[a] / scale;
+	}
+	float length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2] + axis[3] * axis[3]);
+	if (length < 1e-6f) {
+		for (int c = 0; c < 4; c++) endpoints[0][c] = endpoints[1][c] = mean[c];
+		return;
+	}
+	for (int c = 0; c < 4; c++) axis[c] /= length;
+
+	float lo = FLT_MAX, hi = -FLT_MAX;
+	for (int i = 0; i < 16; i++)
+		if (mask >> i & 1) {
+			float t = 0.0f;
+			for (int c = 0; c < 4; c++) t += (block.c[c][i] - mean[c]) * axis[c];
+			lo = std::min(lo, t), hi = std::max(hi, t);
+		}
+	for (int c = 0; c < 4; c++) {
+		endpoints[0][c] = std::min(std::max(mean[c] + axis[c] * lo, 0.0f), 255.0f);
+		endpoints[1][c] = std::min(std::max(mean[c] + axis[c] * hi, 0.0f), 255.0f);
+	}
+}
+
+// least squares endpoints for fixed indices, weights[index] is the share of endpoint 1 in that palette entry
+static bool RefineEndpoints(const BlockPixels& block, uint32_t mask, const uint8_t* indices, const float* weights, float endpoints[2][4]) {
+	float aa = 0.0f, ab = 0.0f, bb = 0.0f, pa[4] = {}, pb[4] = {};
+	for (int i = 0; i < 16; i++)
+		if (mask >> i & 1) {
+			float w = weights[indices[i]], v = 1.0f - w;
+			aa += v * v, ab += v * w, bb += w * w;
+			for (int c = 0; c < 4; c++) pa[c] += v * block.c[c][i], pb[c] += w * block.c[c][i];
+		}
+	float det = aa * bb - ab * ab;
+	if (std::abs(det) < 1e-6f)
+		return false;
+	for (int c = 0; c < 4; c++) {
+		endpoints[0][c] = std::min(std::max((bb * pa[c] - ab * pb[c]) / det, 0.0f), 255.0f);
+		endpoints[1][c] = std::min(std::max((aa * pb[c] - ab * pa[c]) / det, 0.0f), 255.0f);
+	}
+	return true;
+}
+
+// 128 bit block, written and read least significant bit first
+struct BlockBits {
+	uint64_t bits[2] = {};
+	uint32_t position = 0;
+
+	void Write(uint32_t value, uint32_t count) {
+		for (uint32_t i = 0; i < count; i++, position++) bits[position >> 6] |= (uint64_t)(value >> i & 1) << (position & 63);
+	}
+	uint32_t Read(uint32_t count) {
+		uint32_t value = 0;
+		for (uint32_t i = 0; i < count; i++, position++) value |= (uint32_t)(bits[position >> 6] >> (position & 63) & 1) << i;
+		return value;
+	}
+};
+#pragma endregion
+
+// the index search is where the encoders spend their time: every texel in mask gets the nearest of count palette
+// entries (squared rgba distance, the first entry wins ties) and the summed error is returned. all versions
+// compute in integers, so they pick the same indices
+#pragma region index search kernels
+typedef uint32_t (*FindIndicesFn)(const BlockPixels& block, const int32_t (*palette)[4], int count, uint32_t mask, uint8_t* indices);
+
+static uint32_t StoreIndices(const int32_t* error, const int32_t* index, uint32_t mask, uint8_t* indices) {
+	uint32_t total = 0;
+	for (int i = 0; i < 16; i++)
+		if (mask >> i & 1) {
+			indices[i] = static_cast<uint8_t>(index[i]);
+			total += error[i];
+		}
+	return total;
+}
+
+static uint32_t FindIndicesScalar(const BlockPixels& block, const int32_t (*palette)[4], int count, uint32_t mask, uint8_t* indices) {
+	uint32_t total = 0;
+	for (int i = 0; i < 16; i++) {
+		if (!(mask >> i & 1)) continue;
+		int32_t best = INT_MAX, bestIndex = 0;
+		for (int p = 0; p < count; p++) {
+			int32_t dr = block.c[0][i] - palette[p][0], dg = block.c[1][i] - palette[p][1];
+			int32_t db = block.c[2][i] - palette[p][2], da = block.c[3][i] - palette[p][3];
+			int32_t error = dr * dr + dg * dg + db * db + da * da;
+			if (error < best) best = error, bestIndex = p;
+		}
+		indices[i] = static_cast<uint8_t>(bestIndex);
+		total += best;
+	}
+	return total;
+}
+
+TARGET_SSE41 static uint32_t FindIndicesSSE41(const BlockPixels& block, const int32_t (*palette)[4], int count, uint32_t mask, uint8_t* indices) {
+	alignas(16) int32_t best[16], bestIndex[16];
+	for (int g = 0; g < 16; g += 4) {
+		__m128i r = _mm_load_si128(reinterpret_cast<const __m128i*>(block.c[0] + g)), gr = _mm_load_si128(reinterpret_cast<const __m128i*>(block.c[1] + g));
+		__m128i b = _mm_load_si128(reinterpret_cast<const __m128i*>(block.c[2] + g)), a = _mm_load_si128(reinterpret_cast<const __m128i*>(block.c[3] + g));
+		__m128i minError = _mm_set1_epi32(INT_MAX), minIndex = _mm_setzero_si128();
+		for (int p = 0; p < count; p++) {
+			__m128i dr = _mm_sub_epi32(r, _mm_set1_epi32(palette[p][0])), dg = _mm_sub_epi32(gr, _mm_set1_epi32(palette[p][1]));
+			__m128i db = _mm_sub_epi32(b, _mm_set1_epi32(palette[p][2])), da = _mm_sub_epi32(a, _mm_set1_epi32(palette[p][3]));
+			__m128i error = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)),
+				_mm_add_epi32(_mm_mullo_epi32(db, db), _mm_mullo_epi32(da, da)));
+			minIndex = _mm_blendv_epi8(minIndex, _mm_set1_epi32(p), _mm_cmplt_epi32(error, minError));
+			minError = _mm_min_epi32(error, minError);
+		}
+		_mm_store_si128(reinterpret_cast<__m128i*>(best + g), minError);
+		_mm_store_si128(reinterpret_cast<__m128i*>(bestIndex + g), minIndex);
+	}
+	return StoreIndices(best, bestIndex, mask, indices);
+}
+
+TARGET_AVX2 static uint32_t FindIndicesAVX2(const BlockPixels& block, const int32_t (*palette)[4], int count, uint32_t mask, uint8_t* indices) {
+	alignas(32) int32_t best[16], bestIndex[16];
+	for (int g = 0; g < 16; g += 8) {
+		__m256i r = _mm256_load_si256(reinterpret_cast<const __m256i*>(block.c[0] + g)), gr = _mm256_load_si256(reinterpret_cast<const __m256i*>(block.c[1] + g));
+		__m256i b = _mm256_load_si256(reinterpret_cast<const __m256i*>(block.c[2] + g)), a = _mm256_load_si256(reinterpret_cast<const __m256i*>(block.c[3] + g));
+		__m256i minError = _mm256_set1_epi32(INT_MAX), minIndex = _mm256_setzero_si256();
+		for (int p = 0; p < count; p++) {
+			__m256i dr = _mm256_sub_epi32(r, _mm256_set1_epi32(palette[p][0])), dg = _mm256_sub_epi32(gr, _mm256_set1_epi32(palette[p][1]));
+			__m256i db = _mm256_sub_epi32(b, _mm256_set1_epi32(palette[p][2])), da = _mm256_sub_epi32(a, _mm256_set1_epi32(palette[p][3]));
+			__m256i error = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)),
+				_mm256_add_epi32(_mm256_mullo_epi32(db, db), _mm256_mullo_epi32(da, da)));
+			minIndex = _mm256_blendv_epi8(minIndex, _mm256_set1_epi32(p), _mm256_cmpgt_epi32(minError, error));
+			minError = _mm256_min_epi32(error, minError);
+		}
+		_mm256_store_si256(reinterpret_cast<__m256i*>(best + g), minError);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(bestIndex + g), minIndex);
+	}
+	return StoreIndices(best, bestIndex, mask, indices);
+}
+
+// the whole block in one register
+TARGET_AVX512 static uint32_t FindIndicesAVX512(const BlockPixels& block, const int32_t (*palette)[4], int count, uint32_t mask, uint8_t* indices) {
+	alignas(64) int32_t best[16], bestIndex[16];
+	__m512i r = _mm512_load_si512(block.c[0]), g = _mm512_load_si512(block.c[1]), b = _mm512_load_si512(block.c[2]), a = _mm512_load_si512(block.c[3]);
+	__m512i minError = _mm512_set1_epi32(INT_MAX), minIndex = _mm512_setzero_si512();
+	for (int p = 0; p < count; p++) {
+		__m512i dr = _mm512_sub_epi32(r, _mm512_set1_epi32(palette[p][0])), dg = _mm512_sub_epi32(g, _mm512_set1_epi32(palette[p][1]));
+		__m512i db = _mm512_sub_epi32(b, _mm512_set1_epi32(palette[p][2])), da = _mm512_sub_epi32(a, _mm512_set1_epi32(palette[p][3]));
+		__m512i error = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(dr, dr), _mm512_mullo_epi32(dg, dg)),
+			_mm512_add_epi32(_mm512_mullo_epi32(db, db), _mm512_mullo_epi32(da, da)));
+		minIndex = _mm512_mask_mov_epi32(minIndex, _mm512_cmplt_epi32_mask(error, minError), _mm512_set1_epi32(p));
+		minError = _mm512_min_epi32(error, minError);
+	}
+	_mm512_store_si512(best, minError);
+	_mm512_store_si512(bestIndex, minIndex);
+	return StoreIndices(best, bestIndex, mask, indices);
+}
+
+static const FindIndicesFn s_FindIndices[] = { FindIndicesScalar, FindIndicesSSE41, FindIndicesAVX2, FindIndicesAVX512 };
+#pragma endregion
+
+#pragma region BC1
+static const float s_Bc1Weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+static uint32_t PackRgb565(const float color[4]) {
+	uint32_t r = static_cast<uint32_t>(color[0] * 31.0f / 255.0f + 0.5f);
+	uint32_t g = static_cast<uint32_t>(color[1] * 63.0f / 255.0f + 0.5f);
+	uint32_t b = static_cast<uint32_t>(color[2] * 31.0f / 255.0f + 0.5f);
+	return r << 11 | g << 5 | b;
+}
+
+static void UnpackRgb565(uint32_t packed, int32_t color[4]) {
+	uint32_t r = packed >> 11 & 31, g = packed >> 5 & 63, b = packed & 31;
+	color[0] = r << 3 | r >> 2;
+	color[1] = g << 2 | g >> 4;
+	color[2] = b << 3 | b >> 2;
+	color[3] = 255;
+}
+
+// four color mode palette: the endpoints, then 2/3 e0 + 1/3 e1 and 1/3 e0 + 2/3 e1
+static void GetBc1Palette(uint32_t color0, uint32_t color1, int32_t palette[4][4]) {
+	UnpackRgb565(color0, palette[0]);
+	UnpackRgb565(color1, palette[1]);
+	for (int c = 0; c < 4; c++) {
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+}
+
+static void EncodeBc1(FindIndicesFn findIndices, BlockQuality quality, const BlockPixels& block, uint8_t* out) {
+	float endpoints[2][4];
+	FitLine(block, 0xffff, endpoints);
+
+	uint32_t bestError = UINT_MAX, bestColors[2] = {};
+	uint8_t bestIndices[16] = {}, indices[16];
+	const int iterations = quality == BlockQuality::Fast ? 1 : quality == BlockQuality::Normal ? 2 : 4;
+	for (int it = 0; it < iterations; it++) {
+		uint32_t colors[2] = { PackRgb565(endpoints[0]), PackRgb565(endpoints[1]) };
+		int32_t palette[4][4];
+		GetBc1Palette(colors[0], colors[1], palette);
+		uint32_t error = findIndices(block, palette, 4, 0xffff, indices);
+		if (error < bestError) {
+			bestError = error;
+			memcpy(bestColors, colors, sizeof(colors));
+			memcpy(bestIndices, indices, sizeof(indices));
+		}
+		if (bestError == 0 || !RefineEndpoints(block, 0xffff, bestIndices, s_Bc1Weights, endpoints))
+			break;
+	}
+
+	// color0 > color1 selects the four color mode; equal colors only decode as such with every index 0
+	if (bestColors[0] < bestColors[1]) {
+		std::swap(bestColors[0], bestColors[1]);
+		for (int i = 0; i < 16; i++) bestIndices[i] ^= 1;
+	}
+	else if (bestColors[0] == bestColors[1])
+		memset(bestIndices, 0, sizeof(bestIndices));
+
+	uint32_t bits = 0;
+	for (int i = 0; i < 16; i++) bits |= (uint32_t)bestIndices[i] << (i * 2);
+	const uint32_t words[2] = { bestColors[0] | bestColors[1] << 16, bits };
+	memcpy(out, words, 8);
+}
+
+static void DecodeBc1(const uint8_t* in, uint8_t out[16][4]) {
+	uint32_t words[2];
+	memcpy(words, in, 8);
+	uint32_t color0 = words[0] & 0xffff, color1 = words[0] >> 16;
+	int32_t palette[4][4];
+	GetBc1Palette(color0, color1, palette);
+	if (color0 <= color1) {
+		// three color mode, index 3 is black (and transparent for the rgba formats)
+		for (int c = 0; c < 3; c++) palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+		palette[3][0] = palette[3][1] = palette[3][2] = 0;
+	}
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 4; c++) out[i][c] = static_cast<uint8_t>(palette[words[1] >> (i * 2) & 3][c]);
+}
+#pragma endregion
+
+#pragma region BC7
+// the modes the encoder uses: 6 (one subset rgba 7.7.7.7 + endpoint p-bits, 4 bit indices) for everything,
+// 1 (two subsets rgb 6.6.6 + shared p-bits, 3 bit indices) and 3 (two subsets rgb 7.7.7 + endpoint p-bits, 2 bit
+// indices) for opaque blocks, 7 (two subsets rgba 5.5.5.5 + endpoint p-bits, 2 bit indices) for blocks with alpha
+enum Bc7PBits { PBitsNone, PBitsEndpoint, PBitsShared };
+
+struct Bc7Mode {
+	uint32_t mode;
+	uint32_t subsets;
+	uint32_t colorBits;
+	uint32_t alphaBits;
+	Bc7PBits pbits;
+	uint32_t indexBits;
+};
+
+static const Bc7Mode s_Bc7Mode1 = { 1, 2, 6, 0, PBitsShared, 3 };
+static const Bc7Mode s_Bc7Mode3 = { 3, 2, 7, 0, PBitsEndpoint, 2 };
+static const Bc7Mode s_Bc7Mode6 = { 6, 1, 7, 7, PBitsEndpoint, 4 };
+static const Bc7Mode s_Bc7Mode7 = { 7, 2, 5, 5, PBitsEndpoint, 2 };
+static const Bc7Mode* const s_Bc7Modes[] = { &s_Bc7Mode1, &s_Bc7Mode3, &s_Bc7Mode6, &s_Bc7Mode7 };
+
+// two subset partitions, bit i set when texel i belongs to subset 1
+static const uint16_t s_Bc7Partitions[64] = {
+	0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80, 0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8, 0xff00, 0xfff0, 0xf000,
+	0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce, 0x088c, 0x3110, 0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c,
+	0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696, 0xa55a, 0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660,
+	0x0272, 0x04e4, 0x4e40, 0x2720, 0xc936, 0x936c, 0x39c6, 0x639c, 0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22,
+};
+
+// anchor texel of subset 1 (subset 0 always anchors at texel 0), its index is stored without the top bit
+static const uint8_t s_Bc7Anchors[64] = {
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+	15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+	 6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15,
+};
+
+static const int32_t s_Bc7Weights2[4] = { 0, 21, 43, 64 };
+static const int32_t s_Bc7Weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+static const int32_t s_Bc7Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static const int32_t* GetBc7Weights(uint32_t indexBits) {
+	return indexBits == 2 ? s_Bc7Weights2 : indexBits == 3 ? s_Bc7Weights3 : s_Bc7Weights4;
+}
+
+static uint32_t GetSubsetMask(uint32_t partition, uint32_t subset, uint32_t subsets) {
+	if (subsets == 1) return 0xffff;
+	return subset ? s_Bc7Partitions[partition] : ~s_Bc7Partitions[partition] & 0xffff;
+}
+
+// endpoint channel of bits (+ p-bit when pbit >= 0) expanded to 8 bits by replicating the top bits
+static int32_t ExpandChannel(int32_t value, int32_t bits, int32_t pbit) {
+	if (pbit >= 0) value = value << 1 | pbit, bits++;
+	value <<= 8 - bits;
+	return value | value >> bits;
+}
+
+static int32_t QuantizeChannel(float value, int32_t bits, int32_t pbit) {
+	int32_t total = bits + (pbit >= 0 ? 1 : 0), maxValue = (1 << bits) - 1;
+	int32_t estimate = static_cast<int32_t>(value / 255.0f * ((1 << total) - 1) + 0.5f) >> (pbit >= 0 ? 1 : 0);
+	int32_t best = 0, bestError = INT_MAX;
+	for (int32_t q = std::max(estimate - 1, 0); q <= std::min(estimate + 1, maxValue); q++) {
+		int32_t error = std::abs(ExpandChannel(q, bits, pbit) - static_cast<int32_t>(value + 0.5f));
+		if (error < bestError) best = q, bestError = error;
+	}
+	return best;
+}
+
+struct Bc7Subset {
+	int32_t endpoints[2][4];				// quantized, alpha is unused by the opaque modes
+	int32_t pbits[2];
+};
+
+struct Bc7Block {
+	const Bc7Mode* mode = nullptr;
+	uint32_t partition = 0;
+	Bc7Subset subsets[2];
+	uint8_t indices[16];
+	uint32_t error = UINT_MAX;
+};
+
+// builds the palette of one subset from its quantized endpoints
+static void GetBc7Palette(const Bc7Mode& mode, const Bc7Subset& subset, int32_t palette[16][4]) {
+	int32_t colors[2][4];
+	for (int e = 0; e < 2; e++) {
+		for (int c = 0; c < 3; c++) colors[e][c] = ExpandChannel(subset.endpoints[e][c], mode.colorBits, mode.pbits == PBitsNone ? -1 : subset.pbits[e]);
+		colors[e][3] = mode.alphaBits ? ExpandChannel(subset.endpoints[e][3], mode.alphaBits, mode.pbits == PBitsNone ? -1 : subset.pbits[e]) : 255;
+	}
+	const int32_t* weights = GetBc7Weights(mode.indexBits);
+	for (uint32_t k = 0; k < (1u << mode.indexBits); k++)
+		for (int c = 0; c < 4; c++) palette[k][c] = ((64 - weights[k]) * colors[0][c] + weights[k] * colors[1][c] + 32) >> 6;
+}
+
+// fits, quantizes (trying every p-bit combination) and refines the endpoints of the texels in mask
+static uint32_t EncodeBc7Subset(FindIndicesFn findIndices, BlockQuality quality, const Bc7Mode& mode, const BlockPixels& block,
+	uint32_t mask, Bc7Subset& result, uint8_t* indices) {
+	float endpoints[2][4];
+	FitLine(block, mask, endpoints);
+
+	float weights[16];
+	const int32_t* intWeights = GetBc7Weights(mode.indexBits);
+	for (uint32_t k = 0; k < (1u << mode.indexBits); k++) weights[k] = intWeights[k] / 64.0f;
+
+	uint32_t bestError = UINT_MAX;
+	uint8_t candidate[16];
+	const int combinations = mode.pbits == PBitsEndpoint ? 4 : mode.pbits == PBitsShared ? 2 : 1;
+	const int iterations = quality == BlockQuality::Fast ? 1 : quality == BlockQuality::Normal ? 2 : 3;
+	for (int it = 0; it < iterations; it++) {
+		for (int combination = 0; combination < combinations; combination++) {
+			Bc7Subset subset;
+			subset.pbits[0] = mode.pbits == PBitsNone ? -1 : combination & 1;
+			subset.pbits[1] = mode.pbits == PBitsEndpoint ? combination >> 1 : subset.pbits[0];
+			for (int e = 0; e < 2; e++) {
+				for (int c = 0; c < 3; c++) subset.endpoints[e][c] = QuantizeChannel(endpoints[e][c], mode.colorBits, subset.pbits[e]);
+				subset.endpoints[e][3] = mode.alphaBits ? QuantizeChannel(endpoints[e][3], mode.alphaBits, subset.pbits[e]) : 0;
+			}
+			int32_t palette[16][4];
+			GetBc7Palette(mode, subset, palette);
+			uint32_t error = findIndices(block, palette, 1 << mode.indexBits, mask, candidate);
+			if (error < bestError) {
+				bestError = error;
+				result = subset;
+				for (int i = 0; i < 16; i++) if (mask >> i & 1) indices[i] = candidate[i];
+			}
+		}
+		if (bestError == 0 || it + 1 == iterations || !RefineEndpoints(block, mask, indices, weights, endpoints))
+			break;
+	}
+	return bestError;
+}
+
+static void EncodeBc7Mode(FindIndicesFn findIndices, BlockQuality quality, const Bc7Mode& mode, uint32_t partition, const BlockPixels& block, Bc7Block& best) {
+	Bc7Block candidate;
+	candidate.mode = &mode;
+	candidate.partition = partition;
+	candidate.error = 0;
+	for (uint32_t s = 0; s < mode.subsets && candidate.error < best.error; s++)
+		candidate.error += EncodeBc7Subset(findIndices, quality, mode, block, GetSubsetMask(partition, s, mode.subsets), candidate.subsets[s], candidate.indices);
+	if (candidate.error < best.error)
+		best = candidate;
+}
+
+static void PackBc7(Bc7Block& block, uint8_t* out) {
+	const Bc7Mode& mode = *block.mode;
+	const uint32_t maxIndex = (1u << mode.indexBits) - 1;
+
+	// the top index bit of every anchor texel is implicit zero: swap the endpoints of a subset where it is not
+	for (uint32_t s = 0; s < mode.subsets; s++) {
+		uint32_t anchor = s == 0 ? 0 : s_Bc7Anchors[block.partition];
+		if (block.indices[anchor] <= maxIndex >> 1) continue;
+		Bc7Subset& subset = block.subsets[s];
+		std::swap(subset.endpoints[0], subset.endpoints[1]);
+		std::swap(subset.pbits[0], subset.pbits[1]);
+		uint32_t mask = GetSubsetMask(block.partition, s, mode.subsets);
+		for (int i = 0; i < 16; i++) if (mask >> i & 1) block.indices[i] = static_cast<uint8_t>(maxIndex - block.indices[i]);
+	}
+
+	BlockBits bits;
+	bits.Write(1u << mode.mode, mode.mode + 1);
+	if (mode.subsets > 1) bits.Write(block.partition, 6);
+	for (int c = 0; c < (mode.alphaBits ? 4 : 3); c++)
+		for (uint32_t s = 0; s < mode.subsets; s++)
+			for (int e = 0; e < 2; e++) bits.Write(block.subsets[s].endpoints[e][c], c < 3 ? mode.colorBits : mode.alphaBits);
+	for (uint32_t s = 0; s < mode.subsets; s++) {
+		if (mode.pbits == PBitsEndpoint) bits.Write(block.subsets[s].pbits[0], 1), bits.Write(block.subsets[s].pbits[1], 1);
+		else if (mode.pbits == PBitsShared) bits.Write(block.subsets[s].pbits[0], 1);
+	}
+	for (uint32_t i = 0; i < 16; i++) {
+		bool anchor = i == 0 || (mode.subsets > 1 && i == s_Bc7Anchors[block.partition]);
+		bits.Write(block.indices[i], mode.indexBits - (anchor ? 1 : 0));
+	}
+	memcpy(out, bits.bits, 16);
+}
+
+// squared distance to the best fitting line for both subsets of every two subset partition: the sums of the texels
+// and of their channel products are accumulated once per partition for subset 1, subset 0 gets the rest
+static void EstimatePartitionErrors(const BlockPixels& block, float errors[64]) {
+	float products[16][14], total[14] = {};
+	for (int i = 0; i < 16; i++) {
+		float* p = products[i];
+		for (int c = 0; c < 4; c++) p[c] = (float)block.c[c][i];
+		for (int a = 0, k = 4; a < 4; a++)
+			for (int b = a; b < 4; b++) p[k++] = p[a] * p[b];
+		for (int k = 0; k < 14; k++) total[k] += p[k];
+	}
+
+	for (uint32_t partition = 0; partition < 64; partition++) {
+		float sums[2][14] = {};
+		uint32_t mask = s_Bc7Partitions[partition];
+		for (int i = 0; i < 16; i++)
+			if (mask >> i & 1)
+				for (int k = 0; k < 14; k++) sums[1][k] += products[i][k];
+		for (int k = 0; k < 14; k++) sums[0][k] = total[k] - sums[1][k];
+		float counts[2] = { (float)(16 - std::popcount(mask)), (float)std::popcount(mask) };
+
+		errors[partition] = 0.0f;
+		for (int s = 0; s < 2; s++) {
+			float cov[4][4], trace = 0.0f;
+			for (int a = 0, k = 4; a < 4; a++)
+				for (int b = a; b < 4; b++, k++) cov[a][b] = cov[b][a] = sums[s][k] - sums[s][a] * sums[s][b] / counts[s];
+			for (int c = 0; c < 4; c++) trace += cov[c][c];
+
+			// largest eigenvalue by a few power iterations, the residual is what the line does not explain
+			float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f }, lambda = 0.0f;
+			for (int it = 0; it < 3; it++) {
+				float next[4], length = 0.0f;
+				for (int a = 0; a < 4; a++) {
+					next[a] = cov[a][0] * axis[0] + cov[a][1] * axis[1] + cov[a][2] * axis[2] + cov[a][3] * axis[3];
+					length += next[a] * next[a];
+				}
+				if (length == 0.0f) break;
+				float inverse = 1.0f / std::sqrt(length);
+				for (int a = 0; a < 4; a++) axis[a] = next[a] * inverse;
+			}
+			for (int a = 0; a < 4; a++)
+				lambda += axis[a] * (cov[a][0] * axis[0] + cov[a][1] * axis[1] + cov[a][2] * axis[2] + cov[a][3] * axis[3]);
+			errors[partition] += std::max(trace - lambda, 0.0f);
+		}
+	}
+}
+
+static void EncodeBc7(FindIndicesFn findIndices, BlockQuality quality, const BlockPixels& block, uint8_t* out) {
+	bool opaque = true;
+	for (int i = 0; i < 16; i++) opaque &= block.c[3][i] == 255;
+
+	Bc7Block best;
+	EncodeBc7Mode(findIndices, quality, s_Bc7Mode6, 0, block, best);
+
+	// two subsets only pay off where one line leaves a visible error (more than one unit per texel on average)
+	if (quality != BlockQuality::Fast && best.error > 16) {
+		// rank the partitions by how well two lines fit them and encode only the most promising ones
+		const uint32_t candidates = quality == BlockQuality::Normal ? 2 : 8;
+		float errors[64];
+		EstimatePartitionErrors(block, errors);
+		std::pair<float, uint32_t> ranked[64];
+		for (uint32_t p = 0; p < 64; p++) ranked[p] = { errors[p], p };
+		std::partial_sort(ranked, ranked + candidates, ranked + 64);
+
+		const Bc7Mode* opaqueModes[] = { &s_Bc7Mode1, &s_Bc7Mode3 };
+		const Bc7Mode* alphaModes[] = { &s_Bc7Mode7 };
+		const Bc7Mode* const* modes = opaque ? opaqueModes : alphaModes;
+		uint32_t modeCount = opaque ? (quality == BlockQuality::High ? 2 : 1) : 1;
+		for (uint32_t m = 0; m < modeCount; m++)
+			for (uint32_t c = 0; c < candidates; c++) EncodeBc7Mode(findIndices, quality, *modes[m], ranked[c].second, block, best);
+	}
+	PackBc7(best, out);
+}
+
+static void DecodeBc7(const uint8_t* in, uint8_t out[16][4]) {
+	BlockBits bits;
+	memcpy(bits.bits, in, 16);
+	uint32_t modeNumber = 0;
+	while (modeNumber < 8 && !bits.Read(1)) modeNumber++;
+
+	const Bc7Mode* found = nullptr;
+	for (const Bc7Mode* mode : s_Bc7Modes) if (mode->mode == modeNumber) found = mode;
+	if (!found) {
+		memset(out, 0, 64);
+		return;
+	}
+
+	const Bc7Mode& mode = *found;
+	Bc7Block block;
+	block.partition = mode.subsets > 1 ? bits.Read(6) : 0;
+	for (int c = 0; c < (mode.alphaBits ? 4 : 3); c++)
+		for (uint32_t s = 0; s < mode.subsets; s++)
+			for (int e = 0; e < 2; e++) block.subsets[s].endpoints[e][c] = bits.Read(c < 3 ? mode.colorBits : mode.alphaBits);
+	for (uint32_t s = 0; s < mode.subsets; s++) {
+		if (mode.pbits == PBitsEndpoint) block.subsets[s].pbits[0] = bits.Read(1), block.subsets[s].pbits[1] = bits.Read(1);
+		else if (mode.pbits == PBitsShared) block.subsets[s].pbits[0] = block.subsets[s].pbits[1] = bits.Read(1);
+	}
+	for (uint32_t i = 0; i < 16; i++) {
+		bool anchor = i == 0 || (mode.subsets > 1 && i == s_Bc7Anchors[block.partition]);
+		block.indices[i] = static_cast<uint8_t>(bits.Read(mode.indexBits - (anchor ? 1 : 0)));
+	}
+
+	int32_t palettes[2][16][4];
+	for (uint32_t s = 0; s < mode.subsets; s++) GetBc7Palette(mode, block.subsets[s], palettes[s]);
+	for (uint32_t i = 0; i < 16; i++) {
+		uint32_t s = mode.subsets > 1 ? s_Bc7Partitions[block.partition] >> i & 1 : 0;
+		for (int c = 0; c < 4; c++) out[i][c] = static_cast<uint8_t>(palettes[s][block.indices[i]][c]);
+	}
+}
+#pragma endregion
+
+#pragma region block compression
+uint64_t GetLevelSize(VkFormat format, uint32_t width, uint32_t height) {
+	if (!IsBlockFormat(format))
+		return (uint64_t)width * height * 4;
+	uint64_t blocks = (uint64_t)((width + 3) / 4) * ((height + 3) / 4);
+	bool bc1 = format <= VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+	return blocks * (bc1 ? 8 : 16);
+}
+
+const char* GetTextureFormatName(VkFormat format) {
+	switch (format) {
+	case VK_FORMAT_R8G8B8A8_SRGB: return "rgba8 srgb";
+	case VK_FORMAT_R8G8B8A8_UNORM: return "rgba8";
+	case VK_FORMAT_BC1_RGB_SRGB_BLOCK: return "bc1 srgb";
+	case VK_FORMAT_BC1_RGB_UNORM_BLOCK: return "bc1";
+	case VK_FORMAT_BC7_SRGB_BLOCK: return "bc7 srgb";
+	case VK_FORMAT_BC7_UNORM_BLOCK: return "bc7";
+	default: return "unknown";
+	}
+}
+
+const char* GetBlockQualityName(BlockQuality quality) {
+	switch (quality) {
+	case BlockQuality::Fast: return "fast";
+	case BlockQuality::Normal: return "normal";
+	default: return "high";
+	}
+}
+
+void CompressBlocks(const uint8_t* pixels, uint32_t width, uint32_t height, VkFormat format, uint8_t* blocks, const BlockOptions& options) {
+	const uint32_t blocksX = (width + 3) / 4, blockRows = (height + 3) / 4;
+	const bool bc1 = format <= VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+	const uint32_t blockSize = bc1 ? 8 : 16;
+	const FindIndicesFn findIndices = s_FindIndices[(int)std::min(options.simd, GetSimdLevel())];
+	// a block row is a ParallelFor piece, the encode cost varies too much from row to row for fixed bands
+	ParallelFor(0, blockRows, options.threadCount > 1 ? 1 : blockRows, [&](size_t firstRow, size_t endRow) {
+		BlockPixels block;
+		for (uint32_t by = (uint32_t)firstRow; by < endRow; by++)
+			for (uint32_t bx = 0; bx < blocksX; bx++) {
+				LoadBlock(pixels, width, height, bx, by, block);
+				uint8_t* out = blocks + ((size_t)by * blocksX + bx) * blockSize;
+				if (bc1) EncodeBc1(findIndices, options.quality, block, out);
+				else EncodeBc7(findIndices, options.quality, block, out);
+			}
+	});
+}
+
+void DecompressBlocks(const uint8_t* blocks, uint32_t width, uint32_t height, VkFormat format, uint8_t* pixels) {
+	const bool bc1 = format <= VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+	const uint32_t blocksX = (width + 3) / 4, blocksY = (height + 3) / 4, blockSize = bc1 ? 8 : 16;
+	uint8_t decoded[16][4];
+	for (uint32_t by = 0; by < blocksY; by++)
+		for (uint32_t bx = 0; bx < blocksX; bx++) {
+			const uint8_t* in = blocks + ((size_t)by * blocksX + bx) * blockSize;
+			if (bc1) DecodeBc1(in, decoded);
+			else DecodeBc7(in, decoded);
+			StoreBlock(decoded, width, height, bx, by, pixels);
+		}
+}
+
+bool IsOpaque(const uint8_t* pixels, uint32_t width, uint32_t height) {
+	for (size_t i = 3; i < (size_t)width * height * 4; i += 4)
+		if (pixels[i] != 255) return false;
+	return true;
+}
+
+float ComputePSNR(const uint8_t* a, const uint8_t* b, uint32_t width, uint32_t height) {
+	const int channels = IsOpaque(a, width, height) ? 3 : 4;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < (size_t)width * height; i++)
+		for (int c = 0; c < channels; c++) {
+			int d = (int)a[i * 4 + c] - (int)b[i * 4 + c];
+			sum += d * d;
+		}
+	if (sum == 0) return INFINITY;
+	double mse = (double)sum / ((double)width * height * channels);
+	return static_cast<float>(10.0 * std::log10(255.0 * 255.0 / mse));
+}
+
+void BenchmarkBlockCompression(const uint8_t* pixels, uint32_t width, uint32_t height) {
+	uint32_t threadCount = JobManager::GetJobManager()->GetNumThreads();
+	bool opaque = IsOpaque(pixels, width, height);
+	std::vector<uint8_t> decoded((size_t)width * height * 4);
+
+	std::cout << "BenchmarkBlockCompression: " << width << "x" << height << (opaque ? " opaque" : " with alpha") << ", best instruction set "
+		<< GetSimdLevelName(GetSimdLevel()) << '\n';
+	for (VkFormat format : { VK_FORMAT_BC1_RGB_SRGB_BLOCK, VK_FORMAT_BC7_SRGB_BLOCK }) {
+		if (format == VK_FORMAT_BC1_RGB_SRGB_BLOCK && !opaque) continue;
+		for (BlockQuality quality : { BlockQuality::Fast, BlockQuality::Normal, BlockQuality::High }) {
+			std::vector<uint8_t> reference(GetLevelSize(format, width, height)), blocks(reference.size());
+			float serial = 0.0f;
+			for (SimdLevel simd : { SimdLevel::Scalar, GetSimdLevel() })
+				for (uint32_t threads : { 1u, threadCount }) {
+					BlockOptions options;
+					options.quality = quality;
+					options.simd = simd;
+					options.threadCount = threads;
+
+					std::vector<uint8_t>& output = simd == SimdLevel::Scalar && threads == 1 ? reference : blocks;
+					Timer timer;
+					CompressBlocks(pixels, width, height, format, output.data(), options);
+					float seconds = timer.elapsed();
+					if (threads == 1) serial = seconds;
+
+					DecompressBlocks(output.data(), width, height, format, decoded.data());
+					std::cout << "  " << GetTextureFormatName(format) << ' ' << GetBlockQualityName(quality) << ' ' << GetSimdLevelName(simd) << ", "
+						<< threads << " thread(s): " << seconds * 1000.0f << " ms, " << (double)width * height / seconds / 1e6 << " Mpixel/s, x" << serial / seconds
+						<< " over 1 thread, PSNR "
+						<< ComputePSNR(pixels, decoded.data(), width, height) << " dB" << (output == reference ? "" : ", differs from scalar") << '\n';
+				}
+		}
+	}
+}
+#pragma endregion
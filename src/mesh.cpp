@@ -0,0 +1,1204 @@
+#include "precomp.h"
+#include "mesh.h"
+
+#include <filesystem>
+#include <charconv>
+#include <cfloat>
+#include <glm/gtc/packing.hpp>
+#define TINYOBJLOADER_IMPLEMENTATION
+#include <tiny_obj_loader.h>
+
+#pragma region mesh cache
+static int64_t GetFileTime(const std::string& file) {
+	return static_cast<int64_t>(std::filesystem::last_write_time(file).time_since_epoch().count());
+}
+
+static uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash) {
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+std::string GetMeshCachePath(const std::string& source) {
+	return source + ".meshcache";
+}
+
+bool LoadMeshCache(const std::string& source, VertexFormat vertexFormat, MappedFile& file, MeshData& mesh) {
+	std::string cachePath = GetMeshCachePath(source);
+
+	// no modification time ordering here: the header pins the source's size and time exactly
+	if (!FileExists(cachePath.c_str()))
+		return false;
+
+	if (!file.Open(cachePath.c_str()))
+		return false;
+
+	// anything that does not match exactly is treated as a stale cache, and nothing the draws take from the file is
+	// trusted: every array lies inside the file, every sub-mesh inside the index and vertex arrays, every LOD inside
+	// the sub-meshes
+	const size_t fileSize = file.GetSize();
+	if (fileSize < sizeof(MeshCacheHeader)) {
+		file.Close();
+		return false;
+	}
+
+	std::error_code ec;
+	const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(file.GetData());
+	auto fits = [fileSize](uint64_t offset, uint64_t count, uint64_t stride) {
+		return offset <= fileSize && count * stride <= fileSize - offset;
+	};
+	bool valid = header->magic == MESHCACHE_MAGIC &&
+		header->version == MESHCACHE_VERSION &&
+		header->vertexFormat == vertexFormat &&
+		header->vertexStride == Vertex::getStride(vertexFormat) &&
+		(header->indexType == VK_INDEX_TYPE_UINT16 || header->indexType == VK_INDEX_TYPE_UINT32) &&
+		fits(header->vertexOffset, header->vertexCount, header->vertexStride) &&
+		fits(header->indexOffset, header->indexCount, GetIndexSize(header->indexType)) &&
+		fits(header->subMeshOffset, header->subMeshCount, sizeof(SubMesh)) && header->subMeshOffset % alignof(SubMesh) == 0 &&
+		header->lodCount > 0 && fits(header->lodOffset, header->lodCount, sizeof(MeshLod)) && header->lodOffset % alignof(MeshLod) == 0 &&
+		header->sourceSize == std::filesystem::file_size(source, ec) && !ec &&
+		header->sourceTime == GetFileTime(source);
+
+	// only built once the offsets are known to lie inside the file
+	const SubMesh* subMeshes = valid ? reinterpret_cast<const SubMesh*>(file.GetData() + header->subMeshOffset) : nullptr;
+	for (uint32_t i = 0; valid && i < header->subMeshCount; i++) {
+		const SubMesh& subMesh = subMeshes[i];
+		valid = subMesh.firstIndex <= header->indexCount && subMesh.indexCount <= header->indexCount - subMesh.firstIndex &&
+			subMesh.vertexOffset >= 0 && (uint32_t)subMesh.vertexOffset <= header->vertexCount &&
+			subMesh.vertexCount <= header->vertexCount - (uint32_t)subMesh.vertexOffset;
+	}
+	const MeshLod* lods = valid ? reinterpret_cast<const MeshLod*>(file.GetData() + header->lodOffset) : nullptr;
+	for (uint32_t i = 0; valid && i < header->lodCount; i++)
+		valid = lods[i].firstSubMesh <= header->subMeshCount && lods[i].subMeshCount <= header->subMeshCount - lods[i].firstSubMesh;
+
+	if (!valid) {
+		file.Close();
+		return false;
+	}
+
+	mesh.vertexFormat = header->vertexFormat;
+	mesh.vertexTransform = header->vertexTransform;
+	mesh.vertices = file.GetData() + header->vertexOffset;
+	mesh.vertexCount = header->vertexCount;
+	mesh.indexType = header->indexType;
+	mesh.indices = file.GetData() + header->indexOffset;
+	mesh.indexCount = header->indexCount;
+	mesh.subMeshes = subMeshes;
+	mesh.subMeshCount = header->subMeshCount;
+	mesh.lods = lods;
+	mesh.lodCount = header->lodCount;
+	memcpy(mesh.boundsCenter, header->boundsCenter, sizeof(mesh.boundsCenter));
+	mesh.boundsRadius = header->boundsRadius;
+
+	return true;
+}
+
+bool SaveMeshCache(const std::string& source, const MeshData& mesh) {
+	std::error_code ec;
+	uint64_t sourceSize = std::filesystem::file_size(source, ec);
+	if (ec)
+		return false;
+
+	MeshCacheHeader header{};
+	header.magic = MESHCACHE_MAGIC;
+	header.version = MESHCACHE_VERSION;
+	header.vertexFormat = mesh.vertexFormat;
+	header.vertexStride = Vertex::getStride(mesh.vertexFormat);
+	header.vertexCount = mesh.vertexCount;
+	header.indexCount = mesh.indexCount;
+	header.vertexTransform = mesh.vertexTransform;
+	header.indexType = mesh.indexType;
+	header.subMeshCount = mesh.subMeshCount;
+	header.lodCount = mesh.lodCount;
+	header.boundsRadius = mesh.boundsRadius;
+	memcpy(header.boundsCenter, mesh.boundsCenter, sizeof(header.boundsCenter));
+	header.vertexOffset = AlignUp(sizeof(MeshCacheHeader), MESHCACHE_ALIGN);
+	header.indexOffset = AlignUp(header.vertexOffset + (uint64_t)mesh.vertexCount * header.vertexStride, MESHCACHE_ALIGN);
+	header.subMeshOffset = AlignUp(header.indexOffset + (uint64_t)mesh.indexCount * GetIndexSize(mesh.indexType), MESHCACHE_ALIGN);
+	header.lodOffset = header.subMeshOffset + (uint64_t)mesh.subMeshCount * sizeof(SubMesh);
+	header.sourceSize = sourceSize;
+	header.sourceTime = GetFileTime(source);
+
+	std::string cachePath = GetMeshCachePath(source);
+	std::string tempPath = cachePath + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			return false;
+
+		const char padding[MESHCACHE_ALIGN] = {};
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(padding, header.vertexOffset - sizeof(header));
+		file.write(reinterpret_cast<const char*>(mesh.vertices), (std::streamsize)mesh.vertexCount * header.vertexStride);
+		file.write(padding, header.indexOffset - header.vertexOffset - (uint64_t)mesh.vertexCount * header.vertexStride);
+		file.write(reinterpret_cast<const char*>(mesh.indices), (std::streamsize)mesh.indexCount * GetIndexSize(mesh.indexType));
+		file.write(padding, header.subMeshOffset - header.indexOffset - (uint64_t)mesh.indexCount * GetIndexSize(mesh.indexType));
+		file.write(reinterpret_cast<const char*>(mesh.subMeshes), (std::streamsize)mesh.subMeshCount * sizeof(SubMesh));
+		file.write(reinterpret_cast<const char*>(mesh.lods), (std::streamsize)mesh.lodCount * sizeof(MeshLod));
+
+		if (!file.good())
+			return false;
+	}
+
+	std::filesystem::rename(tempPath, cachePath, ec);
+	if (ec) {
+		RemoveFile(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
+#pragma endregion
+
+#pragma region obj parser
+// one line aligned slice of the file, parsed by one job
+struct ObjChunk {
+	const char* begin;
+	const char* end;
+	// pass 1: element counts of this chunk
+	uint32_t positionCount, texcoordCount, triangleCount;
+	// prefix sums of the counts, where this chunk writes into ObjData
+	uint32_t positionBase, texcoordBase, triangleBase;
+	// first triangle of every quad, re-split once all positions are known
+	std::vector<uint32_t> quads;
+};
+
+class ObjParseJob : public Job
+{
+public:
+	void Main() override;
+	ObjChunk* m_Chunk;
+	ObjData* m_Obj;
+	int m_Pass;
+};
+
+static inline const char* SkipSpace(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	return p;
+}
+
+static inline const char* NextLine(const char* p, const char* end) {
+	const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+	return eol ? eol + 1 : end;
+}
+
+static inline const char* ParseFloat(const char* p, const char* end, float& value) {
+	p = SkipSpace(p, end);
+	if (p < end && *p == '+') p++;
+	// parse as double and narrow, the same rounding path as tinyobj
+	double d = 0.0;
+	auto result = std::from_chars(p, end, d);
+	value = static_cast<float>(d);
+	return result.ptr;
+}
+
+// a relative index reaching back before the first element; ParseObj rejects the file
+#define OBJ_BAD_INDEX 0xfffffffeu
+
+// resolves a 1-based (or negative, relative) OBJ index against the number of elements seen so far
+static inline uint32_t ResolveIndex(int index, uint32_t count) {
+	if (index > 0) return static_cast<uint32_t>(index - 1);
+	if (index < 0) return index < -static_cast<int64_t>(count) ? OBJ_BAD_INDEX : static_cast<uint32_t>(static_cast<int64_t>(count) + index);
+	return OBJ_NO_INDEX;
+}
+
+// parses one "v/vt/vn" corner, returns nullptr at the end of the face
+static inline const char* ParseCorner(const char* p, const char* end, int& v, int& vt) {
+	p = SkipSpace(p, end);
+	if (p >= end || *p == '\r' || *p == '\n' || *p == '#')
+		return nullptr;
+	v = vt = 0;
+	p = std::from_chars(p, end, v).ptr;
+	if (p < end && *p == '/') {
+		p++;
+		if (p < end && *p != '/')
+			p = std::from_chars(p, end, vt).ptr;
+		if (p < end && *p == '/') {
+			int vn;
+			p = std::from_chars(p + 1, end, vn).ptr;
+		}
+	}
+	// skip anything unparsable so a malformed corner cannot stall the loop
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+	return p;
+}
+
+void ObjParseJob::Main() {
+	ObjChunk& chunk = *m_Chunk;
+	const char* end = chunk.end;
+
+	if (m_Pass == 0) {
+		chunk.positionCount = chunk.texcoordCount = chunk.triangleCount = 0;
+		for (const char* line = chunk.begin; line < end; line = NextLine(line, end)) {
+			const char* p = SkipSpace(line, end);
+			if (end - p < 2) continue;
+			if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) chunk.positionCount++;
+			else if (p[0] == 'v' && p[1] == 't') chunk.texcoordCount++;
+			else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+				uint32_t corners = 0;
+				int v, vt;
+				for (p += 1; (p = ParseCorner(p, end, v, vt)) != nullptr;) corners++;
+				if (corners >= 3) chunk.triangleCount += corners - 2;
+			}
+		}
+		return;
+	}
+
+	if (m_Pass == 1) {
+		float* positions = m_Obj->positions.data() + 3 * (size_t)chunk.positionBase;
+		float* texcoords = m_Obj->texcoords.data() + 2 * (size_t)chunk.texcoordBase;
+		uint32_t* positionIndices = m_Obj->positionIndices.data() + 3 * (size_t)chunk.triangleBase;
+		uint32_t* texcoordIndices = m_Obj->texcoordIndices.data() + 3 * (size_t)chunk.triangleBase;
+		uint32_t positionCount = chunk.positionBase, texcoordCount = chunk.texcoordBase, triangle = chunk.triangleBase;
+
+		for (const char* line = chunk.begin; line < end; line = NextLine(line, end)) {
+			const char* p = SkipSpace(line, end);
+			if (end - p < 2) continue;
+			if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+				p = ParseFloat(p + 1, end, positions[0]);
+				p = ParseFloat(p, end, positions[1]);
+				ParseFloat(p, end, positions[2]);
+				positions += 3, positionCount++;
+			}
+			else if (p[0] == 'v' && p[1] == 't') {
+				p = ParseFloat(p + 2, end, texcoords[0]);
+				ParseFloat(p, end, texcoords[1]);
+				texcoords += 2, texcoordCount++;
+			}
+			else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+				// fan out the polygon while reading it, corner 0 and the previous corner are kept
+				uint32_t first[2] = {}, prev[2] = {}, corners = 0;
+				uint32_t faceStart = triangle;
+				int v, vt;
+				for (p += 1; (p = ParseCorner(p, end, v, vt)) != nullptr; corners++) {
+					uint32_t corner[2] = { ResolveIndex(v, positionCount), ResolveIndex(vt, texcoordCount) };
+					if (corners == 0) { first[0] = corner[0], first[1] = corner[1]; }
+					else if (corners >= 2) {
+						positionIndices[0] = first[0], positionIndices[1] = prev[0], positionIndices[2] = corner[0];
+						texcoordIndices[0] = first[1], texcoordIndices[1] = prev[1], texcoordIndices[2] = corner[1];
+						positionIndices += 3, texcoordIndices += 3, triangle++;
+					}
+					prev[0] = corner[0], prev[1] = corner[1];
+				}
+				if (corners == 4) chunk.quads.push_back(faceStart);
+			}
+		}
+		return;
+	}
+
+	// pass 2: quads get split along their shorter diagonal like tinyobj does, which needs every position
+	const std::vector<float>& positions = m_Obj->positions;
+	for (uint32_t quad : chunk.quads) {
+		uint32_t* pi = m_Obj->positionIndices.data() + 3 * (size_t)quad;
+		uint32_t* ti = m_Obj->texcoordIndices.data() + 3 * (size_t)quad;
+		// fanned as [0 1 2] [0 2 3]
+		uint32_t p4[4] = { pi[0], pi[1], pi[2], pi[5] }, t4[4] = { ti[0], ti[1], ti[2], ti[5] };
+		bool inRange = true;
+		for (uint32_t k = 0; k < 4; k++) inRange &= 3 * (size_t)p4[k] + 2 < positions.size();
+		if (!inRange) continue;
+		float sqr02 = 0.0f, sqr13 = 0.0f;
+		for (int k = 0; k < 3; k++) {
+			float e02 = positions[3 * p4[2] + k] - positions[3 * p4[0] + k];
+			float e13 = positions[3 * p4[3] + k] - positions[3 * p4[1] + k];
+			sqr02 += e02 * e02, sqr13 += e13 * e13;
+		}
+		if (sqr02 < sqr13) continue;
+		// [0 1 3] [1 2 3]
+		const uint32_t order[6] = { 0, 1, 3, 1, 2, 3 };
+		for (int k = 0; k < 6; k++) pi[k] = p4[order[k]], ti[k] = t4[order[k]];
+	}
+}
+
+bool ParseObj(const std::string& path, ObjData& obj, uint32_t threadCount) {
+	MappedFile file;
+	if (!file.Open(path.c_str()))
+		return false;
+	return ParseObj(reinterpret_cast<const char*>(file.GetData()), file.GetSize(), obj, threadCount);
+}
+
+bool ParseObj(const char* data, size_t size, ObjData& obj, uint32_t threadCount) {
+	const char* end = data + size;
+
+	// a few chunks per thread balances uneven lines, the job list holds at most 256
+	const size_t minChunkSize = 64 * 1024;
+	size_t chunkCount = threadCount <= 1 ? 1 : std::min<size_t>(256, (size_t)threadCount * 4);
+	chunkCount = std::max<size_t>(1, std::min(chunkCount, size / minChunkSize));
+
+	std::vector<ObjChunk> chunks;
+	chunks.reserve(chunkCount);
+	const char* begin = data;
+	for (size_t i = 1; i <= chunkCount && begin < end; i++) {
+		const char* split = i == chunkCount ? end : NextLine(std::max(begin, data + size * i / chunkCount), end);
+		ObjChunk chunk{};
+		chunk.begin = begin, chunk.end = split;
+		chunks.push_back(chunk);
+		begin = split;
+	}
+
+	std::vector<ObjParseJob> jobs(chunks.size());
+	for (size_t i = 0; i < chunks.size(); i++) jobs[i].m_Chunk = &chunks[i], jobs[i].m_Obj = &obj;
+
+	RunJobPass(jobs, 0, threadCount);
+
+	uint32_t positionCount = 0, texcoordCount = 0, triangleCount = 0;
+	for (auto& chunk : chunks) {
+		chunk.positionBase = positionCount, positionCount += chunk.positionCount;
+		chunk.texcoordBase = texcoordCount, texcoordCount += chunk.texcoordCount;
+		chunk.triangleBase = triangleCount, triangleCount += chunk.triangleCount;
+	}
+	obj.positions.resize(3 * (size_t)positionCount);
+	obj.texcoords.resize(2 * (size_t)texcoordCount);
+	obj.positionIndices.resize(3 * (size_t)triangleCount);
+	obj.texcoordIndices.resize(3 * (size_t)triangleCount);
+
+	RunJobPass(jobs, 1, threadCount);
+	RunJobPass(jobs, 2, threadCount);
+
+	// reject files that reference elements they never define (OBJ_BAD_INDEX included, whatever the counts)
+	for (size_t i = 0; i < obj.positionIndices.size(); i++) {
+		uint32_t position = obj.positionIndices[i], texcoord = obj.texcoordIndices[i];
+		if (position >= positionCount || position == OBJ_BAD_INDEX || (texcoord != OBJ_NO_INDEX && (texcoord >= texcoordCount || texcoord == OBJ_BAD_INDEX)))
+			return false;
+	}
+
+	return true;
+}
+
+void BenchmarkObjLoad(const std::string& path) {
+	Timer timer;
+
+	// reference: the tinyobj path loadModel used before
+	tinyobj::attrib_t attrib;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string warn, err;
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, path.c_str()))
+		throw std::runtime_error(warn + err);
+
+	ObjData reference;
+	reference.positions = attrib.vertices;
+	reference.texcoords = attrib.texcoords;
+	for (const auto& shape : shapes)
+		for (const auto& index : shape.mesh.indices) {
+			reference.positionIndices.push_back(static_cast<uint32_t>(index.vertex_index));
+			reference.texcoordIndices.push_back(index.texcoord_index < 0 ? OBJ_NO_INDEX : static_cast<uint32_t>(index.texcoord_index));
+		}
+	float tinyobjTime = timer.elapsed();
+
+	uint32_t threads = JobManager::GetJobManager()->GetNumThreads();
+	ObjData single, multi;
+	timer.reset();
+	bool ok = ParseObj(path, single, 1);
+	float singleTime = timer.elapsed();
+	timer.reset();
+	ok &= ParseObj(path, multi, threads);
+	float multiTime = timer.elapsed();
+
+	std::vector<Vertex> referenceVertices, singleVertices, multiVertices;
+	std::vector<uint32_t> referenceIndices, singleIndices, multiIndices;
+	WeldObj(reference, referenceVertices, referenceIndices);
+	WeldObj(single, singleVertices, singleIndices);
+	WeldObj(multi, multiVertices, multiIndices);
+	bool match = ok && referenceVertices == singleVertices && referenceIndices == singleIndices &&
+		referenceVertices == multiVertices && referenceIndices == multiIndices;
+
+	BenchmarkWeld(multi, threads);
+
+	std::cout << "obj benchmark " << path << ": tinyobj " << tinyobjTime * 1000.0f << " ms, ParseObj 1 thread " << singleTime * 1000.0f
+		<< " ms, " << threads << " threads " << multiTime * 1000.0f << " ms, output " << (match ? "matches" : "DIFFERS") << '\n';
+}
+#pragma endregion
+
+#pragma region vertex welding
+WeldTable::WeldTable(size_t maxCount) {
+	size_t capacity = 16;
+	while (capacity < maxCount * 2) capacity *= 2;		// load factor stays at or below 0.5
+	m_Slots.assign(capacity, 0);
+	m_Keys.reserve(maxCount);
+	m_Mask = capacity - 1;
+}
+
+uint32_t WeldTable::FindOrInsert(const VertexKey& key, uint64_t hash, bool& inserted) {
+	const uint64_t tag = hash & 0xffffffff00000000ull;
+	for (uint64_t slot = hash & m_Mask;; slot = (slot + 1) & m_Mask) {
+		uint64_t entry = m_Slots[slot];
+		if (entry == 0) {
+			uint32_t id = static_cast<uint32_t>(m_Keys.size());
+			m_Slots[slot] = tag | (id + 1);
+			m_Keys.push_back(key);
+			inserted = true;
+			return id;
+		}
+		uint32_t id = static_cast<uint32_t>(entry) - 1;
+		if ((entry & 0xffffffff00000000ull) == tag && m_Keys[id] == key) {
+			inserted = false;
+			return id;
+		}
+	}
+}
+
+static inline Vertex MakeObjVertex(const ObjData& obj, size_t corner) {
+	const float* position = &obj.positions[3 * (size_t)obj.positionIndices[corner]];
+	uint32_t texcoordIndex = obj.texcoordIndices[corner];
+
+	Vertex vertex{};
+	vertex.pos = { position[0], position[1], position[2] };
+	if (texcoordIndex != OBJ_NO_INDEX)
+		vertex.texCoord = { obj.texcoords[2 * (size_t)texcoordIndex + 0], 1.0f - obj.texcoords[2 * (size_t)texcoordIndex + 1] };
+	vertex.color = { 1.0f, 1.0f, 1.0f };
+	return vertex;
+}
+
+static inline float Snap(float value, float grid) {
+	return grid > 0.0f ? std::round(value / grid) * grid : value;
+}
+
+static inline VertexKey MakeWeldKey(const Vertex& vertex, const WeldOptions& options) {
+	if (options.positionGrid <= 0.0f && options.texcoordGrid <= 0.0f)
+		return VertexKey::fromVertex(vertex);
+	Vertex snapped = vertex;
+	snapped.pos = { Snap(vertex.pos.x, options.positionGrid), Snap(vertex.pos.y, options.positionGrid), Snap(vertex.pos.z, options.positionGrid) };
+	snapped.texCoord = { Snap(vertex.texCoord.x, options.texcoordGrid), Snap(vertex.texCoord.y, options.texcoordGrid) };
+	return VertexKey::fromVertex(snapped);
+}
+
+// sharded weld: every corner hashes into one of the shards by the top hash bits, each shard owns
+// its own table, and a final ordered pass numbers the shard entries in first-use order so the
+// result is identical to the single threaded weld
+struct WeldShared {
+	const ObjData* obj;
+	const WeldOptions* options;
+	std::vector<uint64_t> hashes;			// per corner
+	std::vector<uint32_t> localIds;			// per corner, id within its shard
+	std::vector<uint8_t> first;				// per corner, 1 when it introduces a new vertex
+	std::vector<uint32_t> shardCorners;		// corner indices grouped by shard, ascending within each
+	std::vector<size_t> shardStart;			// per shard + 1, its range in shardCorners
+	std::vector<std::vector<uint32_t>> shardFirst;	// per shard, first corner of each local id
+	std::vector<std::vector<uint32_t>> shardGlobal;	// per shard, local id -> output vertex
+};
+
+static void WeldShard(WeldShared& shared, uint32_t shard) {
+	const size_t begin = shared.shardStart[shard], end = shared.shardStart[shard + 1];
+	WeldTable table(end - begin);
+	std::vector<uint32_t>& first = shared.shardFirst[shard];
+	// the corners come in ascending order, so the first corner of every vertex is the one that inserts it
+	for (size_t c = begin; c < end; c++) {
+		uint32_t i = shared.shardCorners[c];
+		uint64_t hash = shared.hashes[i];
+		bool inserted;
+		uint32_t id = table.FindOrInsert(MakeWeldKey(MakeObjVertex(*shared.obj, i), *shared.options), hash, inserted);
+		if (inserted) {
+			first.push_back(i);
+			shared.first[i] = 1;
+		}
+		shared.localIds[i] = id;
+	}
+}
+
+static void WeldObjSharded(const ObjData& obj, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, const WeldOptions& options) {
+	const size_t cornerCount = obj.positionIndices.size();
+	uint32_t shardBits = 1;
+	while ((1u << shardBits) < options.threadCount * 2 && shardBits < 8) shardBits++;
+	const uint32_t shardCount = 1u << shardBits, shift = 64 - shardBits;
+
+	WeldShared shared;
+	shared.obj = &obj;
+	shared.options = &options;
+	shared.hashes.resize(cornerCount);
+	shared.localIds.resize(cornerCount);
+	shared.first.assign(cornerCount, 0);
+	shared.shardFirst.resize(shardCount);
+	shared.shardGlobal.resize(shardCount);
+	indices.resize(cornerCount);
+
+	// hash every corner and count the corners per block and shard; the blocks are fixed (unlike the pieces of a
+	// ParallelFor), so their counts place each block's corners after those of the blocks before it
+	const size_t blockCount = std::max<size_t>(std::min<size_t>(cornerCount, 4 * (size_t)options.threadCount), 1);
+	const size_t blockSize = (cornerCount + blockCount - 1) / blockCount;
+	std::vector<size_t> blockOffsets(blockCount * shardCount, 0);
+	ParallelFor(0, blockCount, 1, [&](size_t begin, size_t end) {
+		for (size_t b = begin; b < end; b++) {
+			size_t* counts = &blockOffsets[b * shardCount];
+			for (size_t i = b * blockSize; i < std::min(cornerCount, (b + 1) * blockSize); i++) {
+				uint64_t hash = hashVertexKey(MakeWeldKey(MakeObjVertex(obj, i), options));
+				shared.hashes[i] = hash;
+				counts[hash >> shift]++;
+			}
+		}
+	});
+
+	// prefix sum, shard major: the counts become where each block writes its corners of each shard
+	shared.shardStart.resize(shardCount + 1);
+	size_t offset = 0;
+	for (uint32_t s = 0; s < shardCount; s++) {
+		shared.shardStart[s] = offset;
+		for (size_t b = 0; b < blockCount; b++) {
+			size_t count = blockOffsets[b * shardCount + s];
+			blockOffsets[b * shardCount + s] = offset;
+			offset += count;
+		}
+	}
+	shared.shardStart[shardCount] = offset;
+
+	// scatter the corner indices, so that every shard only visits its own corners
+	shared.shardCorners.resize(cornerCount);
+	ParallelFor(0, blockCount, 1, [&](size_t begin, size_t end) {
+		for (size_t b = begin; b < end; b++) {
+			size_t* offsets = &blockOffsets[b * shardCount];
+			for (size_t i = b * blockSize; i < std::min(cornerCount, (b + 1) * blockSize); i++)
+				shared.shardCorners[offsets[shared.hashes[i] >> shift]++] = static_cast<uint32_t>(i);
+		}
+	});
+
+	ParallelFor(0, shardCount, 1, [&](size_t begin, size_t end) {
+		for (size_t s = begin; s < end; s++) WeldShard(shared, (uint32_t)s);
+	});
+
+	// number the new vertices in corner order, this is what makes the output deterministic
+	std::vector<uint32_t> globalIds(cornerCount);
+	vertices.clear();
+	for (size_t i = 0; i < cornerCount; i++)
+		if (shared.first[i]) {
+			globalIds[i] = static_cast<uint32_t>(vertices.size());
+			vertices.push_back(MakeObjVertex(obj, i));
+		}
+	for (uint32_t s = 0; s < shardCount; s++) {
+		shared.shardGlobal[s].resize(shared.shardFirst[s].size());
+		for (size_t id = 0; id < shared.shardFirst[s].size(); id++)
+			shared.shardGlobal[s][id] = globalIds[shared.shardFirst[s][id]];
+	}
+
+	ParallelFor(0, cornerCount, 0, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			indices[i] = shared.shardGlobal[shared.hashes[i] >> shift][shared.localIds[i]];
+	});
+}
+
+void WeldObj(const ObjData& obj, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, const WeldOptions& options) {
+	const size_t cornerCount = obj.positionIndices.size();
+
+	if (options.threadCount > 1 && cornerCount >= options.parallelThreshold) {
+		WeldObjSharded(obj, vertices, indices, options);
+		return;
+	}
+
+	// one find-or-insert per corner into a table sized for the worst case (every corner unique)
+	WeldTable table(cornerCount);
+	indices.resize(cornerCount);
+	vertices.clear();
+	for (size_t i = 0; i < cornerCount; i++) {
+		Vertex vertex = MakeObjVertex(obj, i);
+		VertexKey key = MakeWeldKey(vertex, options);
+		bool inserted;
+		indices[i] = table.FindOrInsert(key, hashVertexKey(key), inserted);
+		if (inserted)
+			vertices.push_back(vertex);
+	}
+}
+
+// the node based map welding loadModel used to do, kept as the benchmark baseline
+static void WeldObjMap(const ObjData& obj, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+	std::unordered_map<Vertex, uint32_t> uniqueVertices{};
+
+	for (size_t i = 0; i < obj.positionIndices.size(); i++) {
+		Vertex vertex = MakeObjVertex(obj, i);
+
+		if (uniqueVertices.count(vertex) == 0) {
+			uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
+			vertices.push_back(vertex);
+		}
+
+		indices.push_back(uniqueVertices[vertex]);
+	}
+}
+
+void BenchmarkWeld(const ObjData& obj, uint32_t threadCount) {
+	std::vector<Vertex> mapVertices, tableVertices, shardVertices;
+	std::vector<uint32_t> mapIndices, tableIndices, shardIndices;
+
+	Timer timer;
+	WeldObjMap(obj, mapVertices, mapIndices);
+	float mapTime = timer.elapsed();
+
+	timer.reset();
+	WeldObj(obj, tableVertices, tableIndices);
+	float tableTime = timer.elapsed();
+
+	WeldOptions sharded;
+	sharded.threadCount = std::max(threadCount, 2u);
+	sharded.parallelThreshold = 0;
+	timer.reset();
+	WeldObj(obj, shardVertices, shardIndices, sharded);
+	float shardTime = timer.elapsed();
+
+	bool match = mapVertices == tableVertices && mapIndices == tableIndices && mapVertices == shardVertices && mapIndices == shardIndices;
+	std::cout << "weld benchmark (" << obj.positionIndices.size() << " corners, " << mapVertices.size() << " vertices): unordered_map "
+		<< mapTime * 1000.0f << " ms, WeldTable " << tableTime * 1000.0f << " ms, sharded x" << sharded.threadCount << ' '
+		<< shardTime * 1000.0f << " ms, output " << (match ? "matches" : "DIFFERS") << '\n';
+}
+#pragma endregion
+
+#pragma region mesh optimization
+VertexCacheStats AnalyzeVertexCache(const uint32_t* indices, size_t indexCount, uint32_t vertexCount, uint32_t cacheSize) {
+	// FIFO simulation: a vertex is a hit while fewer than cacheSize misses happened since it was loaded
+	std::vector<uint32_t> loadedAt(vertexCount, 0);
+	uint32_t misses = 0;
+	for (size_t i = 0; i < indexCount; i++) {
+		uint32_t v = indices[i];
+		if (loadedAt[v] == 0 || misses - loadedAt[v] >= cacheSize) {
+			misses++;
+			loadedAt[v] = misses;
+		}
+	}
+
+	VertexCacheStats stats{};
+	stats.acmr = indexCount ? misses / (indexCount / 3.0f) : 0.0f;
+	stats.atvr = vertexCount ? misses / static_cast<float>(vertexCount) : 0.0f;
+	return stats;
+}
+
+void OptimizeVertexCache(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices, uint32_t cacheSize, bool overdraw) {
+	const uint32_t vertexCount = static_cast<uint32_t>(vertices.size());
+	const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+	if (triangleCount == 0) return;
+
+	// vertex -> triangle adjacency (CSR), the live count is the number of unemitted triangles per vertex
+	std::vector<uint32_t> live(vertexCount, 0), offsets(vertexCount + 1, 0), adjacency(indices.size());
+	for (uint32_t index : indices) live[index]++;
+	for (uint32_t v = 0; v < vertexCount; v++) offsets[v + 1] = offsets[v] + live[v];
+	{
+		std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (uint32_t t = 0; t < triangleCount; t++)
+			for (int k = 0; k < 3; k++) adjacency[fill[indices[3 * t + k]]++] = t;
+	}
+
+	std::vector<uint32_t> cacheTime(vertexCount, 0), deadEnd, candidates, output, clusters;
+	std::vector<uint8_t> emitted(triangleCount, 0);
+	output.reserve(indices.size());
+	deadEnd.reserve(indices.size());
+	uint32_t timestamp = cacheSize + 1, cursor = 0;
+	int64_t fanning = indices[0];
+
+	clusters.push_back(0);
+	while (fanning >= 0) {
+		candidates.clear();
+		for (uint32_t a = offsets[fanning]; a < offsets[fanning + 1]; a++) {
+			uint32_t t = adjacency[a];
+			if (emitted[t]) continue;
+			for (int k = 0; k < 3; k++) {
+				uint32_t v = indices[3 * t + k];
+				output.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (timestamp - cacheTime[v] > cacheSize) cacheTime[v] = timestamp++;
+			}
+			emitted[t] = 1;
+		}
+
+		// next fanning vertex: the candidate that stays in cache longest while still having triangles left
+		fanning = -1;
+		int64_t best = -1;
+		for (uint32_t v : candidates) {
+			if (live[v] == 0) continue;
+			int64_t priority = 0;
+			if (timestamp - cacheTime[v] + 2 * live[v] <= cacheSize) priority = timestamp - cacheTime[v];
+			if (priority > best) best = priority, fanning = v;
+		}
+		if (fanning >= 0) continue;
+
+		// dead end: fall back to recently used vertices, then to a linear scan (a cache flush, i.e. a hard boundary)
+		while (!deadEnd.empty() && fanning < 0) {
+			uint32_t v = deadEnd.back();
+			deadEnd.pop_back();
+			if (live[v] > 0) fanning = v;
+		}
+		while (fanning < 0 && cursor < vertexCount) {
+			if (live[cursor] > 0) fanning = cursor;
+			else cursor++;
+		}
+		if (fanning >= 0) clusters.push_back(static_cast<uint32_t>(output.size() / 3));
+	}
+
+	if (overdraw && clusters.size() > 1) {
+		// sort the clusters by how much they face away from the mesh center: outward facing geometry tends
+		// to occlude the rest, drawing it first lets early depth testing reject more fragments
+		glm::vec3 center(0.0f);
+		for (const Vertex& vertex : vertices) center += vertex.pos;
+		center = center / static_cast<float>(std::max<uint32_t>(vertexCount, 1));
+
+		clusters.push_back(triangleCount);
+		std::vector<std::pair<float, uint32_t>> order;
+		for (uint32_t c = 0; c + 1 < clusters.size(); c++) {
+			glm::vec3 centroid(0.0f), normal(0.0f);
+			for (uint32_t t = clusters[c]; t < clusters[c + 1]; t++) {
+				const glm::vec3& p0 = vertices[output[3 * t + 0]].pos;
+				const glm::vec3& p1 = vertices[output[3 * t + 1]].pos;
+				const glm::vec3& p2 = vertices[output[3 * t + 2]].pos;
+				centroid += (p0 + p1 + p2) / 3.0f;
+				normal += glm::cross(p1 - p0, p2 - p0);		// area weighted
+			}
+			centroid = centroid / static_cast<float>(clusters[c + 1] - clusters[c]);
+			order.push_back({ -glm::dot(centroid - center, normal), c });
+		}
+		std::stable_sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+		indices.clear();
+		for (const auto& entry : order)
+			indices.insert(indices.end(), output.begin() + 3 * (size_t)clusters[entry.second], output.begin() + 3 * (size_t)clusters[entry.second + 1]);
+		return;
+	}
+
+	indices.swap(output);
+}
+
+void OptimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+	std::vector<uint32_t> remap(vertices.size(), OBJ_NO_INDEX);
+	std::vector<Vertex> reordered;
+	reordered.reserve(vertices.size());
+
+	for (uint32_t& index : indices) {
+		if (remap[index] == OBJ_NO_INDEX) {
+			remap[index] = static_cast<uint32_t>(reordered.size());
+			reordered.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+
+	// vertices no triangle references are dropped
+	vertices.swap(reordered);
+}
+#pragma endregion
+
+#pragma region mesh simplification
+// quadric error metric (Garland/Heckbert): squared distance to a set of planes as p^T A p + 2 b.p + c, area weighted
+struct Quadric {
+	double a00, a11, a22, a01, a02, a12;
+	double b0, b1, b2;
+	double c;
+	double w;
+};
+
+static void AddPlaneQuadric(Quadric& q, const glm::vec3& n, double d, double w) {
+	q.a00 += w * n.x * n.x; q.a11 += w * n.y * n.y; q.a22 += w * n.z * n.z;
+	q.a01 += w * n.x * n.y; q.a02 += w * n.x * n.z; q.a12 += w * n.y * n.z;
+	q.b0 += w * n.x * d; q.b1 += w * n.y * d; q.b2 += w * n.z * d;
+	q.c += w * d * d;
+	q.w += w;
+}
+
+static void AddQuadric(Quadric& q, const Quadric& r) {
+	q.a00 += r.a00; q.a11 += r.a11; q.a22 += r.a22;
+	q.a01 += r.a01; q.a02 += r.a02; q.a12 += r.a12;
+	q.b0 += r.b0; q.b1 += r.b1; q.b2 += r.b2;
+	q.c += r.c;
+	q.w += r.w;
+}
+
+// mean squared distance of p to the planes of q
+static double QuadricError(const Quadric& q, const glm::vec3& p) {
+	double rx = q.a00 * p.x + q.a01 * p.y + q.a02 * p.z + q.b0;
+	double ry = q.a01 * p.x + q.a11 * p.y + q.a12 * p.z + q.b1;
+	double rz = q.a02 * p.x + q.a12 * p.y + q.a22 * p.z + q.b2;
+	double e = rx * p.x + ry * p.y + rz * p.z + q.b0 * p.x + q.b1 * p.y + q.b2 * p.z + q.c;
+	return q.w > 0.0 ? std::fabs(e) / q.w : 0.0;
+}
+
+struct Collapse {
+	uint32_t from, to;
+	double error;
+};
+
+// what a vertex may collapse along: anything (manifold), open edges only (border), uv seam edges only
+// taking its twin along (seam), or nothing at all (locked)
+enum VertexKind : uint8_t { KIND_MANIFOLD, KIND_BORDER, KIND_SEAM, KIND_LOCKED };
+
+static inline uint64_t EdgeKey(uint32_t a, uint32_t b) {
+	return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+}
+
+static inline uint32_t EdgeCount(const std::unordered_map<uint64_t, uint32_t>& edges, uint32_t a, uint32_t b) {
+	auto it = edges.find(EdgeKey(a, b));
+	return it == edges.end() ? 0 : it->second;
+}
+
+std::vector<uint32_t> SimplifyMesh(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, size_t targetIndexCount, float targetError, float& resultError) {
+	const uint32_t vertexCount = static_cast<uint32_t>(vertices.size());
+	resultError = 0.0f;
+
+	// vertices that only differ in texcoord (the wedges of a uv seam) share a position
+	std::vector<uint32_t> position(vertexCount);
+	WeldTable table(vertexCount);
+	for (uint32_t i = 0; i < vertexCount; i++) {
+		Vertex p{};
+		p.pos = vertices[i].pos;
+		VertexKey key = VertexKey::fromVertex(p);
+		bool inserted;
+		position[i] = table.FindOrInsert(key, hashVertexKey(key), inserted);
+	}
+	const uint32_t positionCount = table.GetCount();
+
+	std::vector<uint32_t> result = indices;
+	std::unordered_map<uint64_t, uint32_t> vertexEdges, positionEdges;
+	auto countEdges = [&]() {
+		vertexEdges.clear();
+		positionEdges.clear();
+		for (size_t i = 0; i < result.size(); i += 3)
+			for (int k = 0; k < 3; k++) {
+				uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+				vertexEdges[EdgeKey(a, b)]++;
+				positionEdges[EdgeKey(position[a], position[b])]++;
+			}
+	};
+	countEdges();
+
+	// area weighted triangle planes, plus planes through every open or seam edge perpendicular to its triangle
+	// so borders and seams keep their shape
+	std::vector<Quadric> quadrics(positionCount, Quadric{});
+	for (size_t i = 0; i < result.size(); i += 3) {
+		const glm::vec3& p0 = vertices[result[i]].pos;
+		glm::vec3 n = glm::cross(vertices[result[i + 1]].pos - p0, vertices[result[i + 2]].pos - p0);
+		float area = glm::length(n);
+		if (area == 0.0f) continue;
+		n = n / area;
+		for (int k = 0; k < 3; k++) {
+			uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+			AddPlaneQuadric(quadrics[position[a]], n, -glm::dot(n, p0), area * 0.5f);
+			if (EdgeCount(vertexEdges, a, b) != 1) continue;
+			glm::vec3 edge = vertices[b].pos - vertices[a].pos;
+			glm::vec3 side = glm::cross(edge, n);
+			float length = glm::length(side);
+			if (length == 0.0f) continue;
+			side = side / length;
+			double weight = glm::dot(edge, edge);
+			AddPlaneQuadric(quadrics[position[a]], side, -glm::dot(side, vertices[a].pos), weight);
+			AddPlaneQuadric(quadrics[position[b]], side, -glm::dot(side, vertices[a].pos), weight);
+		}
+	}
+
+	std::vector<uint8_t> kind(vertexCount), touched(vertexCount);
+	std::vector<uint32_t> remap(vertexCount), openEdges(vertexCount), wedgeOffset(positionCount + 1), wedges;
+	std::vector<uint32_t> borderEdges(positionCount), adjacencyOffset(vertexCount + 1), adjacency;
+	std::vector<uint8_t> complex(positionCount);
+	std::vector<Collapse> collapses;
+	const double maxError = (double)targetError * targetError;
+
+	while (result.size() > targetIndexCount) {
+		// vertex -> triangle adjacency and position -> vertex (wedge) lists of the current triangles
+		std::fill(adjacencyOffset.begin(), adjacencyOffset.end(), 0);
+		for (uint32_t index : result) adjacencyOffset[index + 1]++;
+		std::fill(wedgeOffset.begin(), wedgeOffset.end(), 0);
+		for (uint32_t v = 0; v < vertexCount; v++)
+			if (adjacencyOffset[v + 1] > 0) wedgeOffset[position[v] + 1]++;
+		for (uint32_t v = 0; v < vertexCount; v++) adjacencyOffset[v + 1] += adjacencyOffset[v];
+		for (uint32_t p = 0; p < positionCount; p++) wedgeOffset[p + 1] += wedgeOffset[p];
+		adjacency.resize(result.size());
+		wedges.resize(wedgeOffset[positionCount]);
+		{
+			std::vector<uint32_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+			for (size_t i = 0; i < result.size(); i++) adjacency[fill[result[i]]++] = static_cast<uint32_t>(i / 3);
+			fill.assign(wedgeOffset.begin(), wedgeOffset.end() - 1);
+			for (uint32_t v = 0; v < vertexCount; v++)
+				if (adjacencyOffset[v + 1] > adjacencyOffset[v]) wedges[fill[position[v]]++] = v;
+		}
+
+		// classify the vertices
+		std::fill(openEdges.begin(), openEdges.end(), 0);
+		std::fill(borderEdges.begin(), borderEdges.end(), 0);
+		std::fill(complex.begin(), complex.end(), 0);
+		for (const auto& edge : vertexEdges)
+			if (edge.second == 1) openEdges[edge.first >> 32]++, openEdges[edge.first & 0xffffffff]++;
+		for (const auto& edge : positionEdges) {
+			uint32_t a = static_cast<uint32_t>(edge.first >> 32), b = static_cast<uint32_t>(edge.first & 0xffffffff);
+			if (edge.second == 1) borderEdges[a]++, borderEdges[b]++;
+			if (edge.second > 2) complex[a] = complex[b] = 1;
+		}
+		for (uint32_t v = 0; v < vertexCount; v++) {
+			uint32_t p = position[v], wedgeCount = wedgeOffset[p + 1] - wedgeOffset[p];
+			kind[v] = KIND_LOCKED;
+			if (complex[p]) continue;
+			if (wedgeCount == 1 && borderEdges[p] == 0 && openEdges[v] == 0) kind[v] = KIND_MANIFOLD;
+			else if (wedgeCount == 1 && borderEdges[p] == 2 && openEdges[v] == 2) kind[v] = KIND_BORDER;
+			else if (wedgeCount == 2 && borderEdges[p] == 0 && openEdges[wedges[wedgeOffset[p]]] == 2 && openEdges[wedges[wedgeOffset[p] + 1]] == 2)
+				kind[v] = KIND_SEAM;
+		}
+
+		// the twin of a seam vertex, and the wedge of target that the twin collapses onto
+		auto twin = [&](uint32_t v) { uint32_t p = position[v]; return wedges[wedgeOffset[p]] == v ? wedges[wedgeOffset[p] + 1] : wedges[wedgeOffset[p]]; };
+		auto twinTarget = [&](uint32_t from, uint32_t to) {
+			uint32_t t = twin(from), p = position[to];
+			for (uint32_t w = wedgeOffset[p]; w < wedgeOffset[p + 1]; w++)
+				if (wedges[w] != to && EdgeCount(vertexEdges, t, wedges[w]) == 1) return wedges[w];
+			return OBJ_NO_INDEX;
+		};
+
+		// cheapest allowed collapse of every vertex onto one of its neighbours
+		collapses.clear();
+		for (uint32_t v = 0; v < vertexCount; v++) {
+			if (kind[v] == KIND_LOCKED || adjacencyOffset[v] == adjacencyOffset[v + 1]) continue;
+			Collapse best{ v, 0, DBL_MAX };
+			for (uint32_t a = adjacencyOffset[v]; a < adjacencyOffset[v + 1]; a++) {
+				const uint32_t* tri = &result[adjacency[a] * 3];
+				for (int k = 0; k < 3; k++) {
+					uint32_t to = tri[k];
+					if (to == v || position[to] == position[v]) continue;
+					// borders and seams only slide along themselves
+					if (kind[v] == KIND_BORDER && (EdgeCount(positionEdges, position[v], position[to]) != 1 || kind[to] == KIND_MANIFOLD || kind[to] == KIND_SEAM)) continue;
+					if (kind[v] == KIND_SEAM && (EdgeCount(vertexEdges, v, to) != 1 || (kind[to] != KIND_SEAM && kind[to] != KIND_LOCKED) || twinTarget(v, to) == OBJ_NO_INDEX)) continue;
+					double error = QuadricError(quadrics[position[v]], vertices[to].pos);
+					if (error < best.error) best = { v, to, error };
+				}
+			}
+			if (best.error <= maxError) collapses.push_back(best);
+		}
+		if (collapses.empty()) break;
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+		// apply the cheapest ones; a vertex takes part in at most one collapse per pass so the flip test
+		// below sees up to date triangles. Collapses well above the cost of the ones needed to reach the
+		// target wait for a later pass, otherwise the locking above lets expensive ones through early
+		for (uint32_t i = 0; i < vertexCount; i++) remap[i] = i;
+		std::fill(touched.begin(), touched.end(), 0);
+		size_t triangleCount = result.size() / 3;
+		size_t goal = std::min((triangleCount - targetIndexCount / 3) / 2, collapses.size() - 1);
+		double passError = collapses[goal].error * 1.5;
+		size_t performed = 0;
+		for (const Collapse& collapse : collapses) {
+			if (triangleCount * 3 <= targetIndexCount || collapse.error > passError) break;
+
+			// a seam collapse moves both wedges
+			uint32_t from[2] = { collapse.from, OBJ_NO_INDEX }, to[2] = { collapse.to, OBJ_NO_INDEX };
+			int moves = 1;
+			if (kind[collapse.from] == KIND_SEAM) {
+				from[1] = twin(collapse.from);
+				to[1] = twinTarget(collapse.from, collapse.to);
+				moves = 2;
+			}
+			bool blocked = false;
+			for (int m = 0; m < moves; m++)
+				blocked |= touched[from[m]] || touched[to[m]];
+			if (blocked) continue;
+
+			// reject collapses that flip a remaining triangle around a moved vertex
+			bool flips = false;
+			size_t removed = 0;
+			for (int m = 0; m < moves && !flips; m++)
+				for (uint32_t a = adjacencyOffset[from[m]]; a < adjacencyOffset[from[m] + 1] && !flips; a++) {
+					const uint32_t* tri = &result[adjacency[a] * 3];
+					if (tri[0] == to[m] || tri[1] == to[m] || tri[2] == to[m]) {
+						removed++;
+						continue;
+					}
+					glm::vec3 p[3], q[3];
+					for (int k = 0; k < 3; k++) {
+						p[k] = vertices[tri[k]].pos;
+						q[k] = tri[k] == from[m] ? vertices[to[m]].pos : p[k];
+					}
+					glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+					glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+					flips = glm::dot(before, after) <= 0.0f;
+				}
+			if (flips) continue;
+
+			// every vertex of the triangles around a moved vertex is held until the next pass
+			for (int m = 0; m < moves; m++) {
+				for (uint32_t a = adjacencyOffset[from[m]]; a < adjacencyOffset[from[m] + 1]; a++)
+					for (int k = 0; k < 3; k++) touched[result[adjacency[a] * 3 + k]] = 1;
+				remap[from[m]] = to[m];
+			}
+
+			AddQuadric(quadrics[position[collapse.to]], quadrics[position[collapse.from]]);
+			resultError = std::max(resultError, (float)std::sqrt(collapse.error));
+			triangleCount -= removed;
+			performed++;
+		}
+		if (performed == 0) break;
+
+		// drop the triangles that collapsed to a line
+		size_t write = 0;
+		for (size_t i = 0; i < result.size(); i += 3) {
+			uint32_t a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+			if (a == b || b == c || a == c) continue;
+			result[write++] = a;
+			result[write++] = b;
+			result[write++] = c;
+		}
+		result.resize(write);
+		countEdges();
+	}
+
+	return result;
+}
+
+void ComputeMeshBounds(const std::vector<Vertex>& vertices, float center[3], float& radius) {
+	glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+	for (const Vertex& v : vertices) {
+		lo = glm::min(lo, v.pos);
+		hi = glm::max(hi, v.pos);
+	}
+	glm::vec3 c = vertices.empty() ? glm::vec3(0.0f) : (lo + hi) * 0.5f;
+	radius = 0.0f;
+	for (const Vertex& v : vertices)
+		radius = std::max(radius, glm::length(v.pos - c));
+	center[0] = c.x;
+	center[1] = c.y;
+	center[2] = c.z;
+}
+
+void LogMeshLods(const MeshData& mesh) {
+	for (uint32_t i = 0; i < mesh.lodCount; i++)
+		std::cout << "  lod " << i << ": " << mesh.lods[i].triangleCount << " triangles, error " << mesh.lods[i].error
+			<< " (" << mesh.lods[i].subMeshCount << " sub-mesh(es))\n";
+}
+#pragma endregion
+
+#pragma region vertex formats
+const char* GetVertexFormatName(VertexFormat format) {
+	switch (format) {
+	case VertexFormat::Half: return "half";
+	case VertexFormat::Quantized: return "quantized";
+	default: return "float";
+	}
+}
+
+bool ParseVertexFormat(const char* name, VertexFormat& format) {
+	for (VertexFormat candidate : { VertexFormat::Float, VertexFormat::Half, VertexFormat::Quantized })
+		if (strcmp(name, GetVertexFormatName(candidate)) == 0) {
+			format = candidate;
+			return true;
+		}
+	return false;
+}
+
+void EncodeVertices(const std::vector<Vertex>& vertices, VertexFormat format, std::vector<uint8_t>& data, VertexTransform& transform) {
+	const size_t count = vertices.size();
+	data.resize(count * Vertex::getStride(format));
+
+	// identity unless the format is quantized against the bounds
+	for (int k = 0; k < 3; k++) transform.positionScale[k] = 1.0f, transform.positionOffset[k] = 0.0f;
+	for (int k = 0; k < 2; k++) transform.texCoordScale[k] = 1.0f, transform.texCoordOffset[k] = 0.0f;
+
+	if (format == VertexFormat::Float) {
+		VertexFloat* out = reinterpret_cast<VertexFloat*>(data.data());
+		for (size_t i = 0; i < count; i++) {
+			const Vertex& v = vertices[i];
+			out[i] = { { v.pos.x, v.pos.y, v.pos.z }, { v.texCoord.x, v.texCoord.y } };
+		}
+		return;
+	}
+
+	if (format == VertexFormat::Half) {
+		VertexHalf* out = reinterpret_cast<VertexHalf*>(data.data());
+		for (size_t i = 0; i < count; i++) {
+			const Vertex& v = vertices[i];
+			out[i] = { { (uint16_t)glm::packHalf1x16(v.pos.x), (uint16_t)glm::packHalf1x16(v.pos.y), (uint16_t)glm::packHalf1x16(v.pos.z), 0 },
+				{ (uint16_t)glm::packHalf1x16(v.texCoord.x), (uint16_t)glm::packHalf1x16(v.texCoord.y) } };
+		}
+		return;
+	}
+
+	// quantized: positions as snorm around the bounds center, texcoords as unorm over their range (which
+	// may exceed [0, 1] for repeating textures)
+	float posMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, posMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	float uvMin[2] = { FLT_MAX, FLT_MAX }, uvMax[2] = { -FLT_MAX, -FLT_MAX };
+	for (const Vertex& v : vertices) {
+		for (int k = 0; k < 3; k++) posMin[k] = std::min(posMin[k], v.pos[k]), posMax[k] = std::max(posMax[k], v.pos[k]);
+		for (int k = 0; k < 2; k++) uvMin[k] = std::min(uvMin[k], v.texCoord[k]), uvMax[k] = std::max(uvMax[k], v.texCoord[k]);
+	}
+	if (count == 0) return;
+	for (int k = 0; k < 3; k++) {
+		float halfExtent = 0.5f * (posMax[k] - posMin[k]);
+		transform.positionScale[k] = halfExtent > 0.0f ? halfExtent : 1.0f;
+		transform.positionOffset[k] = 0.5f * (posMax[k] + posMin[k]);
+	}
+	for (int k = 0; k < 2; k++) {
+		float range = uvMax[k] - uvMin[k];
+		transform.texCoordScale[k] = range > 0.0f ? range : 1.0f;
+		transform.texCoordOffset[k] = uvMin[k];
+	}
+
+	VertexQuantized* out = reinterpret_cast<VertexQuantized*>(data.data());
+	for (size_t i = 0; i < count; i++) {
+		const Vertex& v = vertices[i];
+		for (int k = 0; k < 3; k++)
+			out[i].pos[k] = (int16_t)glm::packSnorm1x16((v.pos[k] - transform.positionOffset[k]) / transform.positionScale[k]);
+		out[i].pos[3] = 0;
+		for (int k = 0; k < 2; k++)
+			out[i].texCoord[k] = glm::packUnorm1x16((v.texCoord[k] - transform.texCoordOffset[k]) / transform.texCoordScale[k]);
+	}
+}
+#pragma endregion
+
+#pragma region index buffers
+void SplitMesh(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, const std::vector<uint32_t>& ranges, uint32_t maxVertices, std::vector<SubMesh>& subMeshes) {
+	subMeshes.clear();
+
+	// everything fits: one sub-mesh per range, all of them sharing the whole vertex buffer
+	if (vertices.size() <= maxVertices) {
+		for (size_t r = 0; r < ranges.size(); r++) {
+			uint32_t end = r + 1 < ranges.size() ? ranges[r + 1] : static_cast<uint32_t>(indices.size());
+			subMeshes.push_back({ ranges[r], end - ranges[r], 0, static_cast<uint32_t>(vertices.size()) });
+		}
+		return;
+	}
+
+	// remap[v] is the local index of v in the sub-mesh that owner[v] names
+	std::vector<uint32_t> remap(vertices.size());
+	std::vector<uint32_t> owner(vertices.size(), OBJ_NO_INDEX);
+	std::vector<Vertex> split;
+	split.reserve(vertices.size());
+
+	SubMesh current{ 0, 0, 0, 0 };
+	size_t nextRange = 1;
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		uint32_t subMesh = static_cast<uint32_t>(subMeshes.size());
+		uint32_t added = 0;
+		for (int k = 0; k < 3; k++)
+			if (owner[indices[i + k]] != subMesh) added++;
+
+		// triangles are kept whole and in order, so the cuts land where the vertex cache order already breaks;
+		// a new range always starts a new sub-mesh (and so gets its own copies of the vertices it uses)
+		bool rangeStart = nextRange < ranges.size() && i == ranges[nextRange];
+		if (rangeStart) nextRange++;
+		if ((rangeStart || current.vertexCount + added > maxVertices) && current.indexCount > 0) {
+			subMeshes.push_back(current);
+			current = { static_cast<uint32_t>(i), 0, static_cast<int32_t>(split.size()), 0 };
+			subMesh++;
+		}
+
+		for (int k = 0; k < 3; k++) {
+			uint32_t& index = indices[i + k];
+			if (owner[index] != subMesh) {
+				owner[index] = subMesh;
+				remap[index] = current.vertexCount++;
+				split.push_back(vertices[index]);
+			}
+			index = remap[index];
+		}
+		current.indexCount += 3;
+	}
+	if (current.indexCount > 0)
+		subMeshes.push_back(current);
+
+	vertices.swap(split);
+}
+
+void EncodeIndices(const std::vector<uint32_t>& indices, VkIndexType indexType, std::vector<uint8_t>& data) {
+	if (indexType == VK_INDEX_TYPE_UINT32) {
+		data.resize(indices.size() * sizeof(uint32_t));
+		memcpy(data.data(), indices.data(), data.size());
+		return;
+	}
+
+	data.resize(indices.size() * sizeof(uint16_t));
+	uint16_t* out = reinterpret_cast<uint16_t*>(data.data());
+	for (size_t i = 0; i < indices.size(); i++)
+		out[i] = static_cast<uint16_t>(indices[i]);
+}
+#pragma endregion
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "vulkan.h"
+
+// binary mesh cache, written next to the source asset as "<asset>.meshcache"
+// layout: MeshCacheHeader | vertices (encoded in vertexFormat) | indices (indexType) | sub-meshes | lods
+#define MESHCACHE_MAGIC		0x4853454d	// "MESH"
+#define MESHCACHE_VERSION	6
+#define MESHCACHE_ALIGN		64
+
+struct MeshCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	VertexFormat vertexFormat;
+	uint32_t vertexStride;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	VertexTransform vertexTransform;
+	VkIndexType indexType;
+	uint32_t subMeshCount;
+	uint32_t lodCount;
+	float boundsRadius;
+	float boundsCenter[3];
+	uint32_t reserved;
+	uint64_t vertexOffset;
+	uint64_t indexOffset;
+	uint64_t subMeshOffset;
+	uint64_t lodOffset;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+};
+
+std::string GetMeshCachePath(const std::string& source);
+// maps the cache of source if it exists, is still valid and holds vertexFormat; mesh then points into the mapping
+bool LoadMeshCache(const std::string& source, VertexFormat vertexFormat, MappedFile& file, MeshData& mesh);
+// writes the cache for source (to a temporary file first, then renamed in place)
+bool SaveMeshCache(const std::string& source, const MeshData& mesh);
+
+// FNV-1a over raw bytes
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+
+// OBJ geometry as produced by ParseObj, polygons are triangulated the same way tinyobj does
+// (quads split along the shorter diagonal, larger polygons fanned)
+#define OBJ_NO_INDEX 0xffffffffu
+
+struct ObjData {
+	std::vector<float> positions;				// xyz per "v"
+	std::vector<float> texcoords;				// uv per "vt"
+	std::vector<uint32_t> positionIndices;		// 3 per triangle, zero based
+	std::vector<uint32_t> texcoordIndices;		// 3 per triangle, OBJ_NO_INDEX when a corner has no "vt"
+};
+
+// memory maps the file and parses line aligned chunks on the job manager; threadCount <= 1 parses inline
+bool ParseObj(const std::string& path, ObjData& obj, uint32_t threadCount);
+// the same on OBJ text already in memory
+bool ParseObj(const char* data, size_t size, ObjData& obj, uint32_t threadCount);
+// flat open-addressing table (linear probing) that hands out one id per distinct VertexKey
+class WeldTable
+{
+public:
+	// sized once up front, maxCount is the number of keys that can possibly be inserted
+	explicit WeldTable(size_t maxCount);
+	// returns the id of an equal key, or stores key under the next id; inserted tells which happened
+	uint32_t FindOrInsert(const VertexKey& key, uint64_t hash, bool& inserted);
+	uint32_t GetCount() const { return static_cast<uint32_t>(m_Keys.size()); }
+protected:
+	std::vector<uint64_t> m_Slots;		// upper 32 bits of the hash | id + 1, zero when empty
+	std::vector<VertexKey> m_Keys;
+	uint64_t m_Mask;
+};
+
+struct WeldOptions {
+	float positionGrid = 0.0f;			// > 0 snaps positions to this grid before comparing
+	float texcoordGrid = 0.0f;			// > 0 snaps texcoords to this grid before comparing
+	uint32_t threadCount = 1;			// > 1 allows the sharded parallel weld
+	uint32_t parallelThreshold = 1 << 20;	// corners below this always weld on one thread
+};
+
+// deduplicates the corners of obj into vertices/indices in first-use order (the order loadModel always produced),
+// the first corner of every welded group provides the stored vertex
+void WeldObj(const ObjData& obj, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, const WeldOptions& options = {});
+// times tinyobj against ParseObj on one and on all threads and checks that the outputs match
+void BenchmarkObjLoad(const std::string& path);
+// times std::unordered_map welding against WeldObj on one thread and sharded
+void BenchmarkWeld(const ObjData& obj, uint32_t threadCount);
+
+// post-transform vertex cache statistics for a FIFO cache of cacheSize entries
+// acmr: cache misses per triangle, atvr: cache misses per vertex (1.0 is optimal)
+struct VertexCacheStats {
+	float acmr;
+	float atvr;
+};
+
+VertexCacheStats AnalyzeVertexCache(const uint32_t* indices, size_t indexCount, uint32_t vertexCount, uint32_t cacheSize);
+// reorders triangles for the post-transform cache (Tipsify); with overdraw set the clusters found at the
+// cache flush points are additionally sorted so outward facing clusters draw first
+void OptimizeVertexCache(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices, uint32_t cacheSize, bool overdraw);
+// renumbers vertices in order of first use so vertex fetches walk memory linearly
+void OptimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+
+// quadric error edge collapse down to targetIndexCount indices, stopping early when the next collapse would move the
+// surface further than targetError; the result reuses the vertices, resultError receives the largest error reached
+std::vector<uint32_t> SimplifyMesh(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, size_t targetIndexCount, float targetError, float& resultError);
+void ComputeMeshBounds(const std::vector<Vertex>& vertices, float center[3], float& radius);
+void LogMeshLods(const MeshData& mesh);
+
+// encodes vertices into the GPU layout of format, transform receives the dequantization parameters
+void EncodeVertices(const std::vector<Vertex>& vertices, VertexFormat format, std::vector<uint8_t>& data, VertexTransform& transform);
+const char* GetVertexFormatName(VertexFormat format);
+// the format GetVertexFormatName calls name; false for any other name
+bool ParseVertexFormat(const char* name, VertexFormat& format);
+
+inline uint32_t GetIndexSize(VkIndexType indexType) { return indexType == VK_INDEX_TYPE_UINT16 ? 2 : 4; }
+// cuts the triangle list into sub-meshes that reference at most maxVertices vertices each, vertices shared
+// across a cut are duplicated; afterwards the indices are relative to the vertexOffset of their sub-mesh.
+// ranges holds the first index of every range that must start its own sub-mesh (the LODs), ranges[0] == 0
+void SplitMesh(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, const std::vector<uint32_t>& ranges, uint32_t maxVertices, std::vector<SubMesh>& subMeshes);
+// stores indices as indexType (the caller makes sure they fit)
+void EncodeIndices(const std::vector<uint32_t>& indices, VkIndexType indexType, std::vector<uint8_t>& data);
@@ -0,0 +1,472 @@
+#include "precomp.h"
+#include "texture.h"
+
+#pragma region tables
+#define MIP_KAISER_TAPS		6			// source texels per output texel and axis, centered on the 2x2 footprint
+#define MIP_ROW_GRAIN		16			// rows per ParallelFor piece
+#define MIP_ENCODE_BITS		16			// linear -> sRGB table resolution
+
+// [0, 256): sRGB -> linear, [256, 512): unorm -> float
+alignas(64) static float s_DecodeTable[512];
+// linear quantized to MIP_ENCODE_BITS -> sRGB, padded so 32 bit gathers stay inside
+alignas(64) static uint8_t s_EncodeTable[(1 << MIP_ENCODE_BITS) + 4];
+static float s_KaiserWeights[MIP_KAISER_TAPS];
+
+static double BesselI0(double x) {
+	double sum = 1.0, term = 1.0;
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void InitMipTables() {
+	static const bool ready = [] {
+		for (int i = 0; i < 256; i++) {
+			float c = i / 255.0f;
+			s_DecodeTable[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+			s_DecodeTable[256 + i] = c;
+		}
+		const int encodeMax = (1 << MIP_ENCODE_BITS) - 1;
+		for (int i = 0; i <= encodeMax; i++) {
+			double c = (double)i / encodeMax;
+			double s = c <= 0.0031308 ? c * 12.92 : 1.055 * std::pow(c, 1.0 / 2.4) - 0.055;
+			s_EncodeTable[i] = static_cast<uint8_t>(s * 255.0 + 0.5);
+		}
+		// windowed sinc with the cutoff at the new Nyquist rate, texel centers sit at +-0.5, +-1.5, +-2.5
+		const double pi = 3.14159265358979323846, beta = 4.0, radius = MIP_KAISER_TAPS / 2;
+		double sum = 0.0, weights[MIP_KAISER_TAPS];
+		for (int k = 0; k < MIP_KAISER_TAPS; k++) {
+			double d = k - (MIP_KAISER_TAPS - 1) * 0.5, x = d * 0.5 * pi;
+			double sinc = std::sin(x) / x;
+			double window = BesselI0(beta * std::sqrt(1.0 - (d / radius) * (d / radius))) / BesselI0(beta);
+			sum += weights[k] = sinc * window;
+		}
+		for (int k = 0; k < MIP_KAISER_TAPS; k++) s_KaiserWeights[k] = static_cast<float>(weights[k] / sum);
+		return true;
+	}();
+	(void)ready;
+}
+
+static inline uint32_t ClampIndex(int i, uint32_t count) {
+	return static_cast<uint32_t>(std::min(std::max(i, 0), (int)count - 1));
+}
+#pragma endregion
+
+// every kernel works on one row of RGBA texels (4 floats / 4 bytes each); the SIMD versions do the same
+// arithmetic in the same order as the scalar ones, so levels only differ where the compiler fuses mul + add
+#pragma region scalar kernels
+static void DecodeRowScalar(const uint8_t* src, float* dst, uint32_t width, bool srgb) {
+	const uint32_t colorBase = srgb ? 0 : 256;
+	for (uint32_t i = 0; i < width * 4; i++)
+		dst[i] = s_DecodeTable[src[i] + ((i & 3) == 3 ? 256 : colorBase)];
+}
+
+static void BoxRowScalar(const float* row0, const float* row1, float* dst, uint32_t srcWidth, uint32_t dstWidth, uint32_t first) {
+	for (uint32_t x = first; x < dstWidth; x++) {
+		uint32_t x0 = std::min(x * 2, srcWidth - 1) * 4, x1 = std::min(x * 2 + 1, srcWidth - 1) * 4;
+		for (int c = 0; c < 4; c++)
+			dst[x * 4 + c] = ((row0[x0 + c] + row0[x1 + c]) + (row1[x0 + c] + row1[x1 + c])) * 0.25f;
+	}
+}
+
+static void KaiserRowScalar(const float* src, float* dst, uint32_t srcWidth, uint32_t dstWidth, uint32_t first) {
+	for (uint32_t x = first; x < dstWidth; x++)
+		for (int c = 0; c < 4; c++) {
+			float sum = 0.0f;
+			for (int k = 0; k < MIP_KAISER_TAPS; k++)
+				sum = sum + s_KaiserWeights[k] * src[ClampIndex(x * 2 + k - 2, srcWidth) * 4 + c];
+			dst[x * 4 + c] = sum;
+		}
+}
+
+static void KaiserColumnScalar(const float* const* rows, float* dst, uint32_t count, uint32_t first) {
+	for (uint32_t i = first; i < count; i++) {
+		float sum = 0.0f;
+		for (int k = 0; k < MIP_KAISER_TAPS; k++)
+			sum = sum + s_KaiserWeights[k] * rows[k][i];
+		dst[i] = sum;
+	}
+}
+
+static inline uint8_t EncodeScalar(float v, bool useTable) {
+	v = std::min(std::max(v, 0.0f), 1.0f);
+	if (useTable) return s_EncodeTable[static_cast<int>(v * (float)((1 << MIP_ENCODE_BITS) - 1) + 0.5f)];
+	return static_cast<uint8_t>(static_cast<int>(v * 255.0f + 0.5f));
+}
+
+static void EncodeRowScalar(const float* src, uint8_t* dst, uint32_t width, bool srgb, uint32_t first) {
+	for (uint32_t i = first * 4; i < width * 4; i++)
+		dst[i] = EncodeScalar(src[i], srgb && (i & 3) != 3);
+}
+
+static void BoxRow(const float* row0, const float* row1, float* dst, uint32_t srcWidth, uint32_t dstWidth) { BoxRowScalar(row0, row1, dst, srcWidth, dstWidth, 0); }
+static void KaiserRow(const float* src, float* dst, uint32_t srcWidth, uint32_t dstWidth) { KaiserRowScalar(src, dst, srcWidth, dstWidth, 0); }
+static void KaiserColumn(const float* const* rows, float* dst, uint32_t count) { KaiserColumnScalar(rows, dst, count, 0); }
+static void EncodeRow(const float* src, uint8_t* dst, uint32_t width, bool srgb) { EncodeRowScalar(src, dst, width, srgb, 0); }
+#pragma endregion
+
+#pragma region SSE4.1 kernels
+// one texel per register
+TARGET_SSE41 static void DecodeRowSSE41(const uint8_t* src, float* dst, uint32_t width, bool srgb) {
+	const __m128i base = _mm_setr_epi32(srgb ? 0 : 256, srgb ? 0 : 256, srgb ? 0 : 256, 256);
+	for (uint32_t x = 0; x < width; x++) {
+		int packed;
+		memcpy(&packed, src + x * 4, 4);
+		__m128i index = _mm_add_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)), base);
+		_mm_storeu_ps(dst + x * 4, _mm_setr_ps(s_DecodeTable[_mm_extract_epi32(index, 0)], s_DecodeTable[_mm_extract_epi32(index, 1)],
+			s_DecodeTable[_mm_extract_epi32(index, 2)], s_DecodeTable[_mm_extract_epi32(index, 3)]));
+	}
+}
+
+TARGET_SSE41 static void BoxRowSSE41(const float* row0, const float* row1, float* dst, uint32_t srcWidth, uint32_t dstWidth) {
+	const __m128 quarter = _mm_set1_ps(0.25f);
+	uint32_t x = 0;
+	for (; x < dstWidth && x * 2 + 1 < srcWidth; x++) {
+		__m128 top = _mm_add_ps(_mm_loadu_ps(row0 + x * 8), _mm_loadu_ps(row0 + x * 8 + 4));
+		__m128 bottom = _mm_add_ps(_mm_loadu_ps(row1 + x * 8), _mm_loadu_ps(row1 + x * 8 + 4));
+		_mm_storeu_ps(dst + x * 4, _mm_mul_ps(_mm_add_ps(top, bottom), quarter));
+	}
+	BoxRowScalar(row0, row1, dst, srcWidth, dstWidth, x);
+}
+
+TARGET_SSE41 static void KaiserRowSSE41(const float* src, float* dst, uint32_t srcWidth, uint32_t dstWidth) {
+	for (uint32_t x = 0; x < dstWidth; x++) {
+		__m128 sum = _mm_setzero_ps();
+		for (int k = 0; k < MIP_KAISER_TAPS; k++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(s_KaiserWeights[k]), _mm_loadu_ps(src + ClampIndex(x * 2 + k - 2, srcWidth) * 4)));
+		_mm_storeu_ps(dst + x * 4, sum);
+	}
+}
+
+TARGET_SSE41 static void KaiserColumnSSE41(const float* const* rows, float* dst, uint32_t count) {
+	uint32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 sum = _mm_setzero_ps();
+		for (int k = 0; k < MIP_KAISER_TAPS; k++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(s_KaiserWeights[k]), _mm_loadu_ps(rows[k] + i)));
+		_mm_storeu_ps(dst + i, sum);
+	}
+	KaiserColumnScalar(rows, dst, count, i);
+}
+
+TARGET_SSE41 static void EncodeRowSSE41(const float* src, uint8_t* dst, uint32_t width, bool srgb) {
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+	const __m128 tableScale = _mm_set1_ps((float)((1 << MIP_ENCODE_BITS) - 1)), unormScale = _mm_set1_ps(255.0f);
+	for (uint32_t x = 0; x < width; x++) {
+		__m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + x * 4), zero), one);
+		__m128i unorm = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, unormScale), half));
+		if (srgb) {
+			__m128i index = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, tableScale), half));
+			unorm = _mm_insert_epi32(unorm, s_EncodeTable[_mm_extract_epi32(index, 0)], 0);
+			unorm = _mm_insert_epi32(unorm, s_EncodeTable[_mm_extract_epi32(index, 1)], 1);
+			unorm = _mm_insert_epi32(unorm, s_EncodeTable[_mm_extract_epi32(index, 2)], 2);
+		}
+		__m128i packed = _mm_packus_epi16(_mm_packus_epi32(unorm, unorm), unorm);
+		int texel = _mm_cvtsi128_si32(packed);
+		memcpy(dst + x * 4, &texel, 4);
+	}
+}
+#pragma endregion
+
+#pragma region AVX2 kernels
+// two texels per register
+TARGET_AVX2 static void DecodeRowAVX2(const uint8_t* src, float* dst, uint32_t width, bool srgb) {
+	const int color = srgb ? 0 : 256;
+	const __m256i base = _mm256_setr_epi32(color, color, color, 256, color, color, color, 256);
+	uint32_t x = 0;
+	for (; x + 2 <= width; x += 2) {
+		__m256i index = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + x * 4))), base);
+		_mm256_storeu_ps(dst + x * 4, _mm256_i32gather_ps(s_DecodeTable, index, 4));
+	}
+	if (x < width) DecodeRowScalar(src + x * 4, dst + x * 4, width - x, srgb);
+}
+
+TARGET_AVX2 static void BoxRowAVX2(const float* row0, const float* row1, float* dst, uint32_t srcWidth, uint32_t dstWidth) {
+	const __m256 quarter = _mm256_set1_ps(0.25f);
+	uint32_t x = 0;
+	for (; x + 2 <= dstWidth && x * 2 + 3 < srcWidth; x += 2) {
+		// [t0 t1] [t2 t3] -> [t0 t2] + [t1 t3]
+		__m256 a = _mm256_loadu_ps(row0 + x * 8), b = _mm256_loadu_ps(row0 + x * 8 + 8);
+		__m256 top = _mm256_add_ps(_mm256_permute2f128_ps(a, b, 0x20), _mm256_permute2f128_ps(a, b, 0x31));
+		a = _mm256_loadu_ps(row1 + x * 8), b = _mm256_loadu_ps(row1 + x * 8 + 8);
+		__m256 bottom = _mm256_add_ps(_mm256_permute2f128_ps(a, b, 0x20), _mm256_permute2f128_ps(a, b, 0x31));
+		_mm256_storeu_ps(dst + x * 4, _mm256_mul_ps(_mm256_add_ps(top, bottom), quarter));
+	}
+	BoxRowScalar(row0, row1, dst, srcWidth, dstWidth, x);
+}
+
+TARGET_AVX2 static void KaiserRowAVX2(const float* src, float* dst, uint32_t srcWidth, uint32_t dstWidth) {
+	uint32_t x = 0;
+	for (; x + 2 <= dstWidth; x += 2) {
+		__m256 sum = _mm256_setzero_ps();
+		for (int k = 0; k < MIP_KAISER_TAPS; k++) {
+			__m256 texels = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(src + ClampIndex(x * 2 + k - 2, srcWidth) * 4)),
+				_mm_loadu_ps(src + ClampIndex(x * 2 + k, srcWidth) * 4), 1);
+			sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(s_KaiserWeights[k]), texels));
+		}
+		_mm256_storeu_ps(dst + x * 4, sum);
+	}
+	KaiserRowScalar(src, dst, srcWidth, dstWidth, x);
+}
+
+TARGET_AVX2 static void KaiserColumnAVX2(const float* const* rows, float* dst, uint32_t count) {
+	uint32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 sum = _mm256_setzero_ps();
+		for (int k = 0; k < MIP_KAISER_TAPS; k++)
+			sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(s_KaiserWeights[k]), _mm256_loadu_ps(rows[k] + i)));
+		_mm256_storeu_ps(dst + i, sum);
+	}
+	KaiserColumnScalar(rows, dst, count, i);
+}
+
+TARGET_AVX2 static void EncodeRowAVX2(const float* src, uint8_t* dst, uint32_t width, bool srgb) {
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f);
+	const __m256 tableScale = _mm256_set1_ps((float)((1 << MIP_ENCODE_BITS) - 1)), unormScale = _mm256_set1_ps(255.0f);
+	const __m256i tableLanes = srgb ? _mm256_setr_epi32(-1, -1, -1, 0, -1, -1, -1, 0) : _mm256_setzero_si256();
+	const __m256i byteMask = _mm256_set1_epi32(0xff);
+	uint32_t x = 0;
+	for (; x + 2 <= width; x += 2) {
+		__m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + x * 4), zero), one);
+		__m256i unorm = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, unormScale), half));
+		__m256i index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, tableScale), half));
+		__m256i table = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(s_EncodeTable), index, 1), byteMask);
+		__m256i value = _mm256_blendv_epi8(unorm, table, tableLanes);
+		__m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x * 4), _mm_packus_epi16(packed, packed));
+	}
+	EncodeRowScalar(src, dst, width, srgb, x);
+}
+#pragma endregion
+
+#pragma region AVX-512 kernels
+// four texels per register
+TARGET_AVX512 static void DecodeRowAVX512(const uint8_t* src, float* dst, uint32_t width, bool srgb) {
+	const int color = srgb ? 0 : 256;
+	const __m512i base = _mm512_setr_epi32(color, color, color, 256, color, color, color, 256, color, color, color, 256, color, color, color, 256);
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m512i index = _mm512_add_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4))), base);
+		_mm512_storeu_ps(dst + x * 4, _mm512_i32gather_ps(index, s_DecodeTable, 4));
+	}
+	if (x < width) DecodeRowScalar(src + x * 4, dst + x * 4, width - x, srgb);
+}
+
+TARGET_AVX512 static void BoxRowAVX512(const float* row0, const float* row1, float* dst, uint32_t srcWidth, uint32_t dstWidth) {
+	const __m512 quarter = _mm512_set1_ps(0.25f);
+	uint32_t x = 0;
+	for (; x + 4 <= dstWidth && x * 2 + 7 < srcWidth; x += 4) {
+		// [t0 t1 t2 t3] [t4 t5 t6 t7] -> [t0 t2 t4 t6] + [t1 t3 t5 t7]
+		__m512 a = _mm512_loadu_ps(row0 + x * 8), b = _mm512_loadu_ps(row0 + x * 8 + 16);
+		__m512 top = _mm512_add_ps(_mm512_shuffle_f32x4(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm512_shuffle_f32x4(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		a = _mm512_loadu_ps(row1 + x * 8), b = _mm512_loadu_ps(row1 + x * 8 + 16);
+		__m512 bottom = _mm512_add_ps(_mm512_shuffle_f32x4(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm512_shuffle_f32x4(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		_mm512_storeu_ps(dst + x * 4, _mm512_mul_ps(_mm512_add_ps(top, bottom), quarter));
+	}
+	BoxRowScalar(row0, row1, dst, srcWidth, dstWidth, x);
+}
+
+TARGET_AVX512 static void KaiserRowAVX512(const float* src, float* dst, uint32_t srcWidth, uint32_t dstWidth) {
+	uint32_t x = 0;
+	for (; x + 4 <= dstWidth; x += 4) {
+		__m512 sum = _mm512_setzero_ps();
+		for (int k = 0; k < MIP_KAISER_TAPS; k++) {
+			__m512 texels = _mm512_castps128_ps512(_mm_loadu_ps(src + ClampIndex(x * 2 + k - 2, srcWidth) * 4));
+			texels = _mm512_insertf32x4(texels, _mm_loadu_ps(src + ClampIndex(x * 2 + k, srcWidth) * 4), 1);
+			texels = _mm512_insertf32x4(texels, _mm_loadu_ps(src + ClampIndex(x * 2 + k + 2, srcWidth) * 4), 2);
+			texels = _mm512_insertf32x4(texels, _mm_loadu_ps(src + ClampIndex(x * 2 + k + 4, srcWidth) * 4), 3);
+			sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_set1_ps(s_KaiserWeights[k]), texels));
+		}
+		_mm512_storeu_ps(dst + x * 4, sum);
+	}
+	KaiserRowScalar(src, dst, srcWidth, dstWidth, x);
+}
+
+TARGET_AVX512 static void KaiserColumnAVX512(const float* const* rows, float* dst, uint32_t count) {
+	uint32_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m512 sum = _mm512_setzero_ps();
+		for (int k = 0; k < MIP_KAISER_TAPS; k++)
+			sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_set1_ps(s_KaiserWeights[k]), _mm512_loadu_ps(rows[k] + i)));
+		_mm512_storeu_ps(dst + i, sum);
+	}
+	KaiserColumnScalar(rows, dst, count, i);
+}
+
+TARGET_AVX512 static void EncodeRowAVX512(const float* src, uint8_t* dst, uint32_t width, bool srgb) {
+	const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f), half = _mm512_set1_ps(0.5f);
+	const __m512 tableScale = _mm512_set1_ps((float)((1 << MIP_ENCODE_BITS) - 1)), unormScale = _mm512_set1_ps(255.0f);
+	const __mmask16 tableLanes = srgb ? 0x7777 : 0;
+	const __m512i byteMask = _mm512_set1_epi32(0xff);
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m512 v = _mm512_min_ps(_mm512_max_ps(_mm512_loadu_ps(src + x * 4), zero), one);
+		__m512i unorm = _mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(v, unormScale), half));
+		__m512i index = _mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(v, tableScale), half));
+		__m512i table = _mm512_and_si512(_mm512_i32gather_epi32(index, s_EncodeTable, 1), byteMask);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), _mm512_cvtusepi32_epi8(_mm512_mask_blend_epi32(tableLanes, unorm, table)));
+	}
+	EncodeRowScalar(src, dst, width, srgb, x);
+}
+#pragma endregion
+
+#pragma region mip generation
+struct MipKernels {
+	void (*decodeRow)(const uint8_t* src, float* dst, uint32_t width, bool srgb);
+	void (*boxRow)(const float* row0, const float* row1, float* dst, uint32_t srcWidth, uint32_t dstWidth);
+	void (*kaiserRow)(const float* src, float* dst, uint32_t srcWidth, uint32_t dstWidth);
+	void (*kaiserColumn)(const float* const* rows, float* dst, uint32_t count);
+	void (*encodeRow)(const float* src, uint8_t* dst, uint32_t width, bool srgb);
+};
+
+static const MipKernels s_MipKernels[] = {
+	{ DecodeRowScalar, BoxRow, KaiserRow, KaiserColumn, EncodeRow },
+	{ DecodeRowSSE41, BoxRowSSE41, KaiserRowSSE41, KaiserColumnSSE41, EncodeRowSSE41 },
+	{ DecodeRowAVX2, BoxRowAVX2, KaiserRowAVX2, KaiserColumnAVX2, EncodeRowAVX2 },
+	{ DecodeRowAVX512, BoxRowAVX512, KaiserRowAVX512, KaiserColumnAVX512, EncodeRowAVX512 },
+};
+
+SimdLevel GetSimdLevel() {
+	static CPUCaps caps;
+	if (CPUCaps::HW_AVX512F && CPUCaps::OS_AVX512) return SimdLevel::AVX512;
+	if (CPUCaps::HW_AVX2 && CPUCaps::OS_AVX) return SimdLevel::AVX2;
+	if (CPUCaps::HW_SSE41) return SimdLevel::SSE41;
+	return SimdLevel::Scalar;
+}
+
+const char* GetSimdLevelName(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::SSE41: return "SSE4.1";
+	case SimdLevel::AVX2: return "AVX2";
+	case SimdLevel::AVX512: return "AVX-512";
+	default: return "scalar";
+	}
+}
+
+// one level's rows: decoded from level 0, or filtered from the level above and encoded
+struct MipLevel
+{
+	void Decode(uint32_t firstRow, uint32_t endRow) const;
+	void Filter(uint32_t firstRow, uint32_t endRow, std::vector<float>& scratch) const;
+	const MipKernels* kernels;
+	const MipOptions* options;
+	const uint8_t* pixels;
+	const float* source;					// float texels of the current level
+	float* target;							// float texels of the next level (or of level 0 when decoding)
+	uint8_t* encoded;						// rgba8 texels of the next level
+	uint32_t srcWidth, srcHeight, dstWidth;
+};
+
+void MipLevel::Decode(uint32_t firstRow, uint32_t endRow) const {
+	for (uint32_t y = firstRow; y < endRow; y++)
+		kernels->decodeRow(pixels + (size_t)y * srcWidth * 4, target + (size_t)y * srcWidth * 4, srcWidth, options->srgb);
+}
+
+// scratch holds the horizontally filtered source rows (Kaiser)
+void MipLevel::Filter(uint32_t firstRow, uint32_t endRow, std::vector<float>& scratch) const {
+	const bool srgb = options->srgb;
+	const size_t srcPitch = (size_t)srcWidth * 4, dstPitch = (size_t)dstWidth * 4;
+	if (options->filter == MipFilter::Box) {
+		for (uint32_t y = firstRow; y < endRow; y++) {
+			const float* row0 = source + std::min(y * 2, srcHeight - 1) * srcPitch;
+			const float* row1 = source + std::min(y * 2 + 1, srcHeight - 1) * srcPitch;
+			kernels->boxRow(row0, row1, target + y * dstPitch, srcWidth, dstWidth);
+			kernels->encodeRow(target + y * dstPitch, encoded + y * dstPitch, dstWidth, srgb);
+		}
+		return;
+	}
+
+	// filter the source rows these rows touch horizontally once, then every output row vertically
+	int firstSource = (int)firstRow * 2 - 2, endSource = (int)endRow * 2 + MIP_KAISER_TAPS - 2;
+	scratch.resize((size_t)(endSource - firstSource) * dstPitch);
+	for (int s = firstSource; s < endSource; s++)
+		kernels->kaiserRow(source + ClampIndex(s, srcHeight) * srcPitch, &scratch[(s - firstSource) * dstPitch], srcWidth, dstWidth);
+	for (uint32_t y = firstRow; y < endRow; y++) {
+		const float* rows[MIP_KAISER_TAPS];
+		for (int k = 0; k < MIP_KAISER_TAPS; k++) rows[k] = &scratch[((int)y * 2 + k - 2 - firstSource) * dstPitch];
+		kernels->kaiserColumn(rows, target + y * dstPitch, static_cast<uint32_t>(dstPitch));
+		kernels->encodeRow(target + y * dstPitch, encoded + y * dstPitch, dstWidth, srgb);
+	}
+}
+
+void GenerateMipChain(const uint8_t* pixels, uint32_t width, uint32_t height, uint8_t* const* mips, const MipOptions& options) {
+	InitMipTables();
+	const SimdLevel simd = std::min(options.simd, GetSimdLevel());
+	const uint32_t mipCount = GetMipCount(width, height);
+	if (mipCount <= 1) return;
+
+	// pieces of MIP_ROW_GRAIN rows, a Kaiser piece filters the MIP_KAISER_TAPS - 2 source rows it shares with the next
+	// one again; a single thread takes each level as one piece
+	auto grain = [&](uint32_t rows) -> size_t { return options.threadCount > 1 ? MIP_ROW_GRAIN : rows; };
+	std::vector<float> source((size_t)width * height * 4), target;
+	ScratchPool<std::vector<float>> scratch;
+	MipLevel level = {};
+	level.kernels = &s_MipKernels[(int)simd];
+	level.options = &options;
+	level.pixels = pixels;
+	level.target = source.data();
+	level.srcWidth = width;
+	ParallelFor(0, height, grain(height), [&](size_t first, size_t end) { level.Decode((uint32_t)first, (uint32_t)end); });
+
+	uint32_t srcWidth = width, srcHeight = height;
+	for (uint32_t i = 1; i < mipCount; i++) {
+		uint32_t dstWidth = std::max(srcWidth / 2, 1u), dstHeight = std::max(srcHeight / 2, 1u);
+		target.resize((size_t)dstWidth * dstHeight * 4);
+
+		level.source = source.data();
+		level.target = target.data();
+		level.encoded = mips[i - 1];
+		level.srcWidth = srcWidth;
+		level.srcHeight = srcHeight;
+		level.dstWidth = dstWidth;
+		ParallelFor(0, dstHeight, grain(dstHeight), scratch, [&](size_t first, size_t end, std::vector<float>& rows) {
+			level.Filter((uint32_t)first, (uint32_t)end, rows);
+		});
+
+		source.swap(target);
+		srcWidth = dstWidth;
+		srcHeight = dstHeight;
+	}
+}
+
+void BenchmarkMipChain(const uint8_t* pixels, uint32_t width, uint32_t height) {
+	uint32_t threadCount = JobManager::GetJobManager()->GetNumThreads();
+	uint32_t mipCount = GetMipCount(width, height);
+	size_t mipBytes = 0;
+	for (uint32_t i = 1; i < mipCount; i++) mipBytes += (size_t)std::max(width >> i, 1u) * std::max(height >> i, 1u) * 4;
+
+	std::cout << "BenchmarkMipChain: " << width << "x" << height << ", " << mipCount << " levels, best instruction set "
+		<< GetSimdLevelName(GetSimdLevel()) << '\n';
+	for (MipFilter filter : { MipFilter::Box, MipFilter::Kaiser }) {
+		std::vector<uint8_t> reference(mipBytes), result(mipBytes);
+		float serial = 0.0f;
+		for (int simd = 0; simd <= (int)GetSimdLevel(); simd++)
+			for (uint32_t threads : { 1u, threadCount }) {
+				MipOptions options;
+				options.filter = filter;
+				options.simd = static_cast<SimdLevel>(simd);
+				options.threadCount = threads;
+
+				std::vector<uint8_t>& output = simd == 0 && threads == 1 ? reference : result;
+				std::vector<uint8_t*> mips(mipCount - 1);
+				for (uint32_t i = 1, offset = 0; i < mipCount; offset += std::max(width >> i, 1u) * std::max(height >> i, 1u) * 4, i++)
+					mips[i - 1] = output.data() + offset;
+
+				GenerateMipChain(pixels, width, height, mips.data(), options);		// warm up
+				const int runs = 5;
+				Timer timer;
+				for (int run = 0; run < runs; run++) GenerateMipChain(pixels, width, height, mips.data(), options);
+				float seconds = timer.elapsed() / runs;
+				if (threads == 1) serial = seconds;
+
+				int maxDiff = 0;
+				for (size_t i = 0; i < mipBytes; i++) maxDiff = std::max(maxDiff, std::abs((int)output[i] - (int)reference[i]));
+				std::cout << "  " << (filter == MipFilter::Box ? "box" : "kaiser") << ' ' << GetSimdLevelName(options.simd) << ", " << threads
+					<< " thread(s): " << seconds * 1000.0f << " ms, " << (double)width * height / seconds / 1e6 << " Mpixel/s, x" << serial / seconds
+					<< " over 1 thread, max diff " << maxDiff << '\n';
+			}
+	}
+}
+#pragma endregion
@@ -0,0 +1,242 @@
+#include "precomp.h"
+#include "mesh.h"
+
+size_t PipelineKeyHasher::operator()(const PipelineKey& key) const {
+	return static_cast<size_t>(HashBytes(&key, sizeof(PipelineKey)));
+}
+
+void PipelineManager::Create(VkDevice device, VkPipelineCache cache, const PipelineState& state, uint32_t threadCount) {
+	m_Device = device;
+	m_Cache = cache;
+	m_State = state;
+	m_Stop = false;
+	for (uint32_t i = 0; i < std::max(threadCount, 1u); i++)
+		m_Workers.emplace_back(&PipelineManager::Worker, this);
+}
+
+void PipelineManager::Destroy() {
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Stop = true;
+	}
+	m_Queued.notify_all();
+	for (auto& worker : m_Workers)
+		worker.join();
+	m_Workers.clear();
+	m_Queue.clear();
+
+	for (auto& [key, entry] : m_Entries)
+		if (entry.pipeline != VK_NULL_HANDLE)
+			vkDestroyPipeline(m_Device, entry.pipeline, nullptr);
+	m_Entries.clear();
+
+	if (m_State.fragShader != VK_NULL_HANDLE)
+		vkDestroyShaderModule(m_Device, m_State.fragShader, nullptr);
+	if (m_State.vertShader != VK_NULL_HANDLE)
+		vkDestroyShaderModule(m_Device, m_State.vertShader, nullptr);
+	m_State = {};
+}
+
+PipelineManager::Entry& PipelineManager::Insert(const PipelineKey& key) {
+	auto [it, inserted] = m_Entries.try_emplace(key);
+	Entry& entry = it->second;
+	if (inserted) {
+		entry.key = key;
+		m_Queue.push_back(&entry);
+		m_Queued.notify_one();
+	}
+	return entry;
+}
+
+void PipelineManager::Request(const PipelineKey& key) {
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	Insert(key);
+}
+
+VkPipeline PipelineManager::Get(const PipelineKey& key) {
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	Entry& entry = Insert(key);
+	// no worker has it yet: compiling it here beats waiting for one to finish its current pipeline
+	if (entry.state == PIPELINE_QUEUED)
+		Compile(entry, lock);
+	m_Compiled.wait(lock, [&entry] { return entry.state == PIPELINE_READY || entry.state == PIPELINE_FAILED; });
+	if (entry.state == PIPELINE_FAILED)
+		throw std::runtime_error("failed to create graphics pipeline!");
+	return entry.pipeline;
+}
+
+VkPipeline PipelineManager::Find(const PipelineKey& key, const PipelineKey& fallback) {
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	Entry& entry = Insert(key);
+	if (entry.state == PIPELINE_READY)
+		return entry.pipeline;
+	// waiting for the fallback (or compiling it) here would stall the render thread, so it must be built already
+	auto it = m_Entries.find(fallback);
+	assert(it != m_Entries.end() && it->second.state == PIPELINE_READY);
+	return it != m_Entries.end() && it->second.state == PIPELINE_READY ? it->second.pipeline : VK_NULL_HANDLE;
+}
+
+void PipelineManager::WaitIdle() {
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_Compiled.wait(lock, [this] { return m_Compiling == 0 && m_Queue.empty(); });
+}
+
+uint32_t PipelineManager::GetCompiledCount() {
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	uint32_t count = 0;
+	for (auto& [key, entry] : m_Entries)
+		if (entry.state == PIPELINE_READY)
+			count++;
+	return count;
+}
+
+void PipelineManager::Compile(Entry& entry, std::unique_lock<std::mutex>& lock) {
+	// the queue may still point at entry, whoever pops it skips it
+	entry.state = PIPELINE_COMPILING;
+	m_Compiling++;
+	lock.unlock();
+	VkPipeline pipeline = CreatePipeline(entry.key);
+	lock.lock();
+	entry.pipeline = pipeline;
+	entry.state = pipeline != VK_NULL_HANDLE ? PIPELINE_READY : PIPELINE_FAILED;
+	m_Compiling--;
+	m_Compiled.notify_all();
+}
+
+void PipelineManager::Worker() {
+	JobManager::GetJobManager()->PlaceBackgroundThread();
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	while (true) {
+		m_Queued.wait(lock, [this] { return m_Stop || !m_Queue.empty(); });
+		if (m_Stop)
+			return;
+		Entry* entry = m_Queue.front();
+		m_Queue.pop_front();
+		if (entry->state == PIPELINE_QUEUED)
+			Compile(*entry, lock);
+		else if (m_Queue.empty())
+			m_Compiled.notify_all();		// WaitIdle may be waiting for the queue to drain
+	}
+}
+
+VkPipeline PipelineManager::CreatePipeline(const PipelineKey& key) const {
+	VkPipelineShaderStageCreateInfo shaderStages[2]{};
+	shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	shaderStages[0].module = m_State.vertShader;
+	shaderStages[0].pName = "main";
+	shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	shaderStages[1].module = m_State.fragShader;
+	shaderStages[1].pName = "main";
+
+	// viewport and scissor are dynamic, so the pipelines do not depend on the swap chain
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState{};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount = 2;
+	dynamicState.pDynamicStates = dynamicStates;
+
+	auto bindingDescription = Vertex::getBindingDescription(m_State.vertexFormat);
+	auto attributeDescriptions = Vertex::getAttributeDescriptions(m_State.vertexFormat);
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInputInfo.vertexBindingDescriptionCount = 1;
+	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+	vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
+	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+	VkPipelineViewportStateCreateInfo viewportState{};
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportState.viewportCount = 1;
+	viewportState.scissorCount = 1;
+
+	VkPipelineRasterizationStateCreateInfo rasterizer{};
+	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterizer.depthClampEnable = VK_FALSE;
+	rasterizer.rasterizerDiscardEnable = VK_FALSE;
+	rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizer.lineWidth = 1.0f;
+	rasterizer.cullMode = key.cullMode;
+	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	rasterizer.depthBiasEnable = VK_FALSE;
+
+	VkPipelineMultisampleStateCreateInfo multisampling{};
+	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisampling.sampleShadingEnable = VK_TRUE; // enable sample shading in the pipeline
+	multisampling.rasterizationSamples = key.samples;
+	multisampling.minSampleShading = .2f; // min fraction for sample shading; closer to one is smoother
+
+	VkPipelineDepthStencilStateCreateInfo depthStencil{};
+	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencil.depthTestEnable = VK_TRUE;
+	depthStencil.depthWriteEnable = VK_TRUE;
+	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+	depthStencil.depthBoundsTestEnable = VK_FALSE;
+	depthStencil.minDepthBounds = 0.0f;
+	depthStencil.maxDepthBounds = 1.0f;
+	depthStencil.stencilTestEnable = VK_FALSE;
+
+	/*
+	* what is blend mode:
+	* 	if (blendEnable) {
+	*		finalColor.rgb = (srcColorBlendFactor * newColor.rgb) <colorBlendOp> (dstColorBlendFactor * oldColor.rgb);
+	*		finalColor.a = (srcAlphaBlendFactor * newColor.a) <alphaBlendOp> (dstAlphaBlendFactor * oldColor.a);
+	*	} else {
+	*		finalColor = newColor;
+	*	}
+	*
+	*	finalColor = finalColor & colorWriteMask;
+	*/
+	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+	colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+	colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+	colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+	colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+	colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+	if (key.blendMode == BLEND_ALPHA) {
+		colorBlendAttachment.blendEnable = VK_TRUE;
+		colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+		colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+	}
+	else {
+		colorBlendAttachment.blendEnable = VK_FALSE;
+		colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+		colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+	}
+
+	VkPipelineColorBlendStateCreateInfo colorBlending{};
+	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlending.logicOpEnable = VK_FALSE;
+	colorBlending.logicOp = VK_LOGIC_OP_COPY;
+	colorBlending.attachmentCount = 1;
+	colorBlending.pAttachments = &colorBlendAttachment;
+
+	VkGraphicsPipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineInfo.stageCount = 2;
+	pipelineInfo.pStages = shaderStages;
+	pipelineInfo.pVertexInputState = &vertexInputInfo;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pViewportState = &viewportState;
+	pipelineInfo.pRasterizationState = &rasterizer;
+	pipelineInfo.pMultisampleState = &multisampling;
+	pipelineInfo.pDepthStencilState = &depthStencil;
+	pipelineInfo.pColorBlendState = &colorBlending;
+	pipelineInfo.pDynamicState = &dynamicState;
+	pipelineInfo.layout = m_State.layout;
+	pipelineInfo.renderPass = m_State.renderPass;
+	pipelineInfo.subpass = 0;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	pipelineInfo.basePipelineIndex = -1;
+
+	VkPipeline pipeline;
+	if (vkCreateGraphicsPipelines(m_Device, m_Cache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+		return VK_NULL_HANDLE;
+	return pipeline;
+}
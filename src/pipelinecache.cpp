@@ -0,0 +1,90 @@
+#include "precomp.h"
+#include "pipelinecache.h"
+#include "mesh.h"
+
+#include <filesystem>
+
+static bool MatchesDevice(const PipelineCacheHeader& header, const VkPhysicalDeviceProperties& properties) {
+	return header.vendorID == properties.vendorID && header.deviceID == properties.deviceID &&
+		header.driverVersion == properties.driverVersion && memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+VkPipelineCache LoadPipelineCache(VkDevice device, const VkPhysicalDeviceProperties& properties, const std::string& path, bool& warm) {
+	VkPipelineCacheCreateInfo cacheInfo{};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+
+	MappedFile file;
+	warm = false;
+	if (file.Open(path.c_str())) {
+		const PipelineCacheHeader* header = reinterpret_cast<const PipelineCacheHeader*>(file.GetData());
+		if (file.GetSize() < sizeof(PipelineCacheHeader) || header->magic != PIPELINECACHE_MAGIC || header->version != PIPELINECACHE_VERSION ||
+			file.GetSize() != sizeof(PipelineCacheHeader) + header->dataSize ||
+			HashBytes(file.GetData() + sizeof(PipelineCacheHeader), header->dataSize) != header->dataHash) {
+			std::cerr << "LoadPipelineCache: " << path << " is corrupt, discarding it\n";
+			file.Close();
+			RemoveFile(path.c_str());
+		}
+		else if (!MatchesDevice(*header, properties))
+			std::cout << "LoadPipelineCache: " << path << " is from another device or driver, starting cold\n";
+		else {
+			cacheInfo.initialDataSize = static_cast<size_t>(header->dataSize);
+			cacheInfo.pInitialData = file.GetData() + sizeof(PipelineCacheHeader);
+			warm = true;
+		}
+	}
+
+	VkPipelineCache cache;
+	if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache) == VK_SUCCESS)
+		return cache;
+	if (!warm)
+		throw std::runtime_error("failed to create pipeline cache!");
+
+	// the driver rejected the data after all
+	std::cerr << "LoadPipelineCache: the driver rejected " << path << ", starting cold\n";
+	warm = false;
+	cacheInfo.initialDataSize = 0;
+	cacheInfo.pInitialData = nullptr;
+	if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache) != VK_SUCCESS)
+		throw std::runtime_error("failed to create pipeline cache!");
+	return cache;
+}
+
+bool SavePipelineCache(VkDevice device, VkPipelineCache cache, const VkPhysicalDeviceProperties& properties, const std::string& path) {
+	size_t dataSize = 0;
+	if (vkGetPipelineCacheData(device, cache, &dataSize, nullptr) != VK_SUCCESS)
+		return false;
+	std::vector<uint8_t> data(dataSize);
+	if (vkGetPipelineCacheData(device, cache, &dataSize, data.data()) != VK_SUCCESS)
+		return false;
+
+	PipelineCacheHeader header{};
+	header.magic = PIPELINECACHE_MAGIC;
+	header.version = PIPELINECACHE_VERSION;
+	header.vendorID = properties.vendorID;
+	header.deviceID = properties.deviceID;
+	header.driverVersion = properties.driverVersion;
+	memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+	header.dataSize = dataSize;
+	header.dataHash = HashBytes(data.data(), dataSize);
+
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			return false;
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(data.data()), dataSize);
+
+		if (!file.good())
+			return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tempPath, path, ec);
+	if (ec) {
+		RemoveFile(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "vulkan.h"
+
+// pipeline cache file, written to PIPELINE_CACHE_PATH on shutdown
+// layout: PipelineCacheHeader | data from vkGetPipelineCacheData
+// the driver only accepts data of its own device and version, the header makes that explicit and catches truncated
+// or corrupt files before they reach the driver
+#define PIPELINECACHE_MAGIC		0x45504950	// "PIPE"
+#define PIPELINECACHE_VERSION	1
+
+struct PipelineCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t dataSize;
+	uint64_t dataHash;
+};
+
+// creates a pipeline cache, filled from path when the file was written for this device and driver and is intact
+// (a file that is not is deleted); warm tells which of the two happened
+VkPipelineCache LoadPipelineCache(VkDevice device, const VkPhysicalDeviceProperties& properties, const std::string& path, bool& warm);
+// writes the contents of cache (to a temporary file first, then renamed in place)
+bool SavePipelineCache(VkDevice device, VkPipelineCache cache, const VkPhysicalDeviceProperties& properties, const std::string& path);
@@ -1,13 +1,25 @@
 #pragma once
 
 // C++ headers
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <set>
+#include <vector>
 #include <string>
 #include <thread>
 #include <math.h>
 #include <assert.h>
+#ifdef _WIN32
 #include <io.h>
+#endif
+#include <sys/stat.h>
 
 // header for AVX and before
 #include <immintrin.h>
@@ -17,6 +29,7 @@ typedef unsigned char uchar;
 typedef unsigned int uint;
 typedef unsigned short ushort;
 
+#ifdef _WIN32
 // windows.h: disable as much as possible to speed up compilation.
 #define NOMINMAX
 #ifndef WIN32_LEAN_AND_MEAN
@@ -61,15 +74,7 @@ typedef unsigned short ushort;
 #define NOMCX
 #define NOIME
 #include "windows.h"
-
-// include vulkan application
-#include "vulkan.h"
-
-// fatal error reporting (with a pretty window)
-#define FATALERROR( fmt, ... ) FatalError( "Error on line %d of %s: " fmt "\n", __LINE__, __FILE__, ##__VA_ARGS__ )
-#define FATALERROR_IF( condition, fmt, ... ) do { if ( ( condition ) ) FATALERROR( fmt, ##__VA_ARGS__ ); } while ( 0 )
-#define FATALERROR_IN( prefix, errstr, fmt, ... ) FatalError( prefix " returned error '%s' at %s:%d" fmt "\n", errstr, __FILE__, __LINE__, ##__VA_ARGS__ );
-#define FATALERROR_IN_CALL( stmt, error_parser, fmt, ... ) do { auto ret = ( stmt ); if ( ret ) FATALERROR_IN( #stmt, error_parser( ret ), fmt, ##__VA_ARGS__ ) } while ( 0 )
+#endif
 
 // timer
 struct Timer
@@ -85,49 +90,340 @@ struct Timer
 	std::chrono::high_resolution_clock::time_point start;
 };
 
-// Nils's jobmanager
+// include vulkan application
+#include "vulkan.h"
+
+// fatal error reporting (with a pretty window)
+#define FATALERROR( fmt, ... ) FatalError( "Error on line %d of %s: " fmt "\n", __LINE__, __FILE__, ##__VA_ARGS__ )
+#define FATALERROR_IF( condition, fmt, ... ) do { if ( ( condition ) ) FATALERROR( fmt, ##__VA_ARGS__ ); } while ( 0 )
+#define FATALERROR_IN( prefix, errstr, fmt, ... ) FatalError( prefix " returned error '%s' at %s:%d" fmt "\n", errstr, __FILE__, __LINE__, ##__VA_ARGS__ );
+#define FATALERROR_IN_CALL( stmt, error_parser, fmt, ... ) do { auto ret = ( stmt ); if ( ret ) FATALERROR_IN( #stmt, error_parser( ret ), fmt, ##__VA_ARGS__ ) } while ( 0 )
+
+// job system: std::thread workers with a Chase-Lev deque each. jobs added on a worker (from inside a job) go to its
+// own deque, which it pops newest first; jobs from any other thread go to a shared queue. a worker that runs dry takes
+// from the shared queue, then steals the oldest job of another worker, and only sleeps when no job is queued anywhere
 class Job
 {
 public:
 	virtual void Main() = 0;
 protected:
-	friend class JobThread;
+	friend class JobManager;
 	void RunCodeWrapper();
+	std::atomic<int64_t>* m_Remaining = nullptr;	// jobs left in the RunJobs batch this one belongs to
 };
-class JobThread
+// the logical processors this process may run on, ordered by NUMA node, last level cache, core and number; the ids are
+// the OS's numbers of the core's first logical processor, of the cache's and of the node (-1 when unknown)
+struct CpuInfo
 {
-public:
-	void CreateAndStartThread(unsigned int threadId);
-	void Go();
-	void BackgroundTask();
-	HANDLE m_GoSignal, m_ThreadHandle;
-	int m_ThreadID;
+	int cpu, core, cache, node;
+};
+struct CpuTopology
+{
+	std::vector<CpuInfo> cpus;
+	// sysfs on Linux, GetLogicalProcessorInformationEx on Windows; cpus is empty when neither told anything
+	static CpuTopology Query();
+	// 0 on the same core (SMT siblings), 1 sharing the last level cache, 2 on the same node, 3 further apart
+	static int GetDistance(const CpuInfo& a, const CpuInfo& b);
 };
+// sets the calling thread's affinity to these logical processors; false when the OS refused
+bool SetThreadAffinity(const std::vector<int>& cpus);
+
+struct JobWorker;
+struct StealOrder;
 class JobManager	// singleton class!
 {
 protected:
-	JobManager(unsigned int numThreads);
+	// with affinity every worker is pinned to a logical processor of its own: one per core first, SMT siblings after,
+	// none on the first core, which PinRenderThread gives to the render thread
+	JobManager(unsigned int numThreads, bool affinity = true);
 public:
 	~JobManager();
 	static void CreateJobManager(unsigned int numThreads);
+	// one thread per logical processor outside the caller's core, plus the caller
 	static JobManager* GetJobManager();
 	static void GetProcessorCount(uint& cores, uint& logical);
+	// for long running threads outside the job manager (decoding, pipeline compiles, I/O): keeps the calling thread off
+	// the core the job manager reserved for the render thread, so the two do not share it through SMT
+	void PlaceBackgroundThread();
+	// pins the calling thread to the core the workers leave free. threads inherit the affinity of the thread that
+	// starts them, so this comes after instance and device creation, where the loader and the driver start theirs
+	void PinRenderThread();
+	// back to the processors the process had when the job manager was created
+	void UnpinThread();
+	// adds a job to the calling thread's next RunJobs batch
 	void AddJob2(Job* a_Job);
 	unsigned int GetNumThreads() { return m_NumThreads; }
+	// queues the calling thread's batch and runs jobs until the batch is done, so the caller is one of the
+	// GetNumThreads() threads (there are GetNumThreads() - 1 workers). it never sleeps and may run jobs of other
+	// batches meanwhile; several threads can run batches at once, and jobs can run batches of their own
 	void RunJobs();
-	void ThreadDone(unsigned int n);
+	// queues one job without waiting for it, the job counts *remaining down when it is done
+	void Spawn(Job* a_Job, std::atomic<int64_t>* remaining);
+	// runs one queued job on the calling thread; false when none was found
+	bool RunJob();
+	// nothing waiting in the calling thread's deque (the shared queue for a thread that is no worker): any job it
+	// queues now is one the others can take
+	bool IsQueueEmpty();
 	int MaxConcurrent() { return m_NumThreads; }
+#ifdef JOB_BENCHMARK
+	// batches of small jobs on 1 to GetProcessorCount() threads, against a single locked job list like the Win32
+	// JobManager had (threads woken per batch, the caller sleeping until all of them are done)
+	static void Benchmark();
+#endif
+#ifdef AFFINITY_BENCHMARK
+	// frame times of a render-like loop (a batch of jobs and a serial part per frame) while decode-like threads load
+	// every logical processor, with and without the placement
+	static void AffinityBenchmark();
+#endif
 protected:
-	friend class JobThread;
-	Job* GetNextJob();
+	void WorkerLoop(int worker);
+	// own deque (worker >= 0), shared queue, then one round of stealing, nearest workers first; nullptr when that
+	// found nothing
+	Job* FindJob(int worker);
+	void Wake();
 	static JobManager* m_JobManager;
-	Job* m_JobList[256];
-	CRITICAL_SECTION m_CS;
-	HANDLE m_ThreadDone[64];
-	unsigned int m_NumThreads, m_JobCount;
-	JobThread* m_JobThreadList;
+	unsigned int m_NumThreads;
+	std::vector<std::unique_ptr<JobWorker>> m_Workers;
+	std::unique_ptr<StealOrder> m_CallerSteal;			// for threads that are not workers
+	std::vector<int> m_BackgroundCpus;				// every logical processor but the reserved core's, empty without affinity
+	std::vector<int> m_RenderCpus;					// the reserved core's
+	std::vector<int> m_ProcessCpus;					// all of them
+	std::mutex m_SharedLock;
+	std::deque<Job*> m_Shared;
+	std::atomic<size_t> m_SharedSize{ 0 };
+	std::atomic<int64_t> m_Queued{ 0 };			// jobs added and not taken yet, anywhere
+	std::mutex m_SleepLock;
+	std::condition_variable m_WakeSignal;
+	std::atomic<uint32_t> m_Sleeping{ 0 };
+	bool m_Stop = false;
+};
+
+// sets the pass of every job and runs them all on the job manager (inline when threadCount <= 1)
+template <class T>
+void RunJobPass(std::vector<T>& jobs, int pass, uint32_t threadCount) {
+	for (auto& job : jobs) job.m_Pass = pass;
+	if (threadCount <= 1) {
+		for (auto& job : jobs) job.Main();
+		return;
+	}
+	JobManager* jobManager = JobManager::GetJobManager();
+	for (auto& job : jobs) jobManager->AddJob2(&job);
+	jobManager->RunJobs();
+}
+
+// jobs with dependencies on top of the job manager: a job is queued by whichever thread finishes the last job it
+// depends on. Run() queues the jobs without dependencies and then helps until the whole graph is done
+class JobGraph
+{
+public:
+	typedef uint32_t Node;
+	// dependencies are nodes added before this one; a callerThread job only runs on the thread that calls Run(), for
+	// work that has to stay on the main thread (glfw)
+	Node Add(const char* name, std::function<void()> work, std::initializer_list<Node> dependencies = {}, bool callerThread = false);
+	// rethrows the first exception a job threw; the jobs still queued after it are skipped
+	void Run();
+	// when each job ran, and the critical path: from the job that finished last back through the dependency that
+	// finished last, i.e. the chain that Run() actually waited on
+	void Report(const char* label) const;
+protected:
+	struct Task : public Job
+	{
+		void Main() override;
+		JobGraph* graph = nullptr;
+		const char* name = nullptr;
+		std::function<void()> work;
+		std::vector<Node> dependencies, successors;
+		std::atomic<uint32_t> waiting{ 0 };			// dependencies not done yet
+		bool callerThread = false;
+		float start = 0.0f, end = 0.0f;				// seconds since Run()
+	};
+	void Queue(Task* task);
+	std::vector<std::unique_ptr<Task>> m_Tasks;
+	std::atomic<int64_t> m_Remaining{ 0 };
+	std::mutex m_Lock;								// guards m_CallerTasks and m_Exception
+	std::vector<Task*> m_CallerTasks;
+	std::exception_ptr m_Exception;
+	std::atomic<bool> m_Failed{ false };
+	Timer m_Timer;
+	float m_Elapsed = 0.0f;
+};
+
+// data parallel loops on the job manager, split lazily (Tzannes, Caragea, Barua, Vishkin: "Lazy Binary Splitting"): a
+// thread works through its range a piece of grain elements at a time and, whenever its own queue has run empty, first
+// hands the upper half of what is left to the other threads. ranges are split about as often as threads come asking,
+// so the grain only has to cover the cost of a call. grain 0 picks one from the count and the thread count; a grain of
+// the whole range runs it inline
+template <class Body>
+class ParallelLoop
+{
+public:
+	ParallelLoop(Body& body, size_t begin, size_t end, size_t grain) : m_Body(body), m_Begin(begin), m_End(end), m_Grain(grain) {}
+	// runs the range and helps until every piece is done, then rethrows the first exception the body threw
+	void Run()
+	{
+		JobManager* jobManager = JobManager::GetJobManager();
+		const size_t count = m_End > m_Begin ? m_End - m_Begin : 0, threads = jobManager->GetNumThreads();
+		if (m_Grain == 0) m_Grain = std::max<size_t>(count / (threads * 64), 1);
+		m_Split = threads > 1 && count > m_Grain;
+		RunRange(m_Begin, m_End);
+		m_Remaining.fetch_sub(1, std::memory_order_acq_rel);
+		while (m_Remaining.load(std::memory_order_acquire) > 0)
+			if (!jobManager->RunJob()) std::this_thread::yield();
+		if (m_Exception) std::rethrow_exception(m_Exception);
+	}
+protected:
+	class RangeJob : public Job
+	{
+	public:
+		RangeJob(ParallelLoop& loop, size_t begin, size_t end) : m_Loop(loop), m_Begin(begin), m_End(end) {}
+		void Main() override
+		{
+			m_Loop.RunRange(m_Begin, m_End);
+			delete this;
+		}
+	protected:
+		ParallelLoop& m_Loop;
+		size_t m_Begin, m_End;
+	};
+	void RunRange(size_t begin, size_t end)
+	{
+		JobManager* jobManager = JobManager::GetJobManager();
+		try
+		{
+			auto context = m_Body.Begin();
+			while (begin < end && !m_Failed.load(std::memory_order_relaxed))
+			{
+				if (m_Split && end - begin > m_Grain && jobManager->IsQueueEmpty())
+				{
+					size_t middle = begin + (end - begin) / 2;
+					m_Remaining.fetch_add(1, std::memory_order_relaxed);
+					jobManager->Spawn(new RangeJob(*this, middle, end), &m_Remaining);
+					end = middle;
+					continue;
+				}
+				size_t next = end - begin > m_Grain ? begin + m_Grain : end;
+				m_Body(begin, next, context);
+				begin = next;
+			}
+			m_Body.End(context);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(m_Lock);
+			if (!m_Exception) m_Exception = std::current_exception();
+			m_Failed.store(true, std::memory_order_relaxed);
+		}
+	}
+	Body& m_Body;
+	size_t m_Begin, m_End, m_Grain;
+	bool m_Split = false;
+	std::atomic<int64_t> m_Remaining{ 1 };			// the caller's range, and one per job spawned
+	std::atomic<bool> m_Failed{ false };
+	std::mutex m_Lock;								// guards m_Exception
+	std::exception_ptr m_Exception;
+};
+
+// scratch memory for ParallelFor bodies: each thread running a part of a loop holds one S for as long as it does, so
+// no two threads share one. they are made as needed and kept, a pool that lives across loops (or frames) allocates
+// about once per thread
+template <class S>
+class ScratchPool
+{
+public:
+	class Lease
+	{
+	public:
+		Lease(ScratchPool& pool) : m_Pool(pool), m_Scratch(pool.Acquire()) {}
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+		~Lease() { m_Pool.Release(m_Scratch); }
+		S& Get() { return *m_Scratch; }
+	protected:
+		ScratchPool& m_Pool;
+		S* m_Scratch;
+	};
+	S* Acquire()
+	{
+		std::lock_guard<std::mutex> lock(m_Lock);
+		if (m_Free.empty())
+		{
+			m_Scratch.emplace_back(new S());
+			return m_Scratch.back().get();
+		}
+		S* scratch = m_Free.back();
+		m_Free.pop_back();
+		return scratch;
+	}
+	void Release(S* scratch)
+	{
+		std::lock_guard<std::mutex> lock(m_Lock);
+		m_Free.push_back(scratch);
+	}
+protected:
+	std::mutex m_Lock;
+	std::vector<std::unique_ptr<S>> m_Scratch;
+	std::vector<S*> m_Free;
 };
 
+// fn(begin, end) for pieces of [begin, end), returns when all of them are done
+template <class F>
+void ParallelFor(size_t begin, size_t end, size_t grain, F fn)
+{
+	struct Body
+	{
+		F& fn;
+		int Begin() { return 0; }
+		void operator()(size_t first, size_t last, int&) { fn(first, last); }
+		void End(int&) {}
+	} body{ fn };
+	ParallelLoop<Body>(body, begin, end, grain).Run();
+}
+
+// fn(begin, end, scratch) with a scratch from the pool that is the calling thread's until its share of the loop is done
+template <class S, class F>
+void ParallelFor(size_t begin, size_t end, size_t grain, ScratchPool<S>& scratch, F fn)
+{
+	struct Body
+	{
+		F& fn;
+		ScratchPool<S>& pool;
+		typename ScratchPool<S>::Lease Begin() { return typename ScratchPool<S>::Lease(pool); }
+		void operator()(size_t first, size_t last, typename ScratchPool<S>::Lease& lease) { fn(first, last, lease.Get()); }
+		void End(typename ScratchPool<S>::Lease&) {}
+	} body{ fn, scratch };
+	ParallelLoop<Body>(body, begin, end, grain).Run();
+}
+
+// fn(begin, end, value) folds a piece into value and returns it; every thread's share starts from identity and the
+// shares are merged with combine(a, b) in no particular order, so combine has to be associative and commutative (float
+// sums differ in the last bits from run to run)
+template <class T, class F, class C>
+T ParallelReduce(size_t begin, size_t end, size_t grain, const T& identity, F fn, C combine)
+{
+	struct Body
+	{
+		F& fn;
+		C& combine;
+		const T& identity;
+		T result;
+		std::mutex lock;
+		T Begin() { return identity; }
+		void operator()(size_t first, size_t last, T& value) { value = fn(first, last, std::move(value)); }
+		void End(T& value)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			result = combine(std::move(result), std::move(value));
+		}
+	} body{ fn, combine, identity, identity };
+	ParallelLoop<Body>(body, begin, end, grain).Run();
+	return std::move(body.result);
+}
+#ifdef PARALLEL_BENCHMARK
+// a loop with even and with uneven per element cost: serial, in fixed bands of jobs (how the converted loops were
+// split), with ParallelFor and with ParallelReduce
+void BenchmarkParallelFor();
+#endif
+
 // forward declaration of helper functions
 void FatalError(const char* fmt, ...);			// seem to use in OpenCL which is not used in this project
 bool FileIsNewer(const char* file1, const char* file2);
@@ -145,14 +441,34 @@ void TextFileWrite(const std::string& text, const char* _File);
 
 // #include <iostream>
 #include <bitset>
+#ifdef _WIN32
 #include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
 
 // instruction set detection
 #ifdef _WIN32
 #define cpuid(info, x) __cpuidex(info, x, 0)
 #else
 #include <cpuid.h>
-void cpuid(int info[4], int InfoType) { __cpuid_count(InfoType, 0, info[0], info[1], info[2], info[3]); }
+inline void cpuid(int info[4], int InfoType) { __cpuid_count(InfoType, 0, info[0], info[1], info[2], info[3]); }
+#endif
+#ifdef _MSC_VER
+inline unsigned long long xgetbv0() { return _xgetbv(0); }
+#else
+inline unsigned long long xgetbv0() { unsigned int lo, hi; __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0)); return ((unsigned long long)hi << 32) | lo; }
+#endif
+
+// instruction set of a runtime dispatched kernel (MSVC compiles any intrinsic without one)
+#ifdef _MSC_VER
+#define TARGET_SSE41
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
 #endif
 class CPUCaps // from https://github.com/Mysticial/FeatureDetector
 {
@@ -191,6 +507,9 @@ public:
 	static inline bool HW_AVX512DQ = false;   //  AVX512 Doubleword + Quadword
 	static inline bool HW_AVX512IFMA = false; //  AVX512 Integer 52-bit Fused Multiply-Add
 	static inline bool HW_AVX512VBMI = false; //  AVX512 Vector Byte Manipulation Instructions
+	//  OS support (the register state is saved on context switches)
+	static inline bool OS_AVX = false;
+	static inline bool OS_AVX512 = false;
 	// constructor
 	CPUCaps()
 	{
@@ -214,6 +533,12 @@ public:
 			HW_AVX = (info[2] & ((int)1 << 28)) != 0;
 			HW_FMA3 = (info[2] & ((int)1 << 12)) != 0;
 			HW_RDRAND = (info[2] & ((int)1 << 30)) != 0;
+			if (info[2] & ((int)1 << 27))	// OSXSAVE
+			{
+				unsigned long long xcr0 = xgetbv0();
+				OS_AVX = (xcr0 & 0x6) == 0x6;
+				OS_AVX512 = (xcr0 & 0xe6) == 0xe6;
+			}
 		}
 		if (nIds >= 0x00000007)
 		{
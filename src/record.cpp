@@ -0,0 +1,122 @@
+#include "precomp.h"
+
+class RecordJob : public Job
+{
+public:
+	void Main() override;
+	VkDevice m_Device;
+	VkCommandPool m_Pool;
+	VkCommandBuffer m_CommandBuffer;
+	const DrawState* m_State;
+	const DrawCommand* m_Draws;
+	uint32_t m_DrawCount;
+	VkResult m_Result;
+	int m_Pass;
+};
+
+void RecordJob::Main() {
+	// the pool holds only this job's buffer, resetting it as a whole is cheaper than resetting the buffer
+	m_Result = vkResetCommandPool(m_Device, m_Pool, 0);
+	if (m_Result != VK_SUCCESS)
+		return;
+
+	VkCommandBufferInheritanceInfo inheritanceInfo{};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.renderPass = m_State->renderPass;
+	inheritanceInfo.subpass = 0;
+	inheritanceInfo.framebuffer = m_State->framebuffer;
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+	m_Result = vkBeginCommandBuffer(m_CommandBuffer, &beginInfo);
+	if (m_Result != VK_SUCCESS)
+		return;
+	CommandRecorder::RecordDraws(m_CommandBuffer, *m_State, m_Draws, m_DrawCount);
+	m_Result = vkEndCommandBuffer(m_CommandBuffer);
+}
+
+void CommandRecorder::Create(VkDevice device, uint32_t queueFamily, uint32_t frameCount, uint32_t jobCount) {
+	m_Device = device;
+	m_JobCount = std::max(jobCount, 1u);
+	m_Pools.resize(frameCount * m_JobCount);
+	m_CommandBuffers.resize(m_Pools.size());
+
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = queueFamily;
+
+	for (size_t i = 0; i < m_Pools.size(); i++) {
+		if (vkCreateCommandPool(device, &poolInfo, nullptr, &m_Pools[i]) != VK_SUCCESS)
+			throw std::runtime_error("failed to create command pool!");
+
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = m_Pools[i];
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		allocInfo.commandBufferCount = 1;
+		if (vkAllocateCommandBuffers(device, &allocInfo, &m_CommandBuffers[i]) != VK_SUCCESS)
+			throw std::runtime_error("failed to allocate command buffers!");
+	}
+}
+
+void CommandRecorder::Destroy() {
+	// destroying a pool frees its command buffers
+	for (VkCommandPool pool : m_Pools)
+		vkDestroyCommandPool(m_Device, pool, nullptr);
+	m_Pools.clear();
+	m_CommandBuffers.clear();
+}
+
+void CommandRecorder::Record(VkCommandBuffer primary, uint32_t frame, const DrawState& state, const std::vector<DrawCommand>& draws, uint32_t jobCount) {
+	jobCount = std::min(jobCount, m_JobCount);
+	uint32_t drawCount = static_cast<uint32_t>(draws.size());
+
+	std::vector<RecordJob> jobs(jobCount);
+	for (uint32_t i = 0; i < jobCount; i++) {
+		uint32_t first = static_cast<uint32_t>(static_cast<uint64_t>(drawCount) * i / jobCount);
+		uint32_t end = static_cast<uint32_t>(static_cast<uint64_t>(drawCount) * (i + 1) / jobCount);
+		jobs[i].m_Device = m_Device;
+		jobs[i].m_Pool = m_Pools[frame * m_JobCount + i];
+		jobs[i].m_CommandBuffer = m_CommandBuffers[frame * m_JobCount + i];
+		jobs[i].m_State = &state;
+		jobs[i].m_Draws = draws.data() + first;
+		jobs[i].m_DrawCount = end - first;
+		jobs[i].m_Result = VK_SUCCESS;
+	}
+	RunJobPass(jobs, 0, jobCount);
+
+	for (const RecordJob& job : jobs)
+		if (job.m_Result != VK_SUCCESS)
+			throw std::runtime_error("failed to record command buffer!");
+	vkCmdExecuteCommands(primary, jobCount, &m_CommandBuffers[frame * m_JobCount]);
+}
+
+void CommandRecorder::RecordDraws(VkCommandBuffer commandBuffer, const DrawState& state, const DrawCommand* draws, uint32_t drawCount) {
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipeline);
+
+	VkViewport viewport{};
+	viewport.x = 0.0f;
+	viewport.y = 0.0f;
+	viewport.width = (float)state.extent.width;
+	viewport.height = (float)state.extent.height;
+	viewport.minDepth = 0.0f;
+	viewport.maxDepth = 1.0f;
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+	VkRect2D scissor{};
+	scissor.offset = { 0, 0 };
+	scissor.extent = state.extent;
+	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+	VkDeviceSize offset = 0;
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1, &state.vertexBuffer, &offset);
+	vkCmdBindIndexBuffer(commandBuffer, state.indexBuffer, 0, state.indexType);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state.layout, 0, 1, &state.descriptorSet, 0, nullptr);
+
+	for (uint32_t i = 0; i < drawCount; i++)
+		vkCmdDrawIndexed(commandBuffer, draws[i].indexCount, 1, draws[i].firstIndex, draws[i].vertexOffset, 0);
+}
@@ -0,0 +1,237 @@
+#include "precomp.h"
+
+void UploadContext::Create(VkDevice device, VmaAllocator allocator, VkQueue queue, uint32_t queueFamily, uint32_t graphicsFamily, VkDeviceSize ringSize) {
+	m_Device = device;
+	m_Allocator = allocator;
+	m_Queue = queue;
+	m_QueueFamily = queueFamily;
+	m_GraphicsFamily = graphicsFamily;
+	m_Size = ringSize;
+	m_Head = m_Tail = 0;
+	m_NextTicket = 1;
+	m_Completed = 0;
+	m_WaitCount = 0;
+
+	VkBufferCreateInfo bufferInfo{};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = ringSize;
+	bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	VmaAllocationCreateInfo allocInfo{};
+	allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
+	allocInfo.flags = HOST_WRITE_ALLOCATION;
+
+	VmaAllocationInfo allocationInfo;
+	if (vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &m_Buffer, &m_Allocation, &allocationInfo) != VK_SUCCESS)
+		throw std::runtime_error("failed to create staging ring!");
+	m_Data = static_cast<uint8_t*>(allocationInfo.pMappedData);
+
+	// batches are short lived and never re-recorded: transient, and every buffer is reset when its batch retires
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	poolInfo.queueFamilyIndex = queueFamily;
+	if (vkCreateCommandPool(device, &poolInfo, nullptr, &m_CommandPool) != VK_SUCCESS)
+		throw std::runtime_error("failed to create upload command pool!");
+}
+
+void UploadContext::Destroy() {
+	if (m_Buffer == VK_NULL_HANDLE)
+		return;
+	if (m_CommandBuffer != VK_NULL_HANDLE)
+		Submit();
+	while (!m_Batches.empty())
+		WaitOldest();
+	for (VkFence fence : m_FreeFences)
+		vkDestroyFence(m_Device, fence, nullptr);
+	m_FreeFences.clear();
+	m_FreeCommandBuffers.clear();
+	vkDestroyCommandPool(m_Device, m_CommandPool, nullptr);
+	vmaDestroyBuffer(m_Allocator, m_Buffer, m_Allocation);
+	m_Buffer = VK_NULL_HANDLE;
+	m_Data = nullptr;
+}
+
+VkDeviceSize UploadContext::Allocate(VkDeviceSize size, VkDeviceSize alignment) {
+	if (size > m_Size)
+		throw std::runtime_error("staging allocation is larger than the staging ring!");
+
+	Reclaim();
+	for (;;) {
+		// an empty ring starts over at the beginning of the buffer
+		if (m_Batches.empty() && m_Head == m_Tail)
+			m_Head = m_Tail = (m_Head + m_Size - 1) / m_Size * m_Size;
+
+		uint64_t position = (m_Head + alignment - 1) / alignment * alignment;
+		// an allocation never wraps around the end of the buffer, the rest of it is skipped instead
+		if (position % m_Size + size > m_Size)
+			position = (position / m_Size + 1) * m_Size;
+		if (position + size - m_Tail <= m_Size) {
+			m_Head = position + size;
+			return position % m_Size;
+		}
+
+		// the open batch holds the rest of the ring: submit it so its space can come back
+		if (m_Batches.empty())
+			Submit();
+		WaitOldest();
+	}
+}
+
+VkCommandBuffer UploadContext::GetCommandBuffer() {
+	if (m_CommandBuffer != VK_NULL_HANDLE)
+		return m_CommandBuffer;
+
+	if (!m_FreeCommandBuffers.empty()) {
+		m_CommandBuffer = m_FreeCommandBuffers.back();
+		m_FreeCommandBuffers.pop_back();
+	}
+	else {
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandPool = m_CommandPool;
+		allocInfo.commandBufferCount = 1;
+		if (vkAllocateCommandBuffers(m_Device, &allocInfo, &m_CommandBuffer) != VK_SUCCESS)
+			throw std::runtime_error("failed to allocate upload command buffer!");
+	}
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(m_CommandBuffer, &beginInfo);
+	return m_CommandBuffer;
+}
+
+uint64_t UploadContext::Submit(VkSemaphore signal) {
+	bool handOver = signal != VK_NULL_HANDLE && (!m_ImageAcquires.empty() || !m_BufferAcquires.empty());
+	// allocations without commands still need a batch to give their space back, released resources one to signal
+	if (m_CommandBuffer == VK_NULL_HANDLE && (m_Batches.empty() ? m_Tail : m_Batches.back().end) == m_Head && !handOver)
+		return m_NextTicket - 1;
+	VkCommandBuffer commandBuffer = GetCommandBuffer();
+	vkEndCommandBuffer(commandBuffer);
+	m_CommandBuffer = VK_NULL_HANDLE;
+
+	VkFence fence;
+	if (!m_FreeFences.empty()) {
+		fence = m_FreeFences.back();
+		m_FreeFences.pop_back();
+	}
+	else {
+		VkFenceCreateInfo fenceInfo{};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		if (vkCreateFence(m_Device, &fenceInfo, nullptr, &fence) != VK_SUCCESS)
+			throw std::runtime_error("failed to create upload fence!");
+	}
+
+	// does nothing when the ring ended up in host coherent memory
+	vmaFlushAllocation(m_Allocator, m_Allocation, 0, VK_WHOLE_SIZE);
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &commandBuffer;
+	if (handOver) {
+		// the semaphore signal covers every batch submitted before this one too
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &signal;
+		m_ReadyImageAcquires.insert(m_ReadyImageAcquires.end(), m_ImageAcquires.begin(), m_ImageAcquires.end());
+		m_ReadyBufferAcquires.insert(m_ReadyBufferAcquires.end(), m_BufferAcquires.begin(), m_BufferAcquires.end());
+		m_ReadyAcquireStages |= m_AcquireStages;
+		m_ImageAcquires.clear();
+		m_BufferAcquires.clear();
+		m_AcquireStages = 0;
+	}
+	if (vkQueueSubmit(m_Queue, 1, &submitInfo, fence) != VK_SUCCESS)
+		throw std::runtime_error("failed to submit upload command buffer!");
+
+	m_Batches.push_back({ m_NextTicket, m_Head, fence, commandBuffer });
+	return m_NextTicket++;
+}
+
+// barrier is the transition that ends the upload (TRANSFER_WRITE to the access of the graphics side). on the graphics
+// queue family it is recorded as it is, otherwise it becomes the release half of an ownership transfer and the acquire
+// half waits for the graphics queue: a release ignores the destination access and an acquire the source access
+void UploadContext::ReleaseImage(VkImageMemoryBarrier barrier, VkPipelineStageFlags dstStage) {
+	if (m_QueueFamily == m_GraphicsFamily) {
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		vkCmdPipelineBarrier(GetCommandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+		return;
+	}
+	barrier.srcQueueFamilyIndex = m_QueueFamily;
+	barrier.dstQueueFamilyIndex = m_GraphicsFamily;
+	VkAccessFlags dstAccessMask = barrier.dstAccessMask;
+	barrier.dstAccessMask = 0;
+	vkCmdPipelineBarrier(GetCommandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = dstAccessMask;
+	m_ImageAcquires.push_back(barrier);
+	m_AcquireStages |= dstStage;
+}
+
+void UploadContext::ReleaseBuffer(VkBufferMemoryBarrier barrier, VkPipelineStageFlags dstStage) {
+	if (m_QueueFamily == m_GraphicsFamily) {
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		vkCmdPipelineBarrier(GetCommandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+		return;
+	}
+	barrier.srcQueueFamilyIndex = m_QueueFamily;
+	barrier.dstQueueFamilyIndex = m_GraphicsFamily;
+	VkAccessFlags dstAccessMask = barrier.dstAccessMask;
+	barrier.dstAccessMask = 0;
+	vkCmdPipelineBarrier(GetCommandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = dstAccessMask;
+	m_BufferAcquires.push_back(barrier);
+	m_AcquireStages |= dstStage;
+}
+
+// the acquires chain to the semaphore wait through their source stages, which are the stages the wait blocks
+void UploadContext::RecordAcquires(VkCommandBuffer commandBuffer) {
+	if (m_ReadyAcquireStages == 0)
+		return;
+	vkCmdPipelineBarrier(commandBuffer, m_ReadyAcquireStages, m_ReadyAcquireStages, 0, 0, nullptr,
+		static_cast<uint32_t>(m_ReadyBufferAcquires.size()), m_ReadyBufferAcquires.data(),
+		static_cast<uint32_t>(m_ReadyImageAcquires.size()), m_ReadyImageAcquires.data());
+	m_ReadyImageAcquires.clear();
+	m_ReadyBufferAcquires.clear();
+	m_ReadyAcquireStages = 0;
+}
+
+bool UploadContext::IsComplete(uint64_t ticket) {
+	Reclaim();
+	return m_Completed >= ticket;
+}
+
+void UploadContext::Wait(uint64_t ticket) {
+	Reclaim();
+	while (m_Completed < ticket)
+		WaitOldest();
+}
+
+void UploadContext::Reclaim() {
+	while (!m_Batches.empty() && vkGetFenceStatus(m_Device, m_Batches.front().fence) == VK_SUCCESS)
+		Retire();
+}
+
+void UploadContext::WaitOldest() {
+	m_WaitCount++;
+	vkWaitForFences(m_Device, 1, &m_Batches.front().fence, VK_TRUE, UINT64_MAX);
+	Retire();
+}
+
+void UploadContext::Retire() {
+	Batch& batch = m_Batches.front();
+	vkResetFences(m_Device, 1, &batch.fence);
+	m_FreeFences.push_back(batch.fence);
+	vkResetCommandBuffer(batch.commandBuffer, 0);
+	m_FreeCommandBuffers.push_back(batch.commandBuffer);
+	m_Tail = batch.end;
+	m_Completed = batch.ticket;
+	m_Batches.pop_front();
+}
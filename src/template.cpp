@@ -1,5 +1,13 @@
 #include "precomp.h"
 #include "Vulkan_Experiment_01.h"
+#include "texture.h"
+#include "mesh.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #ifndef __DEBUG__
 #pragma comment( linker, "/subsystem:windows /ENTRY:mainCRTStartup" )
@@ -17,8 +25,42 @@ extern "C"
 }
 #endif
 
-int main() {
+int main(int argc, char** argv) {
+	// converter mode: bake a texture with its mip chain and exit
+	if (argc >= 3 && strcmp(argv[1], "--bake-texture") == 0) {
+		std::string target = argc >= 4 ? argv[3] : GetBakedTexturePath(argv[2]);
+		if (!BakeTexture(argv[2], target)) {
+			std::cerr << "failed to bake " << argv[2] << std::endl;
+			return EXIT_FAILURE;
+		}
+		std::cout << "baked " << argv[2] << " -> " << target << std::endl;
+		return EXIT_SUCCESS;
+	}
+
+#ifdef JOB_BENCHMARK
+	JobManager::Benchmark();
+#endif
+#ifdef AFFINITY_BENCHMARK
+	JobManager::AffinityBenchmark();
+#endif
+	// created before the window and the instance, initVulkan runs on the job manager
+	JobManager::GetJobManager();
+#ifdef PARALLEL_BENCHMARK
+	BenchmarkParallelFor();
+#endif
+
 	MyVulkanApplication app;
+	for (int i = 1; i + 1 < argc; i++)
+		if (strcmp(argv[i], "--frames-in-flight") == 0)
+			app.setFramesInFlight(static_cast<uint32_t>(atoi(argv[i + 1])));
+		else if (strcmp(argv[i], "--vertex-format") == 0) {
+			VertexFormat format;
+			if (!ParseVertexFormat(argv[i + 1], format)) {
+				std::cerr << "unknown vertex format " << argv[i + 1] << " (float, half or quantized)" << std::endl;
+				return EXIT_FAILURE;
+			}
+			app.setVertexFormat(format);
+		}
 
 	try
 	{
@@ -34,97 +76,408 @@ int main() {
 }
 
 #pragma region Jobmanager
-DWORD JobThreadProc(LPVOID lpParameter)
-{
-	JobThread* JobThreadInstance = (JobThread*)lpParameter;
-	JobThreadInstance->BackgroundTask();
-	return 0;
-}
-
-void JobThread::CreateAndStartThread(unsigned int threadId)
+// Chase-Lev work-stealing deque (Le, Pop, Cohen, Zappa Nardelli: "Correct and Efficient Work-Stealing for Weak Memory
+// Models"): the owner pushes and pops at the bottom, thieves take from the top; only the last job is contended, and
+// that is settled with a CAS on top. the ring doubles when full, replaced rings stay alive until the deque goes (a
+// thief may still be reading one)
+class WorkStealingDeque
 {
-	m_GoSignal = CreateEvent(0, FALSE, FALSE, 0);
-	m_ThreadHandle = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)&JobThreadProc, (LPVOID)this, 0, 0);
-	m_ThreadID = threadId;
-}
-void JobThread::BackgroundTask()
-{
-	while (1)
+public:
+	WorkStealingDeque() { m_Rings.emplace_back(new Ring(256)); m_Ring.store(m_Rings.back().get(), std::memory_order_relaxed); }
+	// owner only
+	void Push(Job* job)
 	{
-		WaitForSingleObject(m_GoSignal, INFINITE);
-		while (1)
+		int64_t bottom = m_Bottom.load(std::memory_order_relaxed);
+		int64_t top = m_Top.load(std::memory_order_acquire);
+		Ring* ring = m_Ring.load(std::memory_order_relaxed);
+		if (bottom - top > ring->mask)
 		{
-			Job* job = JobManager::GetJobManager()->GetNextJob();
-			if (!job)
-			{
-				JobManager::GetJobManager()->ThreadDone(m_ThreadID);
-				break;
-			}
-			job->RunCodeWrapper();
+			Ring* grown = new Ring((ring->mask + 1) * 2);
+			for (int64_t i = top; i < bottom; i++) grown->Put(i, ring->Get(i));
+			m_Rings.emplace_back(grown);
+			m_Ring.store(grown, std::memory_order_release);
+			ring = grown;
 		}
+		ring->Put(bottom, job);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_Bottom.store(bottom + 1, std::memory_order_relaxed);
 	}
-}
+	// owner only, newest first
+	Job* Pop()
+	{
+		int64_t bottom = m_Bottom.load(std::memory_order_relaxed) - 1;
+		Ring* ring = m_Ring.load(std::memory_order_relaxed);
+		m_Bottom.store(bottom, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t top = m_Top.load(std::memory_order_relaxed);
+		if (top > bottom)
+		{
+			m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		Job* job = ring->Get(bottom);
+		if (top == bottom)
+		{
+			// the last job: a thief may be after it as well
+			if (!m_Top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) job = nullptr;
+			m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+		}
+		return job;
+	}
+	// any thread, oldest first; nullptr when empty or when another thread won the job
+	Job* Steal()
+	{
+		int64_t top = m_Top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t bottom = m_Bottom.load(std::memory_order_acquire);
+		if (top >= bottom) return nullptr;
+		Job* job = m_Ring.load(std::memory_order_acquire)->Get(top);
+		if (!m_Top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+		return job;
+	}
+	// owner only
+	bool IsEmpty() const { return m_Bottom.load(std::memory_order_relaxed) <= m_Top.load(std::memory_order_relaxed); }
+protected:
+	struct Ring
+	{
+		Ring(int64_t size) : mask(size - 1), slots(new std::atomic<Job*>[size]) {}
+		Job* Get(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+		void Put(int64_t i, Job* job) { slots[i & mask].store(job, std::memory_order_relaxed); }
+		int64_t mask;
+		std::unique_ptr<std::atomic<Job*>[]> slots;
+	};
+	alignas(64) std::atomic<int64_t> m_Top{ 0 };
+	alignas(64) std::atomic<int64_t> m_Bottom{ 0 };
+	std::atomic<Ring*> m_Ring;
+	std::vector<std::unique_ptr<Ring>> m_Rings;		// owner only
+};
+
+// the workers a thread steals from, nearest first: victims[0, tierEnds[0]) are at distance 0, and so on
+struct StealOrder
+{
+	std::vector<int> victims;
+	std::vector<size_t> tierEnds;
+};
+
+struct JobWorker
+{
+	WorkStealingDeque deque;
+	std::thread thread;
+	CpuInfo place = { -1, -1, -1, -1 };				// place.cpu is -1 for a worker that is not pinned
+	StealOrder steal;
+};
 
-void JobThread::Go()
+static void BuildStealOrder(StealOrder& order, const std::vector<std::unique_ptr<JobWorker>>& workers, const CpuInfo& place, int self)
 {
-	SetEvent(m_GoSignal);
+	for (int tier = 0; tier <= 3; tier++)
+	{
+		for (int i = 0; i < (int)workers.size(); i++)
+			if (i != self && (place.cpu < 0 || workers[i]->place.cpu < 0 ? 3 : CpuTopology::GetDistance(place, workers[i]->place)) == tier)
+				order.victims.push_back(i);
+		order.tierEnds.push_back(order.victims.size());
+	}
 }
 
+// the worker the calling thread is (-1 for any other thread), and the jobs it added for its next RunJobs
+static thread_local JobManager* t_JobManager = nullptr;
+static thread_local int t_Worker = -1;
+static thread_local std::vector<Job*> t_Batch;
+static thread_local uint32_t t_VictimSeed = 0x9e3779b9u;
+
 void Job::RunCodeWrapper()
 {
+	std::atomic<int64_t>* remaining = m_Remaining;
 	Main();
+	// the batch owner may release the job right after this
+	remaining->fetch_sub(1, std::memory_order_acq_rel);
 }
 
 JobManager* JobManager::m_JobManager = 0;
 
-JobManager::JobManager(unsigned int threads) : m_NumThreads(threads)
+JobManager::JobManager(unsigned int threads, bool affinity) : m_NumThreads(std::max(threads, 1u)), m_CallerSteal(new StealOrder())
 {
-	InitializeCriticalSection(&m_CS);
+	for (unsigned int i = 0; i + 1 < m_NumThreads; i++) m_Workers.emplace_back(new JobWorker());
+
+	// the first core is kept for the creating thread. the workers go one per core over the others, in topology order so that
+	// neighbouring workers share a cache, then onto the SMT siblings; with more workers than that they share
+	CpuInfo callerPlace = { -1, -1, -1, -1 };
+	CpuTopology topology;
+	if (affinity) topology = CpuTopology::Query();
+	std::vector<CpuInfo> slots;
+	for (int pass = 0; pass < 2 && !topology.cpus.empty(); pass++)
+		for (size_t i = 0; i < topology.cpus.size(); i++)
+		{
+			const CpuInfo& cpu = topology.cpus[i];
+			bool firstOfCore = i == 0 || topology.cpus[i - 1].core != cpu.core;
+			if (cpu.core != topology.cpus[0].core && firstOfCore == (pass == 0)) slots.push_back(cpu);
+		}
+	if (!slots.empty())
+	{
+		// the creating thread is not narrowed here: whatever it starts before PinRenderThread (glfw, the Vulkan loader
+		// and driver) inherits its affinity
+		for (const CpuInfo& cpu : topology.cpus)
+		{
+			(cpu.core == topology.cpus[0].core ? m_RenderCpus : m_BackgroundCpus).push_back(cpu.cpu);
+			m_ProcessCpus.push_back(cpu.cpu);
+		}
+		callerPlace = topology.cpus[0];
+		for (size_t i = 0; i < m_Workers.size(); i++) m_Workers[i]->place = slots[i % slots.size()];
+	}
+	for (size_t i = 0; i < m_Workers.size(); i++) BuildStealOrder(m_Workers[i]->steal, m_Workers, m_Workers[i]->place, (int)i);
+	BuildStealOrder(*m_CallerSteal, m_Workers, callerPlace, -1);
+
+	// the deques exist before any worker may steal from them
+	for (unsigned int i = 0; i < m_Workers.size(); i++) m_Workers[i]->thread = std::thread(&JobManager::WorkerLoop, this, (int)i);
 }
 
 JobManager::~JobManager()
 {
-	DeleteCriticalSection(&m_CS);
+	{
+		std::lock_guard<std::mutex> lock(m_SleepLock);
+		m_Stop = true;
+	}
+	m_WakeSignal.notify_all();
+	for (auto& worker : m_Workers) worker->thread.join();
 }
 
 void JobManager::CreateJobManager(unsigned int numThreads)
 {
 	m_JobManager = new JobManager(numThreads);
-	m_JobManager->m_JobThreadList = new JobThread[numThreads];
-	for (unsigned int i = 0; i < numThreads; i++)
+}
+
+void JobManager::AddJob2(Job* a_Job)
+{
+	t_Batch.push_back(a_Job);
+}
+
+void JobManager::RunJobs()
+{
+	if (t_Batch.empty()) return;
+	std::atomic<int64_t> remaining((int64_t)t_Batch.size());
+	for (Job* job : t_Batch) job->m_Remaining = &remaining;
+
+	int worker = t_JobManager == this ? t_Worker : -1;
+	if (worker >= 0)
+		for (Job* job : t_Batch) m_Workers[worker]->deque.Push(job);
+	else
 	{
-		m_JobManager->m_JobThreadList[i].CreateAndStartThread(i);
-		m_JobManager->m_ThreadDone[i] = CreateEvent(0, FALSE, FALSE, 0);
+		std::lock_guard<std::mutex> lock(m_SharedLock);
+		m_Shared.insert(m_Shared.end(), t_Batch.begin(), t_Batch.end());
+		m_SharedSize.store(m_Shared.size(), std::memory_order_relaxed);
 	}
-	m_JobManager->m_JobCount = 0;
+	m_Queued.fetch_add((int64_t)t_Batch.size());
+	t_Batch.clear();
+	Wake();
+
+	// help rather than wait
+	while (remaining.load(std::memory_order_acquire) > 0)
+		if (!RunJob()) std::this_thread::yield();
 }
 
-void JobManager::AddJob2(Job* a_Job)
+void JobManager::Spawn(Job* a_Job, std::atomic<int64_t>* remaining)
 {
-	m_JobList[m_JobCount++] = a_Job;
+	a_Job->m_Remaining = remaining;
+	int worker = t_JobManager == this ? t_Worker : -1;
+	if (worker >= 0) m_Workers[worker]->deque.Push(a_Job);
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_SharedLock);
+		m_Shared.push_back(a_Job);
+		m_SharedSize.store(m_Shared.size(), std::memory_order_relaxed);
+	}
+	m_Queued.fetch_add(1);
+	Wake();
 }
 
-Job* JobManager::GetNextJob()
+bool JobManager::RunJob()
 {
-	Job* job = 0;
-	EnterCriticalSection(&m_CS);
-	if (m_JobCount > 0) job = m_JobList[--m_JobCount];
-	LeaveCriticalSection(&m_CS);
+	Job* job = FindJob(t_JobManager == this ? t_Worker : -1);
+	if (!job) return false;
+	job->RunCodeWrapper();
+	return true;
+}
+
+bool JobManager::IsQueueEmpty()
+{
+	int worker = t_JobManager == this ? t_Worker : -1;
+	if (worker >= 0) return m_Workers[worker]->deque.IsEmpty();
+	return m_SharedSize.load(std::memory_order_relaxed) == 0;
+}
+
+Job* JobManager::FindJob(int worker)
+{
+	Job* job = nullptr;
+	if (worker >= 0) job = m_Workers[worker]->deque.Pop();
+	if (!job && m_SharedSize.load(std::memory_order_relaxed) > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_SharedLock);
+		if (!m_Shared.empty())
+		{
+			job = m_Shared.front();
+			m_Shared.pop_front();
+			m_SharedSize.store(m_Shared.size(), std::memory_order_relaxed);
+		}
+	}
+	if (!job && !m_Workers.empty())
+	{
+		// one round over the other workers: the SMT sibling first, then the ones sharing the last level cache, the node
+		// and the rest, each group from a random one on so thieves spread out
+		const StealOrder& order = worker >= 0 ? m_Workers[worker]->steal : *m_CallerSteal;
+		t_VictimSeed ^= t_VictimSeed << 13, t_VictimSeed ^= t_VictimSeed >> 17, t_VictimSeed ^= t_VictimSeed << 5;
+		for (size_t tier = 0, begin = 0; tier < order.tierEnds.size() && !job; begin = order.tierEnds[tier++])
+		{
+			size_t count = order.tierEnds[tier] - begin;
+			for (size_t i = 0; i < count && !job; i++) job = m_Workers[order.victims[begin + (t_VictimSeed + i) % count]]->deque.Steal();
+		}
+	}
+	if (job) m_Queued.fetch_sub(1);
 	return job;
 }
 
-void JobManager::RunJobs()
+void JobManager::Wake()
+{
+	// a worker counts itself as sleeping before it checks m_Queued, under the lock: either it sees the new jobs or
+	// this sees it and the notify comes after its wait has started
+	if (m_Sleeping.load() == 0) return;
+	{
+		std::lock_guard<std::mutex> lock(m_SleepLock);
+	}
+	m_WakeSignal.notify_all();
+}
+
+void JobManager::WorkerLoop(int worker)
+{
+	t_JobManager = this;
+	t_Worker = worker;
+	t_VictimSeed += (uint32_t)worker * 0x6d2b79f5u;
+	if (m_Workers[worker]->place.cpu >= 0) SetThreadAffinity({ m_Workers[worker]->place.cpu });
+	while (1)
+	{
+		Job* job = FindJob(worker);
+		if (job)
+		{
+			job->RunCodeWrapper();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(m_SleepLock);
+		m_Sleeping.fetch_add(1);
+		m_WakeSignal.wait(lock, [this] { return m_Stop || m_Queued.load() > 0; });
+		m_Sleeping.fetch_sub(1);
+		if (m_Stop) return;
+	}
+}
+
+JobGraph::Node JobGraph::Add(const char* name, std::function<void()> work, std::initializer_list<Node> dependencies, bool callerThread)
 {
-	if (m_JobCount == 0) return;
-	for (unsigned int i = 0; i < m_NumThreads; i++) m_JobThreadList[i].Go();
-	WaitForMultipleObjects(m_NumThreads, m_ThreadDone, TRUE, INFINITE);
+	Node node = (Node)m_Tasks.size();
+	Task* task = new Task();
+	task->graph = this;
+	task->name = name;
+	task->work = std::move(work);
+	task->callerThread = callerThread;
+	for (Node dependency : dependencies)
+	{
+		assert(dependency < node);
+		task->dependencies.push_back(dependency);
+		m_Tasks[dependency]->successors.push_back(node);
+	}
+	m_Tasks.emplace_back(task);
+	return node;
 }
 
-void JobManager::ThreadDone(unsigned int n)
+void JobGraph::Task::Main()
 {
-	SetEvent(m_ThreadDone[n]);
+	start = graph->m_Timer.elapsed();
+	if (!graph->m_Failed.load(std::memory_order_acquire))
+	{
+		try { work(); }
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(graph->m_Lock);
+			if (!graph->m_Exception) graph->m_Exception = std::current_exception();
+			graph->m_Failed.store(true, std::memory_order_release);
+		}
+	}
+	end = graph->m_Timer.elapsed();
+	// the continuations are queued before this job counts as done, so m_Remaining cannot reach 0 in between
+	for (Node successor : successors)
+	{
+		Task* next = graph->m_Tasks[successor].get();
+		if (next->waiting.fetch_sub(1, std::memory_order_acq_rel) == 1) graph->Queue(next);
+	}
+}
+
+void JobGraph::Queue(Task* task)
+{
+	if (task->callerThread)
+	{
+		std::lock_guard<std::mutex> lock(m_Lock);
+		m_CallerTasks.push_back(task);
+	}
+	else JobManager::GetJobManager()->Spawn(task, &m_Remaining);
 }
 
+void JobGraph::Run()
+{
+	JobManager* jobManager = JobManager::GetJobManager();
+	m_Remaining.store((int64_t)m_Tasks.size());
+	m_Failed.store(false);
+	m_Exception = nullptr;
+	for (auto& task : m_Tasks) task->waiting.store((uint32_t)task->dependencies.size(), std::memory_order_relaxed);
+	m_Timer.reset();
+	for (auto& task : m_Tasks) if (task->dependencies.empty()) Queue(task.get());
+
+	while (m_Remaining.load(std::memory_order_acquire) > 0)
+	{
+		Task* task = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_Lock);
+			if (!m_CallerTasks.empty()) task = m_CallerTasks.back(), m_CallerTasks.pop_back();
+		}
+		if (task)
+		{
+			task->Main();
+			m_Remaining.fetch_sub(1, std::memory_order_acq_rel);
+		}
+		else if (!jobManager->RunJob()) std::this_thread::yield();
+	}
+	m_Elapsed = m_Timer.elapsed();
+	if (m_Exception) std::rethrow_exception(m_Exception);
+}
+
+void JobGraph::Report(const char* label) const
+{
+	if (m_Tasks.empty()) return;
+	float busy = 0.0f;
+	const Task* last = nullptr;
+	std::cout << label << ": " << m_Tasks.size() << " jobs in " << m_Elapsed * 1000.0f << " ms\n";
+	for (auto& task : m_Tasks)
+	{
+		std::cout << "  " << task->name << ": " << task->start * 1000.0f << " - " << task->end * 1000.0f << " ms" << (task->callerThread ? " (caller thread)\n" : "\n");
+		busy += task->end - task->start;
+		if (!last || task->end > last->end) last = task.get();
+	}
+	std::vector<const Task*> path;
+	for (const Task* task = last; task;)
+	{
+		path.push_back(task);
+		const Task* gate = nullptr;
+		for (Node dependency : task->dependencies)
+			if (!gate || m_Tasks[dependency]->end > gate->end) gate = m_Tasks[dependency].get();
+		task = gate;
+	}
+	// the gap between a job and the one before it on the path is time it was ready but waited for a thread
+	float critical = 0.0f;
+	std::cout << "  critical path:";
+	for (auto i = path.rbegin(); i != path.rend(); ++i)
+	{
+		std::cout << (i == path.rbegin() ? " " : " > ") << (*i)->name << " (" << ((*i)->end - (*i)->start) * 1000.0f << " ms)";
+		critical += (*i)->end - (*i)->start;
+	}
+	std::cout << "\n  " << critical * 1000.0f << " ms on the critical path, " << busy * 1000.0f << " ms of work in all, " << busy / std::max(m_Elapsed, 1e-6f) << "x parallel\n";
+}
+
+#ifdef _WIN32
 DWORD CountSetBits(ULONG_PTR bitMask)
 {
 	DWORD LSHIFT = sizeof(ULONG_PTR) * 8 - 1, bitSetCount = 0;
@@ -163,21 +516,513 @@ void JobManager::GetProcessorCount(uint& cores, uint& logical)
 		}
 	}
 }
+#else
+void JobManager::GetProcessorCount(uint& cores, uint& logical)
+{
+	// /proc/cpuinfo: one block per logical processor, cores are the distinct (physical id, core id) pairs; platforms
+	// without those fields (most ARM kernels) count every processor as a core
+	cores = logical = 0;
+	std::ifstream cpuinfo("/proc/cpuinfo");
+	std::set<std::pair<int, int>> coreIds;
+	int physicalId = -1, coreId = -1;
+	bool topology = false;
+	std::string line;
+	while (std::getline(cpuinfo, line))
+	{
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+		{
+			if (coreId >= 0) coreIds.insert({ physicalId, coreId }), topology = true;
+			physicalId = coreId = -1;
+			continue;
+		}
+		std::string key = line.substr(0, line.find_last_not_of(" \t", colon - 1) + 1);
+		if (key == "processor") logical++;
+		else if (key == "physical id") physicalId = atoi(line.c_str() + colon + 1);
+		else if (key == "core id") coreId = atoi(line.c_str() + colon + 1);
+	}
+	if (coreId >= 0) coreIds.insert({ physicalId, coreId }), topology = true;
+	if (logical == 0) logical = std::max(std::thread::hardware_concurrency(), 1u);
+	cores = topology ? (uint)coreIds.size() : logical;
+}
+#endif
+
+int CpuTopology::GetDistance(const CpuInfo& a, const CpuInfo& b)
+{
+	if (a.core == b.core) return 0;
+	if (a.cache >= 0 && a.cache == b.cache) return 1;
+	if (a.node == b.node) return 2;
+	return 3;
+}
 
-JobManager* JobManager::GetJobManager()
+static void SortCpus(std::vector<CpuInfo>& cpus)
 {
-	if (!m_JobManager)
+	std::sort(cpus.begin(), cpus.end(), [](const CpuInfo& a, const CpuInfo& b) {
+		if (a.node != b.node) return a.node < b.node;
+		if (a.cache != b.cache) return a.cache < b.cache;
+		if (a.core != b.core) return a.core < b.core;
+		return a.cpu < b.cpu;
+	});
+}
+
+#ifdef _WIN32
+CpuTopology CpuTopology::Query()
+{
+	CpuTopology topology;
+	DWORD len = 0;
+	GetLogicalProcessorInformationEx(RelationAll, nullptr, &len);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) return topology;
+	std::vector<char> buffer(len);
+	if (!GetLogicalProcessorInformationEx(RelationAll, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer.data(), &len)) return topology;
+
+	// logical processors are numbered group * 64 + bit; the cores come first, the caches and nodes then label them
+	const int groupSize = sizeof(KAFFINITY) * 8;
+	auto forEachCpu = [&](const GROUP_AFFINITY& mask, auto f) {
+		for (int bit = 0; bit < groupSize; bit++)
+			if (mask.Mask & ((KAFFINITY)1 << bit)) f(mask.Group * groupSize + bit);
+	};
+	std::map<int, CpuInfo> cpus;
+	for (int relation : { RelationProcessorCore, RelationCache, RelationNumaNode })
+		for (char* ptr = buffer.data(); ptr < buffer.data() + len; ptr += ((PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)ptr)->Size)
+		{
+			PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX pi = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)ptr;
+			if (pi->Relationship != relation) continue;
+			if (relation == RelationProcessorCore)
+			{
+				int first = -1;
+				for (WORD g = 0; g < pi->Processor.GroupCount; g++)
+					forEachCpu(pi->Processor.GroupMask[g], [&](int cpu) {
+						if (first < 0) first = cpu;
+						cpus[cpu] = { cpu, first, -1, -1 };
+					});
+			}
+			else if (relation == RelationCache && pi->Cache.Level == 3)
+			{
+				int first = -1;
+				forEachCpu(pi->Cache.GroupMask, [&](int cpu) {
+					if (first < 0) first = cpu;
+					if (cpus.count(cpu)) cpus[cpu].cache = first;
+				});
+			}
+			else if (relation == RelationNumaNode)
+				forEachCpu(pi->NumaNode.GroupMask, [&](int cpu) { if (cpus.count(cpu)) cpus[cpu].node = (int)pi->NumaNode.NodeNumber; });
+		}
+
+	// only what the process may run on (in its own group)
+	DWORD_PTR processMask, systemMask;
+	USHORT group = 0, groupCount = 1;
+	bool masked = GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) && GetProcessGroupAffinity(GetCurrentProcess(), &groupCount, &group) && groupCount == 1;
+	for (auto& cpu : cpus)
+		if (!masked || (cpu.first / groupSize == group && (processMask & ((DWORD_PTR)1 << (cpu.first % groupSize)))))
+			topology.cpus.push_back(cpu.second);
+	SortCpus(topology.cpus);
+	return topology;
+}
+
+bool SetThreadAffinity(const std::vector<int>& cpus)
+{
+	if (cpus.empty()) return false;
+	// a thread runs within one processor group, the one of the first processor
+	const int groupSize = sizeof(KAFFINITY) * 8;
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = (WORD)(cpus[0] / groupSize);
+	for (int cpu : cpus)
+		if (cpu / groupSize == affinity.Group) affinity.Mask |= (KAFFINITY)1 << (cpu % groupSize);
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+}
+#else
+// sysfs cpu lists look like "0-3,8,10-11"
+static std::vector<int> ReadCpuList(const std::string& path)
+{
+	std::vector<int> cpus;
+	std::ifstream file(path);
+	std::string list;
+	if (!std::getline(file, list)) return cpus;
+	for (size_t begin = 0; begin < list.size();)
 	{
-		uint c, l;
-		GetProcessorCount(c, l);
-		CreateJobManager(l);
+		size_t end = list.find(',', begin);
+		if (end == std::string::npos) end = list.size();
+		std::string range = list.substr(begin, end - begin);
+		size_t dash = range.find('-');
+		if (!range.empty() && isdigit((unsigned char)range[0]))
+			for (int cpu = atoi(range.c_str()), last = dash == std::string::npos ? cpu : atoi(range.c_str() + dash + 1); cpu <= last; cpu++)
+				cpus.push_back(cpu);
+		begin = end + 1;
 	}
+	return cpus;
+}
+
+CpuTopology CpuTopology::Query()
+{
+	CpuTopology topology;
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return topology;
+
+	std::vector<int> nodes(CPU_SETSIZE, -1);
+	for (int node = 0; node < 256; node++)
+		for (int cpu : ReadCpuList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))
+			if (cpu < CPU_SETSIZE) nodes[cpu] = node;
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET(cpu, &allowed)) continue;
+		std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+		std::vector<int> siblings = ReadCpuList(path + "/topology/thread_siblings_list");
+		// the last level cache is the highest level any of the cpu's caches reports
+		int cache = -1, cacheLevel = 0;
+		for (int index = 0; ; index++)
+		{
+			std::ifstream levelFile(path + "/cache/index" + std::to_string(index) + "/level");
+			int level;
+			if (!(levelFile >> level)) break;
+			std::vector<int> shared = ReadCpuList(path + "/cache/index" + std::to_string(index) + "/shared_cpu_list");
+			if (level > cacheLevel && !shared.empty()) cacheLevel = level, cache = shared[0];
+		}
+		topology.cpus.push_back({ cpu, siblings.empty() ? cpu : siblings[0], cache, nodes[cpu] });
+	}
+	SortCpus(topology.cpus);
+	return topology;
+}
+
+bool SetThreadAffinity(const std::vector<int>& cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+		if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+	return !cpus.empty() && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+#endif
+
+// one thread per logical processor outside the first core, plus the caller, which keeps that core
+static uint GetDefaultThreadCount(const CpuTopology& topology)
+{
+	uint threads = 0;
+	for (const CpuInfo& cpu : topology.cpus)
+		if (cpu.core != topology.cpus[0].core) threads++;
+	if (threads > 0) return threads + 1;
+	uint c, l;
+	JobManager::GetProcessorCount(c, l);
+	return std::max(l, 1u);
+}
+
+JobManager* JobManager::GetJobManager()
+{
+	if (!m_JobManager) CreateJobManager(GetDefaultThreadCount(CpuTopology::Query()));
 	return m_JobManager;
 }
+
+void JobManager::PlaceBackgroundThread()
+{
+	if (!m_BackgroundCpus.empty()) SetThreadAffinity(m_BackgroundCpus);
+}
+
+void JobManager::PinRenderThread()
+{
+	if (!m_RenderCpus.empty()) SetThreadAffinity(m_RenderCpus);
+}
+
+void JobManager::UnpinThread()
+{
+	if (!m_ProcessCpus.empty()) SetThreadAffinity(m_ProcessCpus);
+}
+
+#if defined(JOB_BENCHMARK) || defined(AFFINITY_BENCHMARK)
+class BenchmarkJob : public Job
+{
+public:
+	void Main() override
+	{
+		uint32_t x = m_Seed;
+		for (uint32_t i = 0; i < m_Work; i++) x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+		m_Result = x;
+	}
+	uint32_t m_Seed = 1, m_Work = 0, m_Result = 0;
+};
+#endif
+
+#ifdef JOB_BENCHMARK
+
+// the Win32 JobManager's scheme on std primitives: one locked, fixed job list, all threads woken for every batch and
+// the caller sleeping until each of them has found the list empty
+class LockedJobList
+{
+public:
+	LockedJobList(unsigned int threads)
+	{
+		for (unsigned int i = 0; i < threads; i++) m_Threads.emplace_back(&LockedJobList::ThreadLoop, this);
+	}
+	~LockedJobList()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_Lock);
+			m_Stop = true;
+		}
+		m_Go.notify_all();
+		for (auto& thread : m_Threads) thread.join();
+	}
+	void Run(Job** jobs, unsigned int count)
+	{
+		std::unique_lock<std::mutex> lock(m_Lock);
+		for (unsigned int i = 0; i < count; i++) m_Jobs[m_Count++] = jobs[i];
+		m_Done = 0;
+		m_Round++;
+		m_Go.notify_all();
+		m_AllDone.wait(lock, [this] { return m_Done == m_Threads.size(); });
+	}
+protected:
+	void ThreadLoop()
+	{
+		uint64_t round = 0;
+		std::unique_lock<std::mutex> lock(m_Lock);
+		while (1)
+		{
+			m_Go.wait(lock, [&] { return m_Stop || m_Round != round; });
+			if (m_Stop) return;
+			round = m_Round;
+			while (m_Count > 0)
+			{
+				Job* job = m_Jobs[--m_Count];
+				lock.unlock();
+				job->Main();
+				lock.lock();
+			}
+			if (++m_Done == m_Threads.size()) m_AllDone.notify_one();
+		}
+	}
+	std::vector<std::thread> m_Threads;
+	std::mutex m_Lock;
+	std::condition_variable m_Go, m_AllDone;
+	Job* m_Jobs[256];
+	unsigned int m_Count = 0, m_Done = 0;
+	uint64_t m_Round = 0;
+	bool m_Stop = false;
+};
+
+void JobManager::Benchmark()
+{
+	const unsigned int batches = 200, jobCount = 256;
+	uint cores, logical;
+	GetProcessorCount(cores, logical);
+	std::cout << "job benchmark: " << cores << " cores, " << logical << " logical processors, " << batches << " batches of " << jobCount << " jobs\n";
+
+	for (uint32_t work : { 1000u, 20000u })
+	{
+		std::vector<BenchmarkJob> jobs(jobCount);
+		std::vector<Job*> jobPointers(jobCount);
+		for (unsigned int i = 0; i < jobCount; i++) jobs[i].m_Seed = i + 1, jobs[i].m_Work = work, jobPointers[i] = &jobs[i];
+
+		for (unsigned int threads = 1; threads <= logical; threads++)
+		{
+			Timer timer;
+			{
+				JobManager manager(threads, false);
+				timer.reset();
+				for (unsigned int batch = 0; batch < batches; batch++)
+				{
+					for (auto& job : jobs) manager.AddJob2(&job);
+					manager.RunJobs();
+				}
+			}
+			float stealing = timer.elapsed();
+			{
+				LockedJobList list(threads);
+				timer.reset();
+				for (unsigned int batch = 0; batch < batches; batch++) list.Run(jobPointers.data(), jobCount);
+			}
+			float locked = timer.elapsed();
+			std::cout << "  " << work << " steps per job, " << threads << (threads == 1 ? " thread: " : " threads: ") << "work stealing "
+				<< stealing * 1000.0f / batches << " ms, locked list " << locked * 1000.0f / batches << " ms per batch\n";
+		}
+	}
+}
+#endif
+
+#ifdef AFFINITY_BENCHMARK
+void JobManager::AffinityBenchmark()
+{
+	const unsigned int frames = 600, jobCount = 64;
+	CpuTopology topology = CpuTopology::Query();
+	uint threads = GetDefaultThreadCount(topology), cores, logical;
+	GetProcessorCount(cores, logical);
+	std::cout << "affinity benchmark: " << topology.cpus.size() << " logical processors, " << threads << " job threads, " << logical
+		<< " background threads, " << frames << " frames of " << jobCount << " jobs and a serial part\n";
+
+	for (bool affinity : { false, true })
+	{
+		std::vector<float> times;
+		{
+			JobManager manager(threads, affinity);
+			// decode-like load: every thread streams through a buffer larger than the caches
+			std::atomic<bool> stop{ false };
+			std::vector<std::thread> background;
+			for (uint i = 0; i < logical; i++)
+				background.emplace_back([&manager, &stop] {
+					manager.PlaceBackgroundThread();
+					std::vector<uint32_t> data(4 * 1024 * 1024);
+					uint32_t x = 1;
+					while (!stop.load(std::memory_order_relaxed))
+						for (size_t j = 0; j < data.size(); j += 16) data[j] += x, x ^= data[j] << 3;
+				});
+
+			std::vector<BenchmarkJob> jobs(jobCount);
+			for (unsigned int i = 0; i < jobCount; i++) jobs[i].m_Seed = i + 1, jobs[i].m_Work = 20000;
+			BenchmarkJob submission;
+			submission.m_Work = 200000;
+			manager.PinRenderThread();
+			Timer timer;
+			for (unsigned int frame = 0; frame < frames; frame++)
+			{
+				timer.reset();
+				for (auto& job : jobs) manager.AddJob2(&job);
+				manager.RunJobs();
+				submission.Main();						// the serial part stands for the render thread's submission
+				times.push_back(timer.elapsed() * 1000.0f);
+			}
+			stop = true;
+			for (auto& thread : background) thread.join();
+			manager.UnpinThread();
+		}
+
+		float mean = 0.0f, variance = 0.0f;
+		for (float time : times) mean += time / frames;
+		for (float time : times) variance += (time - mean) * (time - mean) / frames;
+		std::sort(times.begin(), times.end());
+		std::cout << (affinity ? "  pinned:   " : "  unpinned: ") << "mean " << mean << " ms, deviation " << sqrtf(variance) << " ms, 99th percentile "
+			<< times[frames * 99 / 100] << " ms, worst " << times.back() << " ms\n";
+	}
+
+}
+#endif
+
+#ifdef PARALLEL_BENCHMARK
+static const size_t PARALLEL_BENCHMARK_COUNT = 1 << 18;
+
+// uneven: the last eighth of the range costs 16 times as much as the rest
+static uint32_t BenchmarkElement(size_t i, bool uneven)
+{
+	uint32_t steps = uneven && i >= PARALLEL_BENCHMARK_COUNT / 8 * 7 ? 1600 : 100, x = (uint32_t)i + 1;
+	for (uint32_t step = 0; step < steps; step++) x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+	return x;
+}
+
+class BandJob : public Job
+{
+public:
+	void Main() override { for (size_t i = m_Begin; i < m_End; i++) (*m_Results)[i] = BenchmarkElement(i, m_Uneven); }
+	std::vector<uint32_t>* m_Results = nullptr;
+	size_t m_Begin = 0, m_End = 0;
+	bool m_Uneven = false;
+	int m_Pass = 0;
+};
+
+void BenchmarkParallelFor()
+{
+	const size_t count = PARALLEL_BENCHMARK_COUNT;
+	const int runs = 10;
+	uint32_t threads = JobManager::GetJobManager()->GetNumThreads();
+	std::cout << "parallel benchmark: " << count << " elements on " << threads << " threads, " << runs << " runs\n";
+	for (bool uneven : { false, true })
+	{
+		std::vector<uint32_t> reference(count), results(count);
+		Timer timer;
+		for (int run = 0; run < runs; run++)
+			for (size_t i = 0; i < count; i++) reference[i] = BenchmarkElement(i, uneven);
+		float serial = timer.elapsed() / runs;
+
+		// threads * 4 bands of equal size, how the converted loops were split
+		std::vector<BandJob> bands(threads * 4);
+		for (size_t i = 0; i < bands.size(); i++)
+		{
+			bands[i].m_Results = &results, bands[i].m_Uneven = uneven;
+			bands[i].m_Begin = count * i / bands.size(), bands[i].m_End = count * (i + 1) / bands.size();
+		}
+		timer.reset();
+		for (int run = 0; run < runs; run++) RunJobPass(bands, 0, threads);
+		float banded = timer.elapsed() / runs;
+		bool match = results == reference;
+
+		std::fill(results.begin(), results.end(), 0);
+		timer.reset();
+		for (int run = 0; run < runs; run++)
+			ParallelFor(0, count, 0, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) results[i] = BenchmarkElement(i, uneven);
+			});
+		float lazy = timer.elapsed() / runs;
+		match = match && results == reference;
+
+		uint32_t expected = 0, reduced = 0;
+		for (uint32_t x : reference) expected ^= x;
+		timer.reset();
+		for (int run = 0; run < runs; run++)
+			reduced = ParallelReduce(0, count, 0, 0u, [uneven](size_t begin, size_t end, uint32_t value) {
+				for (size_t i = begin; i < end; i++) value ^= BenchmarkElement(i, uneven);
+				return value;
+			}, [](uint32_t a, uint32_t b) { return a ^ b; });
+		float reduce = timer.elapsed() / runs;
+		match = match && reduced == expected;
+
+		std::cout << (uneven ? "  uneven: " : "  even:   ") << "serial " << serial * 1000.0f << " ms, bands " << banded * 1000.0f << " ms (x"
+			<< serial / banded << "), ParallelFor " << lazy * 1000.0f << " ms (x" << serial / lazy << "), ParallelReduce " << reduce * 1000.0f
+			<< " ms (x" << serial / reduce << "), results " << (match ? "match" : "DIFFER") << '\n';
+	}
+}
+#endif
+#pragma endregion
+
+#pragma region mapped file
+#ifdef _WIN32
+bool MappedFile::Open(const char* a_File)
+{
+	Close();
+	HANDLE file = CreateFileA(a_File, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	m_File = file;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) { Close(); return false; }
+	m_Mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	if (!m_Mapping) { Close(); return false; }
+	m_Data = (const uint8_t*)MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_Data) { Close(); return false; }
+	m_Size = (size_t)size.QuadPart;
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (m_Data) UnmapViewOfFile(m_Data);
+	if (m_Mapping) CloseHandle(m_Mapping);
+	if (m_File) CloseHandle(m_File);
+	m_File = m_Mapping = 0, m_Data = 0, m_Size = 0;
+}
+#else
+bool MappedFile::Open(const char* a_File)
+{
+	Close();
+	int file = open(a_File, O_RDONLY);
+	if (file < 0) return false;
+	struct stat info;
+	void* data = MAP_FAILED;
+	if (fstat(file, &info) == 0 && info.st_size > 0) data = mmap(0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);									// the mapping keeps the file open
+	if (data == MAP_FAILED) return false;
+	m_Data = (const uint8_t*)data;
+	m_Size = (size_t)info.st_size;
+	madvise(data, m_Size, MADV_SEQUENTIAL);
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (m_Data) munmap((void*)m_Data, m_Size);
+	m_Data = 0, m_Size = 0;
+}
+#endif
 #pragma endregion
 
 #pragma region help function
-namespace std{
+using namespace std;
+
 void FatalError(const char* fmt, ...)
 {
 	//	char t[16384];
@@ -203,12 +1048,13 @@ bool FileIsNewer(const char* file1, const char* file2)
 
 	if (stat(file2, &f2)) return true; // second file does not exist
 
+	// strictly newer: a file written in the same instant as file2 is not
 #ifdef _MSC_VER
-	return f1.st_mtime >= f2.st_mtime;
+	return f1.st_mtime > f2.st_mtime;
 #else
-	if (f1.st_mtim.tv_sec >= f2.st_mtim.tv_sec)
-		return true;
-	return f1.st_mtim.tv_nsec >= f2.st_mtim.tv_nsec;
+	if (f1.st_mtim.tv_sec != f2.st_mtim.tv_sec)
+		return f1.st_mtim.tv_sec > f2.st_mtim.tv_sec;
+	return f1.st_mtim.tv_nsec > f2.st_mtim.tv_nsec;
 #endif
 }
 
@@ -253,5 +1099,4 @@ void TextFileWrite(const string& text, const char* _File)
 	s.write((const char*)&len, sizeof(len));
 	s.write(text.c_str(), len);
 }
-}
 #pragma endregion
@@ -0,0 +1,269 @@
+#include "precomp.h"
+#include "texture.h"
+
+#include <filesystem>
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#pragma region baked textures
+static uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+std::string GetBakedTexturePath(const std::string& source) {
+	return std::filesystem::path(source).replace_extension(".tex").string();
+}
+
+bool LoadBakedTexture(const std::string& source, MappedFile& file, TextureData& texture) {
+	std::string path = GetBakedTexturePath(source);
+
+	// the source image is optional once a baked file exists, but a newer one wins
+	if (!FileExists(path.c_str()) || (FileExists(source.c_str()) && FileIsNewer(source.c_str(), path.c_str())))
+		return false;
+
+	if (!file.Open(path.c_str()))
+		return false;
+
+	// everything the upload takes from the file is checked against the file: the level sizes and extents follow from
+	// the format and the size of level 0, and every level lies inside the data block
+	const TextureHeader* header = reinterpret_cast<const TextureHeader*>(file.GetData());
+	bool valid = file.GetSize() >= sizeof(TextureHeader) &&
+		header->magic == TEXTURE_MAGIC &&
+		header->version == TEXTURE_VERSION &&
+		IsTextureFormat(header->format) &&
+		header->width > 0 && header->height > 0 &&
+		header->mipCount > 0 && header->mipCount <= GetMipCount(header->width, header->height) &&
+		sizeof(TextureHeader) + (uint64_t)header->mipCount * sizeof(TextureLevel) <= header->dataOffset &&
+		header->dataOffset <= file.GetSize() && header->dataSize <= file.GetSize() - header->dataOffset;
+
+	const TextureLevel* levels = reinterpret_cast<const TextureLevel*>(file.GetData() + sizeof(TextureHeader));
+	for (uint32_t i = 0; valid && i < header->mipCount; i++) {
+		const TextureLevel& level = levels[i];
+		valid = level.width == std::max(header->width >> i, 1u) && level.height == std::max(header->height >> i, 1u) &&
+			level.size == GetLevelSize(header->format, level.width, level.height) &&
+			level.offset <= header->dataSize && level.size <= header->dataSize - level.offset && level.offset % TEXTURE_ALIGN == 0;
+	}
+
+	if (!valid) {
+		file.Close();
+		return false;
+	}
+
+	texture.format = header->format;
+	texture.width = header->width;
+	texture.height = header->height;
+	texture.mipCount = header->mipCount;
+	texture.levels = levels;
+	texture.data = file.GetData() + header->dataOffset;
+	texture.dataSize = header->dataSize;
+	return true;
+}
+
+VkFormat GetTextureFormat(TextureCompression compression, bool opaque) {
+	if (compression == TextureCompression::BC1 && opaque)
+		return VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+	if (compression != TextureCompression::None)
+		return VK_FORMAT_BC7_SRGB_BLOCK;
+	return VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+void BuildTexture(const uint8_t* pixels, uint32_t width, uint32_t height, VkFormat format, const MipOptions& mipOptions,
+	const BlockOptions& blockOptions, std::vector<uint8_t>& data, std::vector<TextureLevel>& levels, TextureData& texture) {
+	uint32_t mipCount = GetMipCount(width, height);
+	levels.resize(mipCount);
+	uint64_t offset = 0;
+	for (uint32_t i = 0; i < mipCount; i++) {
+		levels[i].width = std::max(width >> i, 1u);
+		levels[i].height = std::max(height >> i, 1u);
+		levels[i].size = GetLevelSize(format, levels[i].width, levels[i].height);
+		levels[i].offset = offset;
+		offset = AlignUp(offset + levels[i].size, TEXTURE_ALIGN);
+	}
+	data.assign(offset, 0);
+
+	// block formats filter into a separate rgba8 chain first
+	std::vector<uint8_t> rgba;
+	std::vector<uint8_t*> mips(mipCount);
+	if (IsBlockFormat(format)) {
+		uint64_t rgbaSize = 0;
+		for (uint32_t i = 1; i < mipCount; i++) rgbaSize += (uint64_t)levels[i].width * levels[i].height * 4;
+		rgba.resize(rgbaSize);
+		for (uint32_t i = 1, rgbaOffset = 0; i < mipCount; rgbaOffset += levels[i].width * levels[i].height * 4, i++) mips[i] = rgba.data() + rgbaOffset;
+	}
+	else {
+		for (uint32_t i = 0; i < mipCount; i++) mips[i] = data.data() + levels[i].offset;
+		memcpy(mips[0], pixels, levels[0].size);
+	}
+	GenerateMipChain(pixels, width, height, mips.data() + 1, mipOptions);
+
+	if (IsBlockFormat(format))
+		for (uint32_t i = 0; i < mipCount; i++)
+			CompressBlocks(i == 0 ? pixels : mips[i], levels[i].width, levels[i].height, format, data.data() + levels[i].offset, blockOptions);
+
+	texture.format = format;
+	texture.width = width;
+	texture.height = height;
+	texture.mipCount = mipCount;
+	texture.levels = levels.data();
+	texture.data = data.data();
+	texture.dataSize = data.size();
+}
+
+bool WriteTexture(const TextureData& texture, const std::string& path) {
+	TextureHeader header{};
+	header.magic = TEXTURE_MAGIC;
+	header.version = TEXTURE_VERSION;
+	header.format = texture.format;
+	header.width = texture.width;
+	header.height = texture.height;
+	header.mipCount = texture.mipCount;
+	header.dataOffset = AlignUp(sizeof(TextureHeader) + header.mipCount * sizeof(TextureLevel), TEXTURE_ALIGN);
+	header.dataSize = texture.dataSize;
+
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			return false;
+
+		const char padding[TEXTURE_ALIGN] = {};
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(texture.levels), texture.mipCount * sizeof(TextureLevel));
+		file.write(padding, header.dataOffset - sizeof(header) - texture.mipCount * sizeof(TextureLevel));
+		file.write(reinterpret_cast<const char*>(texture.data), texture.dataSize);
+
+		if (!file.good())
+			return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tempPath, path, ec);
+	if (ec) {
+		RemoveFile(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool BakeTexture(const uint8_t* pixels, uint32_t width, uint32_t height, VkFormat format, const std::string& path) {
+	MipOptions mipOptions;
+	mipOptions.srgb = IsSrgbFormat(format);
+	mipOptions.threadCount = JobManager::GetJobManager()->GetNumThreads();
+	BlockOptions blockOptions;
+	blockOptions.threadCount = mipOptions.threadCount;
+
+	std::vector<uint8_t> data;
+	std::vector<TextureLevel> levels;
+	TextureData texture;
+	BuildTexture(pixels, width, height, format, mipOptions, blockOptions, data, levels, texture);
+	return WriteTexture(texture, path);
+}
+
+bool BakeTexture(const std::string& source, const std::string& path) {
+	int width, height, channels;
+	stbi_uc* pixels = stbi_load(source.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+	if (!pixels)
+		return false;
+
+#ifdef TEXTURE_BENCHMARK
+	BenchmarkMipChain(pixels, width, height);
+	BenchmarkBlockCompression(pixels, width, height);
+#endif
+
+	VkFormat format = GetTextureFormat(TEXTURE_COMPRESSION, IsOpaque(pixels, width, height));
+	Timer timer;
+	bool baked = BakeTexture(pixels, width, height, format, path);
+	std::cout << "BakeTexture: " << source << " as " << GetTextureFormatName(format);
+	if (IsBlockFormat(format)) std::cout << " (" << GetBlockQualityName(TEXTURE_BLOCK_QUALITY) << ')';
+	std::cout << " took " << timer.elapsed() * 1000.0f << " ms\n";
+	stbi_image_free(pixels);
+	return baked;
+}
+#pragma endregion
+
+#pragma region streaming
+void TextureStream::Open(const std::string& source, std::function<VkFormat(bool)> selectFormat) {
+	bool prefetched = m_Prefetched;
+	if (!prefetched)
+		Close();
+	m_Prefetched = false;
+	if (prefetched || LoadBakedTexture(source, m_File, m_Texture)) {
+		if (m_Texture.format == selectFormat(true) || m_Texture.format == selectFormat(false)) {
+			m_Ready.store(true, std::memory_order_release);
+			return;
+		}
+		m_File.Close();							// baked with another TEXTURE_COMPRESSION or for another device
+	}
+	m_Worker = std::thread(&TextureStream::Build, this, source, selectFormat);
+}
+
+void TextureStream::Prefetch(const std::string& source) {
+	Close();
+	if (!LoadBakedTexture(source, m_File, m_Texture))
+		return;
+	// touch a byte per page, so the disk reads happen here rather than in the first upload
+	const volatile uint8_t* data = m_File.GetData();
+	uint8_t sum = 0;
+	for (size_t i = 0; i < m_File.GetSize(); i += 4096)
+		sum += data[i];
+	(void)sum;
+	m_Prefetched = true;
+}
+
+// the worker is a background thread that decodes the image; the mip filtering and the block encoding are ParallelFors
+// it helps with, their pieces share the job manager's workers with the startup jobs and the first frames
+void TextureStream::Build(std::string source, std::function<VkFormat(bool)> selectFormat) {
+	JobManager::GetJobManager()->PlaceBackgroundThread();
+	Timer timer;
+	int width, height, channels;
+	stbi_uc* pixels = stbi_load(source.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+	if (!pixels) {
+		m_Failed.store(true, std::memory_order_release);
+		return;
+	}
+
+	VkFormat format = selectFormat(IsOpaque(pixels, width, height));
+	MipOptions mipOptions;
+	mipOptions.srgb = IsSrgbFormat(format);
+	mipOptions.threadCount = JobManager::GetJobManager()->GetNumThreads();
+	BlockOptions blockOptions;
+	blockOptions.threadCount = mipOptions.threadCount;
+	BuildTexture(pixels, width, height, format, mipOptions, blockOptions, m_Data, m_Levels, m_Texture);
+	stbi_image_free(pixels);
+	std::cout << "TextureStream: decoded " << source << " and built " << m_Texture.mipCount << " levels of " << GetTextureFormatName(format)
+		<< " in " << timer.elapsed() * 1000.0f << " ms\n";
+
+	// bake it for the next start (the same thing "--bake-texture" does offline)
+	if (!WriteTexture(m_Texture, GetBakedTexturePath(source)))
+		std::cerr << "TextureStream: failed to write " << GetBakedTexturePath(source) << '\n';
+	m_Ready.store(true, std::memory_order_release);
+}
+
+uint32_t TextureStream::GetTailLevel(uint64_t tailSize) const {
+	uint32_t level = m_Texture.mipCount - 1;
+	uint64_t size = m_Texture.levels[level].size;
+	while (level > 0 && size + m_Texture.levels[level - 1].size <= tailSize)
+		size += m_Texture.levels[--level].size;
+	return level;
+}
+
+uint32_t TextureStream::GetNextLevel(uint32_t resident, uint64_t budget) const {
+	uint32_t level = resident - 1;
+	uint64_t size = m_Texture.levels[level].size;
+	while (level > 0 && size + m_Texture.levels[level - 1].size <= budget)
+		size += m_Texture.levels[--level].size;
+	return level;
+}
+
+void TextureStream::Close() {
+	if (m_Worker.joinable())
+		m_Worker.join();
+	m_File.Close();
+	m_Prefetched = false;
+	m_Data = std::vector<uint8_t>();
+	m_Levels = std::vector<TextureLevel>();
+	m_Texture = TextureData();
+	m_Ready.store(false, std::memory_order_relaxed);
+	m_Failed.store(false, std::memory_order_relaxed);
+}
+#pragma endregion
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "vulkan.h"
+
+// baked texture container, written next to the source image with the extension replaced by ".tex"
+// layout: TextureHeader | TextureLevel[mipCount] | level data (largest level first, every level TEXTURE_ALIGN aligned)
+// the level data is one block, so a single staging copy plus one VkBufferImageCopy per level uploads everything
+#define TEXTURE_MAGIC	0x58455442	// "BTEX"
+#define TEXTURE_VERSION	1
+#define TEXTURE_ALIGN	16			// multiple of every texel/block size
+
+struct TextureHeader {
+	uint32_t magic;
+	uint32_t version;
+	VkFormat format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t mipCount;
+	uint64_t dataOffset;
+	uint64_t dataSize;
+};
+
+std::string GetBakedTexturePath(const std::string& source);
+// maps the baked version of source if it exists and is not older than source; texture then points into the mapping
+bool LoadBakedTexture(const std::string& source, MappedFile& file, TextureData& texture);
+// writes a built texture (to a temporary file first, then renamed in place)
+bool WriteTexture(const TextureData& texture, const std::string& path);
+// bakes an rgba8 image with its full mip chain, block compressed when format is a BC format
+bool BakeTexture(const uint8_t* pixels, uint32_t width, uint32_t height, VkFormat format, const std::string& path);
+// decodes source and bakes it in the format TEXTURE_COMPRESSION picks for it, this is what "--bake-texture" runs
+bool BakeTexture(const std::string& source, const std::string& path);
+// VkFormat that compression uses for an image, before any device support is considered
+VkFormat GetTextureFormat(TextureCompression compression, bool opaque);
+
+// CPU mip generation for rgba8 images: levels are filtered in float, in linear space for sRGB formats,
+// every level from the float result of the previous one; the rows of each level are a ParallelFor on the job manager
+enum class MipFilter {
+	Box,			// 2x2 average
+	Kaiser			// 6 tap Kaiser windowed sinc, sharper and less aliasing
+};
+
+// instruction sets the mip kernels exist for, in increasing order
+enum class SimdLevel {
+	Scalar,
+	SSE41,
+	AVX2,
+	AVX512
+};
+
+// best level the CPU and OS support, from CPUCaps
+SimdLevel GetSimdLevel();
+const char* GetSimdLevelName(SimdLevel level);
+
+struct MipOptions {
+	MipFilter filter = MipFilter::Box;
+	bool srgb = true;						// color channels are sRGB encoded, alpha is always linear
+	SimdLevel simd = GetSimdLevel();		// clamped to GetSimdLevel()
+	uint32_t threadCount = 1;
+};
+
+inline uint32_t GetMipCount(uint32_t width, uint32_t height) {
+	uint32_t count = 1;
+	while ((width | height) > 1) width >>= 1, height >>= 1, count++;
+	return count;
+}
+
+// fills mips[0 .. GetMipCount() - 2] with levels 1 and below, each (w >> l) * (h >> l) * 4 bytes (at least 1x1)
+void GenerateMipChain(const uint8_t* pixels, uint32_t width, uint32_t height, uint8_t* const* mips, const MipOptions& options);
+// times every supported instruction set and filter on one and on all threads and checks them against the scalar kernels
+void BenchmarkMipChain(const uint8_t* pixels, uint32_t width, uint32_t height);
+
+// block compression: BC1 (opaque rgb, 8 bytes per 4x4 block) and BC7 (rgba, 16 bytes per block, modes 1, 3, 6 and 7);
+// blocks are encoded in the color space of the image, rows of blocks are a ParallelFor on the job manager
+struct BlockOptions {
+	BlockQuality quality = TEXTURE_BLOCK_QUALITY;
+	SimdLevel simd = GetSimdLevel();		// clamped to GetSimdLevel()
+	uint32_t threadCount = 1;
+};
+
+inline bool IsBlockFormat(VkFormat format) {
+	return format >= VK_FORMAT_BC1_RGB_UNORM_BLOCK && format <= VK_FORMAT_BC7_SRGB_BLOCK;
+}
+
+// the formats BuildTexture writes, the ones GetLevelSize knows the size of
+inline bool IsTextureFormat(VkFormat format) {
+	switch (format) {
+	case VK_FORMAT_R8G8B8A8_SRGB: case VK_FORMAT_R8G8B8A8_UNORM:
+	case VK_FORMAT_BC1_RGB_SRGB_BLOCK: case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+	case VK_FORMAT_BC7_SRGB_BLOCK: case VK_FORMAT_BC7_UNORM_BLOCK:
+		return true;
+	default:
+		return false;
+	}
+}
+
+inline bool IsSrgbFormat(VkFormat format) {
+	return format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_BC1_RGB_SRGB_BLOCK || format == VK_FORMAT_BC1_RGBA_SRGB_BLOCK ||
+		format == VK_FORMAT_BC7_SRGB_BLOCK;
+}
+
+// bytes of one level, block formats round the size up to whole blocks
+uint64_t GetLevelSize(VkFormat format, uint32_t width, uint32_t height);
+const char* GetTextureFormatName(VkFormat format);
+const char* GetBlockQualityName(BlockQuality quality);
+
+// format is one of the BC1 or BC7 formats, blocks receives GetLevelSize() bytes
+void CompressBlocks(const uint8_t* pixels, uint32_t width, uint32_t height, VkFormat format, uint8_t* blocks, const BlockOptions& options);
+// decodes what CompressBlocks writes back to rgba8 (only the BC7 modes the encoder uses)
+void DecompressBlocks(const uint8_t* blocks, uint32_t width, uint32_t height, VkFormat format, uint8_t* pixels);
+bool IsOpaque(const uint8_t* pixels, uint32_t width, uint32_t height);
+// peak signal to noise ratio of b against a in dB, over rgb only when the image is opaque
+float ComputePSNR(const uint8_t* a, const uint8_t* b, uint32_t width, uint32_t height);
+// times BC1 (for opaque images) and BC7 at every quality, scalar and SIMD, on one and on all threads, with the PSNR of each
+void BenchmarkBlockCompression(const uint8_t* pixels, uint32_t width, uint32_t height);
+
+// lays out pixels and its mip chain the way the baked container stores them; texture points into data and levels.
+// for block formats the rgba8 chain is generated first and every level is compressed afterwards
+void BuildTexture(const uint8_t* pixels, uint32_t width, uint32_t height, VkFormat format, const MipOptions& mipOptions,
+	const BlockOptions& blockOptions, std::vector<uint8_t>& data, std::vector<TextureLevel>& levels, TextureData& texture);
@@ -0,0 +1,120 @@
+#include "precomp.h"
+
+void FrameTimeline::Create(VkDevice device, bool timelineSemaphore, uint32_t slotCount) {
+	m_Device = device;
+	m_Submitted = m_Completed = 0;
+
+	if (timelineSemaphore) {
+		VkSemaphoreTypeCreateInfoKHR typeInfo{};
+		typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+		typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+		typeInfo.initialValue = 0;
+
+		VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		semaphoreInfo.pNext = &typeInfo;
+
+		// the instance is 1.0, the entry points come from the extension
+		m_WaitSemaphores = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(device, "vkWaitSemaphoresKHR");
+		m_GetSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(device, "vkGetSemaphoreCounterValueKHR");
+		if (m_WaitSemaphores == nullptr || m_GetSemaphoreCounterValue == nullptr ||
+			vkCreateSemaphore(device, &semaphoreInfo, nullptr, &m_Semaphore) != VK_SUCCESS)
+			throw std::runtime_error("failed to create timeline semaphore!");
+		return;
+	}
+
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	m_Fences.resize(slotCount);
+	m_FenceValues.assign(slotCount, 0);
+	for (VkFence& fence : m_Fences)
+		if (vkCreateFence(device, &fenceInfo, nullptr, &fence) != VK_SUCCESS)
+			throw std::runtime_error("failed to create synchronization objects for a frame!");
+}
+
+void FrameTimeline::Destroy() {
+	if (m_Semaphore != VK_NULL_HANDLE)
+		vkDestroySemaphore(m_Device, m_Semaphore, nullptr);
+	m_Semaphore = VK_NULL_HANDLE;
+	for (VkFence fence : m_Fences)
+		vkDestroyFence(m_Device, fence, nullptr);
+	m_Fences.clear();
+	m_FenceValues.clear();
+}
+
+uint64_t FrameTimeline::Submit(VkQueue queue, VkSubmitInfo submitInfo) {
+	uint64_t value = m_Submitted + 1;
+	VkFence fence = VK_NULL_HANDLE;
+
+	// declared out here, submitInfo points at it
+	VkTimelineSemaphoreSubmitInfoKHR timelineInfo{};
+	if (m_Semaphore != VK_NULL_HANDLE) {
+		// binary semaphores ignore their value
+		m_SignalSemaphores.assign(submitInfo.pSignalSemaphores, submitInfo.pSignalSemaphores + submitInfo.signalSemaphoreCount);
+		m_SignalValues.assign(submitInfo.signalSemaphoreCount, 0);
+		m_SignalSemaphores.push_back(m_Semaphore);
+		m_SignalValues.push_back(value);
+
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+		timelineInfo.pNext = submitInfo.pNext;
+		timelineInfo.signalSemaphoreValueCount = static_cast<uint32_t>(m_SignalValues.size());
+		timelineInfo.pSignalSemaphoreValues = m_SignalValues.data();
+		submitInfo.pNext = &timelineInfo;
+		submitInfo.signalSemaphoreCount = static_cast<uint32_t>(m_SignalSemaphores.size());
+		submitInfo.pSignalSemaphores = m_SignalSemaphores.data();
+	}
+	else {
+		// the slot is free once the value submitted slotCount values ago is done
+		uint32_t slot = static_cast<uint32_t>(value % m_Fences.size());
+		Wait(m_FenceValues[slot]);
+		fence = m_Fences[slot];
+		vkResetFences(m_Device, 1, &fence);
+		m_FenceValues[slot] = value;
+	}
+
+	if (vkQueueSubmit(queue, 1, &submitInfo, fence) != VK_SUCCESS)
+		throw std::runtime_error("failed to submit draw command buffer!");
+	m_Submitted = value;
+	return value;
+}
+
+uint64_t FrameTimeline::GetCompletedValue() {
+	if (m_Semaphore != VK_NULL_HANDLE) {
+		uint64_t value;
+		if (m_GetSemaphoreCounterValue(m_Device, m_Semaphore, &value) == VK_SUCCESS)
+			m_Completed = std::max(m_Completed, value);
+		return m_Completed;
+	}
+	// the queue completes in submission order, the first pending fence ends the run
+	while (m_Completed < m_Submitted) {
+		uint64_t value = m_Completed + 1;
+		uint32_t slot = static_cast<uint32_t>(value % m_Fences.size());
+		if (m_FenceValues[slot] == value && vkGetFenceStatus(m_Device, m_Fences[slot]) != VK_SUCCESS)
+			break;
+		m_Completed = value;
+	}
+	return m_Completed;
+}
+
+void FrameTimeline::Wait(uint64_t value) {
+	if (value <= m_Completed)
+		return;
+	if (value > m_Submitted)
+		throw std::runtime_error("failed to wait for a frame that was not submitted!");
+
+	if (m_Semaphore != VK_NULL_HANDLE) {
+		VkSemaphoreWaitInfoKHR waitInfo{};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &m_Semaphore;
+		waitInfo.pValues = &value;
+		m_WaitSemaphores(m_Device, &waitInfo, UINT64_MAX);
+	}
+	else {
+		// a value whose slot was reused is done already, Submit waited for it
+		uint32_t slot = static_cast<uint32_t>(value % m_Fences.size());
+		if (m_FenceValues[slot] == value)
+			vkWaitForFences(m_Device, 1, &m_Fences[slot], VK_TRUE, UINT64_MAX);
+	}
+	m_Completed = value;
+}
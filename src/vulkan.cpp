@@ -1,13 +1,17 @@
-#define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
-#define TINYOBJLOADER_IMPLEMENTATION
-#include <tiny_obj_loader.h>
 // header for Vulkan
-#include "vulkan.h"
+#define VMA_IMPLEMENTATION
+#include "precomp.h"
+#include "mesh.h"
+#include "texture.h"
+#include "pipelinecache.h"
 
 void MyVulkanApplication::run() {
+	startupTimer.reset();
 	initWindow();
 	initVulkan();
+	// the loader, the driver and glfw have started their threads, the ones started after this share the core
+	JobManager::GetJobManager()->PinRenderThread();
 	mainLoop();
 	cleanup();
 }
@@ -41,6 +45,10 @@ void MyVulkanApplication::createInstance() {
 	createInfo.pApplicationInfo = &appInfo;
 
 	auto extensions = getRequiredExtensions();
+	// optional: needed to query the timeline semaphore feature of the device
+	physicalDeviceProperties2 = isInstanceExtensionSupported(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+	if (physicalDeviceProperties2)
+		extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
 	
 	createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
 	createInfo.ppEnabledExtensionNames = extensions.data();
@@ -88,32 +96,72 @@ void MyVulkanApplication::createSurface() {
 }
 
 //------------------------------------init vulkan
+// startup as a job graph: the file reads and the model and texture work run next to instance, device and swap chain
+// creation, the glfw calls (surface, framebuffer size) stay on the main thread. so do instance and device creation:
+// the threads the loader and the driver start there inherit the main thread's affinity, which is not narrowed yet,
+// where a worker's is a single processor
 void MyVulkanApplication::initVulkan() {
-	createInstance();
-	setupDebugMessenger();
-	createSurface();
-	pickPhysicalDevice();
-	createLogicalDevice();
-	createSwapChain();
-	createImageViews();
-	createRenderPass();
-	createDescriptorSetLayout();
-	createGraphicsPipeline();
-	createColorResources();
-	createDepthResources();
-	createFramebuffers();
-	createCommandPool();
-	createTextureImage();
-	createTextureImageView();
-	createTextureSampler();
-	loadModel();
-	createVertexBuffer();
-	createIndexBuffer();
-	createUniformBuffers();
-	createDescriptorPool();
-	createDescriptorSets();
-	createCommandBuffers();
-	createSyncObjects();
+	JobGraph graph;
+	JobGraph::Node instanceJob = graph.Add("instance", [this] {
+		createInstance();
+		setupDebugMessenger();
+		createSurface();
+	}, {}, true);
+	JobGraph::Node deviceJob = graph.Add("device", [this] {
+		pickPhysicalDevice();
+		createLogicalDevice();
+		createAllocator();
+		uploadContext.Create(device, allocator, transferQueue, transferFamily, findQueueFamilies(physicalDevice).graphicsFamily.value(), STAGING_RING_SIZE);
+		createCommandPool();
+	}, { instanceJob }, true);
+	JobGraph::Node swapChainJob = graph.Add("swap chain", [this] {
+		createSwapChain();
+		createImageViews();
+		createRenderPass();
+		createColorResources();
+		createDepthResources();
+		createFramebuffers();
+	}, { deviceJob }, true);
+	JobGraph::Node shaderFileJob = graph.Add("shader files", [this] { SyncWait(loadShaderFiles()); });
+	JobGraph::Node pipelineJob = graph.Add("pipelines", [this] {
+		createDescriptorSetLayout();
+		createPipelineCache();
+		createGraphicsPipeline();
+	}, { swapChainJob, shaderFileJob });
+	JobGraph::Node textureFileJob = graph.Add("texture file", [this] { textureStream.Prefetch(TEXTURE_PATH); });
+	JobGraph::Node textureJob = graph.Add("texture", [this] {
+		createTextureImage();
+		createTextureImageView();
+		createTextureSampler();
+	}, { deviceJob, textureFileJob });
+	JobGraph::Node modelJob = graph.Add("model", [this] {
+		loadModel();
+		optimizeModel();
+	});
+	JobGraph::Node meshBufferJob = graph.Add("mesh buffers", [this] {
+		createVertexBuffer();
+		createIndexBuffer();
+		modelCache.Close();																	// mesh data lives on the GPU now
+	}, { deviceJob, modelJob });
+	JobGraph::Node descriptorJob = graph.Add("descriptors", [this] {
+		createUniformBuffers();
+		createDescriptorPool();
+		createDescriptorSets();
+	}, { pipelineJob, textureJob });
+	graph.Add("command buffers", [this] {
+		createCommandBuffers();
+		createSyncObjects();
+	}, { swapChainJob, pipelineJob, meshBufferJob, descriptorJob });
+	graph.Run();
+	graph.Report("initVulkan");
+
+#ifdef RECORD_BENCHMARK
+	benchmarkRecording();
+#endif
+#ifdef ASYNC_BENCHMARK
+	benchmarkAsyncLoading();
+#endif
+	printAllocatorStats("initVulkan");
 }
 
 #pragma region vulkan init function
@@ -168,6 +216,8 @@ void MyVulkanApplication::createLogicalDevice() {
 
 	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 	std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value() };
+	if (indices.transferFamily.has_value())
+		uniqueQueueFamilies.insert(indices.transferFamily.value());
 
 	float queuePriority = 1.0f;
 	for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -192,8 +242,39 @@ void MyVulkanApplication::createLogicalDevice() {
 	deviceFeatures.samplerAnisotropy = VK_TRUE;
 	deviceFeatures.sampleRateShading = VK_TRUE;
 
-	createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+	deviceFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+	textureCompressionBC = supportedFeatures.textureCompressionBC == VK_TRUE;
+
+	// optional: lets the allocator ask the driver which resources want an allocation of their own
+	std::vector<const char*> extensions = deviceExtensions;
+	dedicatedAllocation = isDeviceExtensionSupported(VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME) &&
+		isDeviceExtensionSupported(VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME);
+	if (dedicatedAllocation) {
+		extensions.push_back(VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME);
+		extensions.push_back(VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME);
+	}
+	// optional: frame pacing on a timeline semaphore, frameTimeline falls back to fences
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures{};
+	timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+	timelineSemaphore = false;
+	if (physicalDeviceProperties2 && isDeviceExtensionSupported(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME)) {
+		auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+		VkPhysicalDeviceFeatures2KHR features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+		features2.pNext = &timelineFeatures;
+		if (getFeatures2 != nullptr) {
+			getFeatures2(physicalDevice, &features2);
+			timelineSemaphore = timelineFeatures.timelineSemaphore == VK_TRUE;
+		}
+	}
+	if (timelineSemaphore) {
+		extensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+		createInfo.pNext = &timelineFeatures;
+	}
+	createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+	createInfo.ppEnabledExtensionNames = extensions.data();
 
 	if (enableValidationLayers) {
 		createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
@@ -207,6 +288,29 @@ void MyVulkanApplication::createLogicalDevice() {
 
 	vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 	vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+	// uploads go to the copy engine when there is one, so they overlap rendering
+	transferFamily = indices.transferFamily.value_or(indices.graphicsFamily.value());
+	vkGetDeviceQueue(device, transferFamily, 0, &transferQueue);
+	std::cout << "createLogicalDevice: uploads on queue family " << transferFamily << (indices.transferFamily.has_value() ? " (transfer only)\n" : " (graphics)\n");
+}
+
+void MyVulkanApplication::createAllocator() {
+	// vk_mem_alloc.h is built with VMA_DYNAMIC_VULKAN_FUNCTIONS, it fetches the rest through these two
+	VmaVulkanFunctions vulkanFunctions{};
+	vulkanFunctions.vkGetInstanceProcAddr = vkGetInstanceProcAddr;
+	vulkanFunctions.vkGetDeviceProcAddr = vkGetDeviceProcAddr;
+
+	VmaAllocatorCreateInfo allocatorInfo{};
+	allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_0;
+	allocatorInfo.physicalDevice = physicalDevice;
+	allocatorInfo.device = device;
+	allocatorInfo.instance = instance;
+	allocatorInfo.pVulkanFunctions = &vulkanFunctions;
+	if (dedicatedAllocation)
+		allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_KHR_DEDICATED_ALLOCATION_BIT;
+
+	if (vmaCreateAllocator(&allocatorInfo, &allocator) != VK_SUCCESS)
+		throw std::runtime_error("failed to create memory allocator!");
 }
 
 void MyVulkanApplication::createSwapChain() {
@@ -375,162 +479,25 @@ void MyVulkanApplication::createDescriptorSetLayout() {
 		throw std::runtime_error("failed to create descriptor set layout!");
 }
 
-void MyVulkanApplication::createGraphicsPipeline() {
-	auto vertShaderCode = readFile("assets/shaders/shader.vert.spv");
-	auto fragShaderCode = readFile("assets/shaders/shader.frag.spv");
-
-	VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-	VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
-
-	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-	vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-
-	// vert shader
-	vertShaderStageInfo.module = vertShaderModule;
-	vertShaderStageInfo.pName = "main";
-
-	// frag shader
-	VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-	fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-	fragShaderStageInfo.module = fragShaderModule;
-	fragShaderStageInfo.pName = "main";
-
-	VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
-
-	// dynamic
-	std::vector<VkDynamicState> dynamicStates = {
-	VK_DYNAMIC_STATE_VIEWPORT,
-	VK_DYNAMIC_STATE_SCISSOR
-	};
-
-	VkPipelineDynamicStateCreateInfo dynamicState{};
-	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
-	dynamicState.pDynamicStates = dynamicStates.data();
-
-	// vertex input
-	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-
-	auto bindingDescription = Vertex::getBindingDescription();
-	auto attributeDescriptions = Vertex::getAttributeDescriptions();
-
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
-
-	// input assembly
-	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-	inputAssembly.primitiveRestartEnable = VK_FALSE;
-
-	// viewport and scissors
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = (float)swapChainExtent.width;
-	viewport.height = (float)swapChainExtent.height;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-
-	VkRect2D scissor{};
-	scissor.offset = { 0, 0 };
-	scissor.extent = swapChainExtent;
-
-	VkPipelineViewportStateCreateInfo viewportState{};
-	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
-	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
-
-	// rasterizer
-	VkPipelineRasterizationStateCreateInfo rasterizer{};
-	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-	rasterizer.depthClampEnable = VK_FALSE;
-
-	rasterizer.rasterizerDiscardEnable = VK_FALSE;
-	rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-	rasterizer.lineWidth = 1.0f;
-
-	rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-
-	rasterizer.depthBiasEnable = VK_FALSE;
-	rasterizer.depthBiasConstantFactor = 0.0f; // Optional
-	rasterizer.depthBiasClamp = 0.0f; // Optional
-	rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
-
-	// multisampling
-	VkPipelineMultisampleStateCreateInfo multisampling{};
-	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-	multisampling.sampleShadingEnable = VK_TRUE; // enable sample shading in the pipeline
-	multisampling.rasterizationSamples = msaaSamples;
-	multisampling.minSampleShading = .2f; // min fraction for sample shading; closer to one is smoother
-	multisampling.pSampleMask = nullptr; // Optional
-	multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
-	multisampling.alphaToOneEnable = VK_FALSE; // Optional
-
-	// depth dtencil
-	VkPipelineDepthStencilStateCreateInfo depthStencil{};
-	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-	depthStencil.depthTestEnable = VK_TRUE;
-	depthStencil.depthWriteEnable = VK_TRUE;
-	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
-	depthStencil.depthBoundsTestEnable = VK_FALSE;
-	depthStencil.minDepthBounds = 0.0f; // Optional
-	depthStencil.maxDepthBounds = 1.0f; // Optional
-	depthStencil.stencilTestEnable = VK_FALSE;
-	depthStencil.front = {}; // Optional
-	depthStencil.back = {}; // Optional
-
-	// color blending
-	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-	colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-	/*
-	* what is blend mode:
-	* 	if (blendEnable) {
-	*		finalColor.rgb = (srcColorBlendFactor * newColor.rgb) <colorBlendOp> (dstColorBlendFactor * oldColor.rgb);
-	*		finalColor.a = (srcAlphaBlendFactor * newColor.a) <alphaBlendOp> (dstAlphaBlendFactor * oldColor.a);
-	*	} else {
-	*		finalColor = newColor;
-	*	}
-	*
-	*	finalColor = finalColor & colorWriteMask;
-	*/
-#ifndef BLENDMODE
-	colorBlendAttachment.blendEnable = VK_FALSE;
-	colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-	colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-	colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
-	colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-	colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-	colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
-#else
-	colorBlendAttachment.blendEnable = VK_TRUE;
-	colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-	colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-	colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-	colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-	colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-	colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
-#endif // BLENDMODE
-	// here we do not implement the function for blend mode
-	VkPipelineColorBlendStateCreateInfo colorBlending{};
-	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-	colorBlending.logicOpEnable = VK_FALSE;
-	colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-	colorBlending.attachmentCount = 1;
-	colorBlending.pAttachments = &colorBlendAttachment;
-	colorBlending.blendConstants[0] = 0.0f; // Optional
-	colorBlending.blendConstants[1] = 0.0f; // Optional
-	colorBlending.blendConstants[2] = 0.0f; // Optional
-	colorBlending.blendConstants[3] = 0.0f; // Optional
+void MyVulkanApplication::createPipelineCache() {
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	pipelineCache = LoadPipelineCache(device, properties, PIPELINE_CACHE_PATH, pipelineCacheWarm);
+}
 
+void MyVulkanApplication::savePipelineCache() {
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	if (!SavePipelineCache(device, pipelineCache, properties, PIPELINE_CACHE_PATH))
+		std::cerr << "savePipelineCache: failed to write " << PIPELINE_CACHE_PATH << "\n";
+}
+
+Task<void> MyVulkanApplication::loadShaderFiles() {
+	vertShaderCode = co_await ReadFileAsync("assets/shaders/shader.vert.spv");
+	fragShaderCode = co_await ReadFileAsync("assets/shaders/shader.frag.spv");
+}
+
+void MyVulkanApplication::createGraphicsPipeline() {
 	// pipeline layout
 	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
 	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -542,94 +509,170 @@ void MyVulkanApplication::createGraphicsPipeline() {
 	if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
 		throw std::runtime_error("failed to create pipeline layout!");
 
-	// finally create pipeline
-	VkGraphicsPipelineCreateInfo pipelineInfo{};
-	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = 2;
-	pipelineInfo.pStages = shaderStages;
-
-	// fixed
-	pipelineInfo.pVertexInputState = &vertexInputInfo;
-	pipelineInfo.pInputAssemblyState = &inputAssembly;
-	pipelineInfo.pViewportState = &viewportState;
-	pipelineInfo.pRasterizationState = &rasterizer;
-	pipelineInfo.pMultisampleState = &multisampling;
-	pipelineInfo.pDepthStencilState = &depthStencil;
-	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = &dynamicState;
-
-	// pipeline layout
-	pipelineInfo.layout = pipelineLayout;
-
-	// render pass
-	pipelineInfo.renderPass = renderPass;
-	pipelineInfo.subpass = 0;
-
-	// derivatives
-	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
-	pipelineInfo.basePipelineIndex = -1; // Optional
-
-	if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS)
-		throw std::runtime_error("failed to create graphics pipeline!");
-
-	// clean up
-	vkDestroyShaderModule(device, fragShaderModule, nullptr);
-	vkDestroyShaderModule(device, vertShaderModule, nullptr);
+	// the permutations share shaders, layout and render pass; the manager owns the shader modules from here on
+	PipelineState state{};
+	state.vertShader = createShaderModule(vertShaderCode);
+	state.fragShader = createShaderModule(fragShaderCode);
+	vertShaderCode = std::vector<char>();
+	fragShaderCode = std::vector<char>();
+	state.layout = pipelineLayout;
+	state.renderPass = renderPass;
+	state.vertexFormat = vertexFormat;		// the pipelines are created before the model is loaded, LoadMeshCache/EncodeVertices produce vertexFormat
+	pipelineManager.Create(device, pipelineCache, state, PIPELINE_COMPILE_THREADS);
+
+	// the opaque permutation is what is drawn while any other one compiles, so it is the only one waited for
+	basePipelineKey.samples = msaaSamples;
+	Timer timer;
+	pipelineManager.Get(basePipelineKey);
+	std::cout << "graphics pipeline created in " << timer.elapsed() * 1000.0f << " ms (" << (pipelineCacheWarm ? "warm" : "cold") << " pipeline cache)\n";
+
+	pipelineKey = basePipelineKey;
+#ifdef BLENDMODE
+	pipelineKey.blendMode = BLEND_ALPHA;
+#endif // BLENDMODE
+	pipelineManager.Request(pipelineKey);
+
+	// the remaining blend and cull permutations of the render pass compile in the background
+	for (PipelineBlendMode blendMode : { BLEND_OPAQUE, BLEND_ALPHA })
+		for (VkCullModeFlags cullMode : { VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_NONE }) {
+			PipelineKey key = basePipelineKey;
+			key.blendMode = blendMode;
+			key.cullMode = cullMode;
+			pipelineManager.Request(key);
+		}
 }
 
 void MyVulkanApplication::createDepthResources() {
 	VkFormat depthFormat = findDepthFormat();
-	createImage(swapChainExtent.width, swapChainExtent.height, 1, msaaSamples, depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
+	createImage(swapChainExtent.width, swapChainExtent.height, 1, msaaSamples, depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT, depthImage, depthImageAllocation);
 	depthImageView = createImageView(depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
 }
 
 void MyVulkanApplication::createColorResources() {
 	VkFormat colorFormat = swapChainImageFormat;
 
-	createImage(swapChainExtent.width, swapChainExtent.height, 1, msaaSamples, colorFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, colorImage, colorImageMemory);
+	createImage(swapChainExtent.width, swapChainExtent.height, 1, msaaSamples, colorFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT, colorImage, colorImageAllocation);
 	colorImageView = createImageView(colorImage, colorFormat, VK_IMAGE_ASPECT_COLOR_BIT, 1);
 }
 
 void MyVulkanApplication::createTextureImage() {
-	int texWidth, texHeight, texChannels;
-	stbi_uc* pixels = stbi_load(TEXTURE_PATH.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-	VkDeviceSize imageSize = texWidth * texHeight * 4;
-	mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
-
-	if (!pixels)
-		throw std::runtime_error("failed to load texture image!");
-
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-	createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-	void* data;
-	vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-	memcpy(data, pixels, static_cast<size_t>(imageSize));
-	vkUnmapMemory(device, stagingBufferMemory);
-
-	stbi_image_free(pixels);
+	Timer timer;
+
+	// the baked texture is mapped right away, an image without one is decoded and built on a worker thread
+	textureStream.Open(TEXTURE_PATH, [this](bool opaque) { return selectTextureFormat(opaque); });
+	if (textureStream.IsReady()) {
+		createStreamedTextureImage();
+		std::cout << "createTextureImage: " << GetBakedTexturePath(TEXTURE_PATH) << " (" << textureStream.GetData().width << "x" << textureStream.GetData().height
+			<< ", " << GetTextureFormatName(textureFormat) << "), levels " << textureResidentLevel << "-" << mipLevels - 1 << " of " << mipLevels
+			<< " resident after " << timer.elapsed() * 1000.0f << " ms\n";
+	}
+	else {
+		createPlaceholderTextureImage();
+		std::cout << "createTextureImage: no baked texture, drawing with a placeholder until " << TEXTURE_PATH << " is built\n";
+	}
+}
 
-	createImage(texWidth, texHeight, mipLevels, VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-		VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT| VK_IMAGE_USAGE_SAMPLED_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		textureImage, textureImageMemory);
+// creates the image with every level, but uploads only the small tail: the rest is streamed in by updateTextureStreaming
+void MyVulkanApplication::createStreamedTextureImage() {
+	const TextureData& source = textureStream.GetData();
+	mipLevels = source.mipCount;
+	textureFormat = source.format;
+	texturePlaceholder = false;
+
+	createImage(source.width, source.height, mipLevels, VK_SAMPLE_COUNT_1_BIT, textureFormat, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 0,
+		textureImage, textureImageAllocation);
+
+	textureResidentLevel = textureStream.GetTailLevel(TEXTURE_STREAM_TAIL_SIZE);
+	uploadTextureLevels(source, textureResidentLevel, mipLevels, true);
+	if (textureResidentLevel == 0)
+		textureStream.Close();
+}
+
+void MyVulkanApplication::createPlaceholderTextureImage() {
+	mipLevels = 1;
+	textureFormat = VK_FORMAT_R8G8B8A8_SRGB;
+	texturePlaceholder = true;
+	textureResidentLevel = 0;
+
+	uint8_t texel[4] = { 128, 128, 128, 255 };
+	TextureLevel level = { 0, sizeof(texel), 1, 1 };
+	TextureData placeholder{};
+	placeholder.format = textureFormat;
+	placeholder.width = placeholder.height = 1;
+	placeholder.mipCount = 1;
+	placeholder.levels = &level;
+	placeholder.data = texel;
+	placeholder.dataSize = sizeof(texel);
+
+	createImage(1, 1, 1, VK_SAMPLE_COUNT_1_BIT, textureFormat, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 0,
+		textureImage, textureImageAllocation);
+	uploadTextureLevels(placeholder, 0, 1, true);
+}
+
+// records the upload of levels [firstLevel, endLevel) into the open upload batch, in bands of rows (of blocks) of at
+// most half the staging ring, so levels larger than the ring go through in several batches.
+// the levels are not sampled yet (minLod keeps the sampler above them), so their old contents are discarded; the
+// initial upload moves every level of the new image to SHADER_READ_ONLY so the whole view is in the layout the descriptor expects
+void MyVulkanApplication::uploadTextureLevels(const TextureData& source, uint32_t firstLevel, uint32_t endLevel, bool initial) {
+	std::lock_guard<std::mutex> lock(uploadLock);
+	const VkDeviceSize bandSize = uploadContext.GetSize() / 2;
+	const uint32_t blockHeight = IsBlockFormat(source.format) ? 4 : 1;
 
-	transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
-	copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
-	//transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, mipLevels);
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = textureImage;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = initial ? 0 : firstLevel;
+	barrier.subresourceRange.levelCount = initial ? source.mipCount : endLevel - firstLevel;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
 
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(uploadContext.GetCommandBuffer(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	for (uint32_t i = firstLevel; i < endLevel; i++) {
+		const TextureLevel& level = source.levels[i];
+		VkDeviceSize rowSize = GetLevelSize(source.format, level.width, 1);		// one row of texels or of blocks
+		uint32_t rowCount = (level.height + blockHeight - 1) / blockHeight;
+		for (uint32_t row = 0; row < rowCount;) {
+			uint32_t rows = static_cast<uint32_t>(std::clamp<VkDeviceSize>(bandSize / rowSize, 1, rowCount - row));
+			VkDeviceSize size = rows * rowSize;
+			VkDeviceSize offset = uploadContext.Allocate(size, TEXTURE_ALIGN);
+			memcpy(uploadContext.GetData(offset), source.data + level.offset + row * rowSize, static_cast<size_t>(size));
+
+			VkBufferImageCopy region{};
+			region.bufferOffset = offset;
+			region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			region.imageSubresource.mipLevel = i;
+			region.imageSubresource.baseArrayLayer = 0;
+			region.imageSubresource.layerCount = 1;
+			region.imageOffset = { 0, static_cast<int32_t>(row * blockHeight), 0 };
+			region.imageExtent = { level.width, std::min((row + rows) * blockHeight, level.height) - row * blockHeight, 1 };
+			vkCmdCopyBufferToImage(uploadContext.GetCommandBuffer(), uploadContext.GetBuffer(), textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+			row += rows;
+		}
+	}
 
-	generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB, texWidth, texHeight, mipLevels);
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	uploadContext.ReleaseImage(barrier, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
 }
 
 void MyVulkanApplication::createTextureImageView() {
-	textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels);
+	textureImageView = createImageView(textureImage, textureFormat, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels);
 }
 
+// one sampler per minLod: while levels are missing the descriptor sets use the one that starts at the finest resident level
 void MyVulkanApplication::createTextureSampler() {
 	VkSamplerCreateInfo samplerInfo{};
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -647,12 +690,23 @@ void MyVulkanApplication::createTextureSampler() {
 	samplerInfo.compareEnable = VK_FALSE;
 	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
 	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-	samplerInfo.minLod = 0.0f; // Optional
 	samplerInfo.maxLod = static_cast<float>(mipLevels);
 	samplerInfo.mipLodBias = 0.0f; // Optional
 
-	if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) != VK_SUCCESS)
-		throw std::runtime_error("failed to create texture sampler!");
+	textureSamplers.resize(mipLevels);
+	for (uint32_t i = 0; i < mipLevels; i++) {
+		samplerInfo.minLod = static_cast<float>(i);
+		if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSamplers[i]) != VK_SUCCESS)
+			throw std::runtime_error("failed to create texture sampler!");
+	}
+}
+
+void MyVulkanApplication::destroyTextureImage() {
+	for (VkSampler sampler : textureSamplers)
+		vkDestroySampler(device, sampler, nullptr);
+	textureSamplers.clear();
+	vkDestroyImageView(device, textureImageView, nullptr);
+	vmaDestroyImage(allocator, textureImage, textureImageAllocation);
 }
 
 void MyVulkanApplication::createFramebuffers() {
@@ -680,128 +734,186 @@ void MyVulkanApplication::createFramebuffers() {
 }
 
 void MyVulkanApplication::loadModel() {
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-	std::string warn, err;
-
-	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, MODEL_PATH.c_str())) {
-		throw std::runtime_error(warn + err);
+	Timer timer;
+
+	// warm start: map the cached vertex/index arrays, the upload copies straight out of the mapping
+	if (LoadMeshCache(MODEL_PATH, vertexFormat, modelCache, mesh)) {
+		// the draw needs the sub-meshes after the mapping is closed
+		subMeshes.assign(mesh.subMeshes, mesh.subMeshes + mesh.subMeshCount);
+		meshLods.assign(mesh.lods, mesh.lods + mesh.lodCount);
+		mesh.subMeshes = subMeshes.data();
+		mesh.lods = meshLods.data();
+		std::cout << "loadModel: warm load from " << GetMeshCachePath(MODEL_PATH) << " took " << timer.elapsed() * 1000.0f << " ms ("
+			<< mesh.vertexCount << " vertices, " << mesh.indexCount << " indices)\n";
+		LogMeshLods(mesh);
+		return;
 	}
 
-	std::unordered_map<Vertex, uint32_t> uniqueVertices{};
-
-	for (const auto& shape : shapes) {
-		for (const auto& index : shape.mesh.indices) {
-			Vertex vertex{};
+#ifdef MESH_BENCHMARK
+	BenchmarkObjLoad(MODEL_PATH);
+	timer.reset();
+#endif
 
-			vertex.pos = {
-				attrib.vertices[3 * index.vertex_index + 0],
-				attrib.vertices[3 * index.vertex_index + 1],
-				attrib.vertices[3 * index.vertex_index + 2]
-			};
+	uint32_t threadCount = JobManager::GetJobManager()->GetNumThreads();
 
-			vertex.texCoord = {
-				attrib.texcoords[2 * index.texcoord_index + 0],
-				1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
-			};
+	ObjData obj;
+	if (!ParseObj(MODEL_PATH, obj, threadCount))
+		throw std::runtime_error("failed to load model " + MODEL_PATH + "!");
 
-			vertex.color = { 1.0f, 1.0f, 1.0f };
+	WeldOptions weldOptions;
+	weldOptions.threadCount = threadCount;
+	WeldObj(obj, vertices, indices, weldOptions);
 
-			if (uniqueVertices.count(vertex) == 0) {
-				uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
-				vertices.push_back(vertex);
-			}
+	// mesh.vertices/indices are set once optimizeModel() has encoded them
+	mesh.vertexCount = static_cast<uint32_t>(vertices.size());
+	mesh.indexCount = static_cast<uint32_t>(indices.size());
 
-			indices.push_back(uniqueVertices[vertex]);
-		}
-	}
+	std::cout << "loadModel: cold load from " << MODEL_PATH << " took " << timer.elapsed() * 1000.0f << " ms ("
+		<< mesh.vertexCount << " vertices, " << mesh.indexCount << " indices)\n";
 }
 
-void MyVulkanApplication::createVertexBuffer() {
-	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
+void MyVulkanApplication::optimizeModel() {
+	// a mesh from the cache has been through this already
+	if (modelCache.IsOpen())
+		return;
 
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+	Timer timer;
+	VertexCacheStats before = AnalyzeVertexCache(indices.data(), indices.size(), static_cast<uint32_t>(vertices.size()), VERTEX_CACHE_SIZE);
+
+	// LOD chain, every level simplified from the previous one; the errors add up so they stay an upper bound
+	ComputeMeshBounds(vertices, mesh.boundsCenter, mesh.boundsRadius);
+	std::vector<std::vector<uint32_t>> lodIndices = { indices };
+	std::vector<float> lodErrors = { 0.0f };
+	while (lodIndices.size() < MESH_LOD_COUNT) {
+		const std::vector<uint32_t>& source = lodIndices.back();
+		float budget = MESH_LOD_MAX_ERROR * mesh.boundsRadius - lodErrors.back();
+		if (budget <= 0.0f) break;
+		float error;
+		std::vector<uint32_t> lod = SimplifyMesh(vertices, source, source.size() / 6 * 3, budget, error);
+		// stop when the error budget leaves hardly anything to remove
+		if (lod.empty() || lod.size() > source.size() * 3 / 4) break;
+		lodIndices.push_back(std::move(lod));
+		lodErrors.push_back(lodErrors.back() + error);
+	}
 
-	void* data;
-	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t)bufferSize);
-	vkUnmapMemory(device, stagingBufferMemory);
+	// every LOD gets its own cache order, the fetch order follows LOD 0 then the rest
+	std::vector<uint32_t> ranges;
+	indices.clear();
+	for (std::vector<uint32_t>& lod : lodIndices) {
+#ifdef OPTIMIZE_OVERDRAW
+		OptimizeVertexCache(lod, vertices, VERTEX_CACHE_SIZE, true);
+#else
+		OptimizeVertexCache(lod, vertices, VERTEX_CACHE_SIZE, false);
+#endif
+		ranges.push_back(static_cast<uint32_t>(indices.size()));
+		indices.insert(indices.end(), lod.begin(), lod.end());
+	}
+	OptimizeVertexFetch(vertices, indices);
+
+	VertexCacheStats after = AnalyzeVertexCache(indices.data(), lodIndices[0].size(), static_cast<uint32_t>(vertices.size()), VERTEX_CACHE_SIZE);
+	std::cout << "optimizeModel: " << timer.elapsed() * 1000.0f << " ms, cache " << VERTEX_CACHE_SIZE << " ACMR " << before.acmr << " -> " << after.acmr
+		<< ", ATVR " << before.atvr << " -> " << after.atvr << '\n';
+
+	// 16 bit indices whenever every sub-mesh can address its vertices with them
+	SplitMesh(vertices, indices, ranges, SPLIT_16BIT_INDICES ? 65536 : UINT32_MAX, subMeshes);
+	VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+	for (const SubMesh& subMesh : subMeshes)
+		if (subMesh.vertexCount > 65536) indexType = VK_INDEX_TYPE_UINT32;
+	EncodeIndices(indices, indexType, indexData);
+	std::cout << "optimizeModel: " << subMeshes.size() << " sub-mesh(es), " << GetIndexSize(indexType) * 8 << " bit indices, index buffer "
+		<< indexData.size() << " bytes\n";
+
+	// encode into the upload layout last, the passes above work on full precision vertices
+	EncodeVertices(vertices, vertexFormat, vertexData, mesh.vertexTransform);
+	std::cout << "optimizeModel: " << GetVertexFormatName(vertexFormat) << " vertices, " << Vertex::getStride(vertexFormat) << " bytes each (was "
+		<< sizeof(Vertex) << "), vertex buffer " << vertexData.size() << " bytes\n";
+
+	mesh.vertexFormat = vertexFormat;
+	mesh.vertices = vertexData.data();
+	mesh.vertexCount = static_cast<uint32_t>(vertices.size());
+	mesh.indexType = indexType;
+	mesh.indices = indexData.data();
+	mesh.indexCount = static_cast<uint32_t>(indices.size());
+	mesh.subMeshes = subMeshes.data();
+	mesh.subMeshCount = static_cast<uint32_t>(subMeshes.size());
+
+	// sub-meshes never straddle a range, so each LOD owns a consecutive run of them
+	meshLods.clear();
+	for (size_t l = 0, s = 0; l < lodIndices.size(); l++) {
+		MeshLod lod{ static_cast<uint32_t>(s), 0, static_cast<uint32_t>(lodIndices[l].size() / 3), lodErrors[l] };
+		for (; s < subMeshes.size() && (l + 1 == ranges.size() || subMeshes[s].firstIndex < ranges[l + 1]); s++)
+			lod.subMeshCount++;
+		meshLods.push_back(lod);
+	}
+	mesh.lods = meshLods.data();
+	mesh.lodCount = static_cast<uint32_t>(meshLods.size());
+	std::cout << "optimizeModel: " << mesh.lodCount << " lod(s), bounds radius " << mesh.boundsRadius << '\n';
+	LogMeshLods(mesh);
 
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
+	if (!SaveMeshCache(MODEL_PATH, mesh))
+		std::cerr << "optimizeModel: failed to write " << GetMeshCachePath(MODEL_PATH) << '\n';
+}
 
-	copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
+void MyVulkanApplication::createVertexBuffer() {
+	VkDeviceSize bufferSize = (VkDeviceSize)Vertex::getStride(mesh.vertexFormat) * mesh.vertexCount;
 
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
+	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 0, vertexBuffer, vertexBufferAllocation);
+	uploadBuffer(vertexBuffer, mesh.vertices, bufferSize);
 }
 
 void MyVulkanApplication::createIndexBuffer() {
-	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
-
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-	void* data;
-	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t)bufferSize);
-	vkUnmapMemory(device, stagingBufferMemory);
+	VkDeviceSize bufferSize = (VkDeviceSize)GetIndexSize(mesh.indexType) * mesh.indexCount;
 
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
-
-	copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
+	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, 0, indexBuffer, indexBufferAllocation);
+	uploadBuffer(indexBuffer, mesh.indices, bufferSize);
+	indexBufferType = mesh.indexType;
 }
 
 void MyVulkanApplication::createUniformBuffers() {
 	VkDeviceSize bufferSize = sizeof(UniformBufferObject);
 
-	uniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-	uniformBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
-	uniformBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+	uniformBuffers.resize(framesInFlight);
+	uniformBuffersAllocation.resize(framesInFlight);
+	uniformBuffersMapped.resize(framesInFlight);
 
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i], uniformBuffersMemory[i]);
-
-		vkMapMemory(device, uniformBuffersMemory[i], 0, bufferSize, 0, &uniformBuffersMapped[i]);
+	for (size_t i = 0; i < framesInFlight; i++) {
+		VmaAllocationInfo allocationInfo;
+		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, HOST_WRITE_ALLOCATION, uniformBuffers[i], uniformBuffersAllocation[i], &allocationInfo);
+		uniformBuffersMapped[i] = allocationInfo.pMappedData;
 	}
 }
 
 void MyVulkanApplication::createDescriptorPool() {
 	std::array<VkDescriptorPoolSize, 2> poolSizes{};
 	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+	poolSizes[0].descriptorCount = framesInFlight;
 	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+	poolSizes[1].descriptorCount = framesInFlight;
 
 	VkDescriptorPoolCreateInfo poolInfo{};
 	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
 	poolInfo.pPoolSizes = poolSizes.data();
-	poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+	poolInfo.maxSets = framesInFlight;
 
 	if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS)
 		throw std::runtime_error("failed to create descriptor pool!");
 }
 
 void MyVulkanApplication::createDescriptorSets() {
-	std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, descriptorSetLayout);
+	std::vector<VkDescriptorSetLayout> layouts(framesInFlight, descriptorSetLayout);
 	VkDescriptorSetAllocateInfo allocInfo{};
 	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	allocInfo.descriptorPool = descriptorPool;
-	allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+	allocInfo.descriptorSetCount = framesInFlight;
 	allocInfo.pSetLayouts = layouts.data();
 
-	descriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+	descriptorSets.resize(framesInFlight);
+	descriptorTextureLevel.resize(framesInFlight);
 	if (vkAllocateDescriptorSets(device, &allocInfo, descriptorSets.data()) != VK_SUCCESS)
 		throw std::runtime_error("failed to allocate descriptor sets!");
 
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+	for (size_t i = 0; i < framesInFlight; i++) {
 		VkDescriptorBufferInfo bufferInfo{};
 		bufferInfo.buffer = uniformBuffers[i];
 		bufferInfo.offset = 0;
@@ -810,7 +922,8 @@ void MyVulkanApplication::createDescriptorSets() {
 		VkDescriptorImageInfo imageInfo{};
 		imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 		imageInfo.imageView = textureImageView;
-		imageInfo.sampler = textureSampler;
+		imageInfo.sampler = textureSamplers[textureResidentLevel];
+		descriptorTextureLevel[i] = textureResidentLevel;
 
 		std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
 
@@ -834,6 +947,28 @@ void MyVulkanApplication::createDescriptorSets() {
 	}
 }
 
+// only called for the set of the frame whose fence was just waited for, so no submitted work still uses it
+void MyVulkanApplication::updateTextureDescriptor(uint32_t frame) {
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageInfo.imageView = textureImageView;
+	imageInfo.sampler = textureSamplers[textureResidentLevel];
+
+	VkWriteDescriptorSet descriptorWrite{};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstSet = descriptorSets[frame];
+	descriptorWrite.dstBinding = 1;
+	descriptorWrite.dstArrayElement = 0;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrite.descriptorCount = 1;
+	descriptorWrite.pImageInfo = &imageInfo;
+
+	vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+	descriptorTextureLevel[frame] = textureResidentLevel;
+	// a recorded command buffer that binds the set is invalid once the set is written
+	sceneVersion++;
+}
+
 void MyVulkanApplication::createCommandPool() {
 	QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
 
@@ -847,7 +982,7 @@ void MyVulkanApplication::createCommandPool() {
 }
 
 void MyVulkanApplication::createCommandBuffers() {
-	commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	commandBuffers.resize(framesInFlight);
 
 	VkCommandBufferAllocateInfo allocInfo{};
 	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -858,26 +993,68 @@ void MyVulkanApplication::createCommandBuffers() {
 	if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
 		throw std::runtime_error("failed to allocate command buffers!");
 
+	// secondaries for the recording jobs, one set per frame slot
+	commandRecorder.Create(device, findQueueFamilies(physicalDevice).graphicsFamily.value(), framesInFlight, JobManager::GetJobManager()->GetNumThreads());
+	createCachedCommandBuffers();
+}
+
+// one primary per frame slot and swap chain image, recorded on first use and again whenever sceneVersion has moved on
+void MyVulkanApplication::createCachedCommandBuffers() {
+	if (!REUSE_COMMAND_BUFFERS)
+		return;
+	if (!cachedCommandBuffers.empty())
+		vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(cachedCommandBuffers.size()), cachedCommandBuffers.data());
+
+	cachedCommandBuffers.resize(framesInFlight * swapChainImages.size());
+	cachedVersions.assign(cachedCommandBuffers.size(), 0);		// sceneVersion starts at 1, all of them get recorded
+
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = commandPool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = static_cast<uint32_t>(cachedCommandBuffers.size());
+
+	if (vkAllocateCommandBuffers(device, &allocInfo, cachedCommandBuffers.data()) != VK_SUCCESS)
+		throw std::runtime_error("failed to allocate command buffers!");
 }
 
 void MyVulkanApplication::createSyncObjects() {
-	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+	imageAvailableSemaphores.resize(framesInFlight);
+	renderFinishedSemaphores.resize(framesInFlight);
+	uploadSemaphores.resize(framesInFlight);
 
 	VkSemaphoreCreateInfo semaphoreInfo{};
 	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-	VkFenceCreateInfo fenceInfo{};
-	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+	for (size_t i = 0; i < framesInFlight; i++) {
 		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
 			vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
-			vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS)
+			vkCreateSemaphore(device, &semaphoreInfo, nullptr, &uploadSemaphores[i]) != VK_SUCCESS)
 			throw std::runtime_error("failed to create synchronization objects for a frame!");
 	}
+	frameTimeline.Create(device, timelineSemaphore, framesInFlight);
+	std::cout << "createSyncObjects: " << framesInFlight << " frame(s) in flight, paced by "
+		<< (timelineSemaphore ? "a timeline semaphore\n" : "fences\n");
+
+	// two timestamps per frame slot, when the graphics queue writes them
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+	if (queueFamilies[findQueueFamilies(physicalDevice).graphicsFamily.value()].timestampValidBits == 0)
+		return;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	timestampPeriod = properties.limits.timestampPeriod;
+
+	VkQueryPoolCreateInfo queryPoolInfo{};
+	queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryPoolInfo.queryCount = 2 * framesInFlight;
+	if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampPool) != VK_SUCCESS)
+		throw std::runtime_error("failed to create timestamp query pool!");
+	timestampValues.assign(framesInFlight, 0);
 }
 #pragma endregion
 
@@ -889,6 +1066,20 @@ void MyVulkanApplication::mainLoop() {
 	}
 
 	vkDeviceWaitIdle(device);
+	queueIdleCount++;
+
+	if (frameCount > 0) {
+		std::cout << "mainLoop: " << frameCount << " frames, " << framesInFlight << " in flight, cpu wait " << cpuWaitTime / frameCount << " ms/frame";
+		if (gpuWaitSamples > 0)
+			std::cout << ", gpu wait " << gpuWaitTime / gpuWaitSamples << " ms/frame";
+		std::cout << "\n";
+	}
+	if (REUSE_COMMAND_BUFFERS)
+		std::cout << "mainLoop: " << reusedFrames << " of " << frameCount << " frames reused a recorded command buffer\n";
+	for (size_t jobCount = 1; jobCount < recordFrames.size(); jobCount++)
+		if (recordFrames[jobCount] > 0)
+			std::cout << "mainLoop: recording " << recordTime[jobCount] / recordFrames[jobCount] << " ms/frame on " << jobCount
+				<< (jobCount == 1 ? " thread (" : " threads (") << recordFrames[jobCount] << " frames)\n";
 }
 /*HOW DOES A FRAME BEEN RENDERED ?
 * 
@@ -915,7 +1106,18 @@ void MyVulkanApplication::mainLoop() {
 */
 
 void MyVulkanApplication::drawFrame() {
-	vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+	// the frame slot is free once the frame submitted framesInFlight frames ago is done
+	uint64_t frameValue = frameTimeline.GetSubmittedValue() + 1;
+	if (frameValue > framesInFlight) {
+		Timer waitTimer;
+		frameTimeline.Wait(frameValue - framesInFlight);
+		cpuWaitTime += waitTimer.elapsed() * 1000.0;
+	}
+	readFrameTimestamps(currentFrame);
+
+	updateTextureStreaming();
+	if (descriptorTextureLevel[currentFrame] != textureResidentLevel)
+		updateTextureDescriptor(currentFrame);
 
 	uint32_t imageIndex;
 	VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
@@ -929,30 +1131,54 @@ void MyVulkanApplication::drawFrame() {
 
 	updateUniformBuffer(currentFrame);
 
-	// Only reset the fence if we are submitting work
-	vkResetFences(device, 1, &inFlightFences[currentFrame]);
+	// uploads recorded since the last frame go first. on the graphics queue their barriers order them before the draw,
+	// on a transfer queue they run beside rendering and the frame waits for them only where it acquires what they released
+	VkPipelineStageFlags uploadStages;
+	{
+		std::lock_guard<std::mutex> lock(uploadLock);
+		uploadContext.Submit(uploadSemaphores[currentFrame]);
+		uploadStages = uploadContext.GetAcquireStages();
+	}
 
-	vkResetCommandBuffer(commandBuffers[currentFrame], /*VkCommandBufferResetFlagBits*/ 0);
-	recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+	// a frame that acquires uploads records into the slot's own command buffer, every other one reuses the buffer
+	// recorded for its slot and image until the scene changes
+	updateDrawList();
+	VkCommandBuffer commandBuffer = commandBuffers[currentFrame];
+	if (REUSE_COMMAND_BUFFERS && uploadStages == 0) {
+		size_t cached = currentFrame * swapChainImages.size() + imageIndex;
+		commandBuffer = cachedCommandBuffers[cached];
+		if (cachedVersions[cached] != sceneVersion) {
+			vkResetCommandBuffer(commandBuffer, /*VkCommandBufferResetFlagBits*/ 0);
+			recordCommandBuffer(commandBuffer, imageIndex, true);
+			cachedVersions[cached] = sceneVersion;
+		}
+		else
+			reusedFrames++;
+	}
+	else {
+		vkResetCommandBuffer(commandBuffer, /*VkCommandBufferResetFlagBits*/ 0);
+		recordCommandBuffer(commandBuffer, imageIndex, false);
+	}
 
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-	VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] };
-	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-	submitInfo.waitSemaphoreCount = 1;
+	VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame], uploadSemaphores[currentFrame] };
+	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, uploadStages };
+	submitInfo.waitSemaphoreCount = uploadStages != 0 ? 2 : 1;
 	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.pWaitDstStageMask = waitStages;
 
 	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+	submitInfo.pCommandBuffers = &commandBuffer;
 
 	VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
 	submitInfo.signalSemaphoreCount = 1;
 	submitInfo.pSignalSemaphores = signalSemaphores;
 
-	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS)
-		throw std::runtime_error("failed to submit draw command buffer!");
+	frameTimeline.Submit(graphicsQueue, submitInfo);
+	if (timestampPool != VK_NULL_HANDLE)
+		timestampValues[currentFrame] = frameValue;
 
 	VkPresentInfoKHR presentInfo{};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -975,17 +1201,69 @@ void MyVulkanApplication::drawFrame() {
 	else if (result != VK_SUCCESS)
 		throw std::runtime_error("failed to present swap chain image!");
 
-	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+	if (frameCount++ == 0)
+		std::cout << "drawFrame: first frame presented " << startupTimer.elapsed() * 1000.0f << " ms after start, " << queueIdleCount
+			<< " queue idle stall(s), " << uploadContext.GetWaitCount() << " upload wait(s)\n";
+	currentFrame = (currentFrame + 1) % framesInFlight;
+}
+
+// idle time of the graphics queue before the frame that last used the slot, which has completed
+void MyVulkanApplication::readFrameTimestamps(uint32_t frame) {
+	if (timestampPool == VK_NULL_HANDLE || timestampValues[frame] == 0)
+		return;
+	timestampValues[frame] = 0;
+
+	uint64_t timestamps[2];
+	if (vkGetQueryPoolResults(device, timestampPool, 2 * frame, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+		return;
+	// slots are read in submission order, lastFrameEnd belongs to the frame before
+	if (lastFrameEnd != 0 && timestamps[0] > lastFrameEnd) {
+		gpuWaitTime += (timestamps[0] - lastFrameEnd) * timestampPeriod * 1e-6;
+		gpuWaitSamples++;
+	}
+	lastFrameEnd = timestamps[1];
+}
+
+// swaps the placeholder for the built texture once the worker is done, then uploads the next finer levels each frame
+void MyVulkanApplication::updateTextureStreaming() {
+	if (texturePlaceholder) {
+		if (textureStream.HasFailed())
+			throw std::runtime_error("failed to load texture image!");
+		// the first frame has to run before the swap: it submits and acquires the placeholder's upload
+		if (!textureStream.IsReady() || frameCount == 0)
+			return;
+
+		// the placeholder may still be in use by the frames in flight
+		frameTimeline.Wait(frameTimeline.GetSubmittedValue());
+		destroyTextureImage();
+		createStreamedTextureImage();
+		createTextureImageView();
+		createTextureSampler();
+		descriptorTextureLevel.assign(framesInFlight, UINT32_MAX);
+		std::cout << "updateTextureStreaming: " << TEXTURE_PATH << " built, levels " << textureResidentLevel << "-" << mipLevels - 1
+			<< " resident after " << startupTimer.elapsed() * 1000.0f << " ms\n";
+		return;
+	}
+	if (textureResidentLevel == 0)
+		return;
+
+	uint32_t level = textureStream.GetNextLevel(textureResidentLevel, TEXTURE_STREAM_BUDGET);
+	uploadTextureLevels(textureStream.GetData(), level, textureResidentLevel, false);
+	textureResidentLevel = level;
+	if (textureResidentLevel == 0) {
+		std::cout << "updateTextureStreaming: " << TEXTURE_PATH << " fully resident " << startupTimer.elapsed() * 1000.0f << " ms after start (frame "
+			<< frameCount << ")\n";
+		textureStream.Close();
+		printAllocatorStats("updateTextureStreaming");
+	}
 }
 
 void MyVulkanApplication::cleanupSwapChain() {
 	vkDestroyImageView(device, colorImageView, nullptr);
-	vkDestroyImage(device, colorImage, nullptr);
-	vkFreeMemory(device, colorImageMemory, nullptr);
+	vmaDestroyImage(allocator, colorImage, colorImageAllocation);
 
 	vkDestroyImageView(device, depthImageView, nullptr);
-	vkDestroyImage(device, depthImage, nullptr);
-	vkFreeMemory(device, depthImageMemory, nullptr);
+	vmaDestroyImage(allocator, depthImage, depthImageAllocation);
 
 	for (size_t i = 0; i < swapChainFramebuffers.size(); i++)
 		vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
@@ -1009,6 +1287,7 @@ void MyVulkanApplication::recreateSwapChain() {
 	}
 
 	vkDeviceWaitIdle(device);
+	queueIdleCount++;
 
 	cleanupSwapChain();
 
@@ -1017,45 +1296,49 @@ void MyVulkanApplication::recreateSwapChain() {
 	createColorResources();
 	createDepthResources();
 	createFramebuffers();
+	// the recorded frames point at the old framebuffers, and the image count may have changed
+	createCachedCommandBuffers();
 }
 
 //------------------------------------clean up
 void MyVulkanApplication::cleanup() {
 	cleanupSwapChain();
 
-	vkDestroySampler(device, textureSampler, nullptr);
-	vkDestroyImageView(device, textureImageView, nullptr);
-
-	vkDestroyImage(device, textureImage, nullptr);
-	vkFreeMemory(device, textureImageMemory, nullptr);
+	destroyTextureImage();
+	textureStream.Close();
 
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-		vkDestroyBuffer(device, uniformBuffers[i], nullptr);
-		vkFreeMemory(device, uniformBuffersMemory[i], nullptr);
+	for (size_t i = 0; i < framesInFlight; i++) {
+		vmaDestroyBuffer(allocator, uniformBuffers[i], uniformBuffersAllocation[i]);
 	}
 
 	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 	vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 
-	vkDestroyBuffer(device, indexBuffer, nullptr);
-	vkFreeMemory(device, indexBufferMemory, nullptr);
-
-	vkDestroyBuffer(device, vertexBuffer, nullptr);
-	vkFreeMemory(device, vertexBufferMemory, nullptr);
+	vmaDestroyBuffer(allocator, indexBuffer, indexBufferAllocation);
+	vmaDestroyBuffer(allocator, vertexBuffer, vertexBufferAllocation);
 
-	vkDestroyPipeline(device, graphicsPipeline, nullptr);
+	pipelineManager.Destroy();
 	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
 
+	savePipelineCache();
+	vkDestroyPipelineCache(device, pipelineCache, nullptr);
+
 	vkDestroyRenderPass(device, renderPass, nullptr);
 
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+	for (size_t i = 0; i < framesInFlight; i++) {
 		vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
 		vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-		vkDestroyFence(device, inFlightFences[i], nullptr);
+		vkDestroySemaphore(device, uploadSemaphores[i], nullptr);
 	}
+	frameTimeline.Destroy();
+	if (timestampPool != VK_NULL_HANDLE)
+		vkDestroyQueryPool(device, timestampPool, nullptr);
 
+	commandRecorder.Destroy();
 	vkDestroyCommandPool(device, commandPool, nullptr);
 
+	uploadContext.Destroy();
+	vmaDestroyAllocator(allocator);
 	vkDestroyDevice(device, nullptr);
 
 	if (enableValidationLayers)
@@ -1076,97 +1359,41 @@ void MyVulkanApplication::updateUniformBuffer(uint32_t currentImage) {
 	float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
 
 	UniformBufferObject ubo{};
+	const VertexTransform& transform = mesh.vertexTransform;
 	ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+	modelMatrix = ubo.model;
+	ubo.model = glm::translate(ubo.model, glm::vec3(transform.positionOffset[0], transform.positionOffset[1], transform.positionOffset[2]));
+	ubo.model = glm::scale(ubo.model, glm::vec3(transform.positionScale[0], transform.positionScale[1], transform.positionScale[2]));
+	ubo.texCoordTransform = glm::vec4(transform.texCoordScale[0], transform.texCoordScale[1], transform.texCoordOffset[0], transform.texCoordOffset[1]);
 	ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
 	ubo.proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float)swapChainExtent.height, 0.1f, 10.0f);
 	ubo.proj[1][1] *= -1;
+	viewMatrix = ubo.view;
+	projMatrix = ubo.proj;
 
 	memcpy(uniformBuffersMapped[currentImage], &ubo, sizeof(ubo));
+	vmaFlushAllocation(allocator, uniformBuffersAllocation[currentImage], 0, VK_WHOLE_SIZE);
 }
 
-void MyVulkanApplication::generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels){
-	VkFormatProperties formatProperties;
-	vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat, &formatProperties);
-
-	if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT))
-		throw std::runtime_error("texture image format does not support linear blitting!");
-
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-	VkImageMemoryBarrier barrier{};
-	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	barrier.image = image;
-	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	barrier.subresourceRange.baseArrayLayer = 0;
-	barrier.subresourceRange.layerCount = 1;
-	barrier.subresourceRange.levelCount = 1;
-
-	int32_t mipWidth = texWidth;
-	int32_t mipHeight = texHeight;
-
-	for (uint32_t i = 1; i < mipLevels; i++) {
-		barrier.subresourceRange.baseMipLevel = i - 1;
-		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-		vkCmdPipelineBarrier(commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-			0, nullptr,
-			0, nullptr,
-			1, &barrier);
-
-		VkImageBlit blit{};
-		blit.srcOffsets[0] = { 0, 0, 0 };
-		blit.srcOffsets[1] = { mipWidth, mipHeight, 1 };
-		blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		blit.srcSubresource.mipLevel = i - 1;
-		blit.srcSubresource.baseArrayLayer = 0;
-		blit.srcSubresource.layerCount = 1;
-		blit.dstOffsets[0] = { 0, 0, 0 };
-		blit.dstOffsets[1] = { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1, 1 };
-		blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		blit.dstSubresource.mipLevel = i;
-		blit.dstSubresource.baseArrayLayer = 0;
-		blit.dstSubresource.layerCount = 1;
-
-		vkCmdBlitImage(commandBuffer,
-			image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-			image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			1, &blit,
-			VK_FILTER_LINEAR);
-
-		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-		vkCmdPipelineBarrier(commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-			0, nullptr,
-			0, nullptr,
-			1, &barrier);
-
-		if (mipWidth > 1) mipWidth /= 2;
-		if (mipHeight > 1) mipHeight /= 2;
-	}
-
-	barrier.subresourceRange.baseMipLevel = mipLevels - 1;
-	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+uint32_t MyVulkanApplication::selectLod() {
+	// distance to the front of the bounding sphere, the whole mesh is treated as being that close
+	glm::vec4 center = viewMatrix * modelMatrix * glm::vec4(mesh.boundsCenter[0], mesh.boundsCenter[1], mesh.boundsCenter[2], 1.0f);
+	float distance = std::max(-center.z - mesh.boundsRadius, 0.1f);
+	float pixelsPerUnit = std::fabs(projMatrix[1][1]) * 0.5f * swapChainExtent.height / distance;
 
-	vkCmdPipelineBarrier(commandBuffer,
-		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-		0, nullptr,
-		0, nullptr,
-		1, &barrier);
+	uint32_t lod = 0;
+	for (uint32_t i = static_cast<uint32_t>(meshLods.size()); i-- > 1;)
+		if (meshLods[i].error * pixelsPerUnit <= LOD_ERROR_PIXELS) {
+			lod = i;
+			break;
+		}
 
-	endSingleTimeCommands(commandBuffer);
+	if (lod != currentLod) {
+		std::cout << "selectLod: lod " << currentLod << " -> " << lod << " (" << meshLods[lod].triangleCount << " triangles, error "
+			<< meshLods[lod].error * pixelsPerUnit << " px)\n";
+		currentLod = lod;
+	}
+	return lod;
 }
 
 VkImageView MyVulkanApplication::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels) {
@@ -1189,46 +1416,62 @@ VkImageView MyVulkanApplication::createImageView(VkImage image, VkFormat format,
 	return imageView;
 }
 
-VkCommandBuffer MyVulkanApplication::beginSingleTimeCommands() {
-	VkCommandBufferAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandPool = commandPool;
-	allocInfo.commandBufferCount = 1;
+// the draw list and pipeline of the frame; any change to them moves sceneVersion on
+void MyVulkanApplication::updateDrawList() {
+	uint32_t lod = selectLod();
+	// the base pipeline stands in until pipelineKey has compiled
+	VkPipeline pipeline = pipelineManager.Find(pipelineKey, basePipelineKey);
+	if (!drawList.empty() && lod == drawLod && pipeline == drawPipeline)
+		return;
 
-	VkCommandBuffer commandBuffer;
-	vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+	// the draw list of the frame: the sub-meshes of the selected LOD
+	const MeshLod& meshLod = meshLods[lod];
+	drawList.clear();
+	for (uint32_t i = meshLod.firstSubMesh; i < meshLod.firstSubMesh + meshLod.subMeshCount; i++)
+		drawList.push_back({ subMeshes[i].indexCount, subMeshes[i].firstIndex, subMeshes[i].vertexOffset });
+	drawLod = lod;
+	drawPipeline = pipeline;
+	sceneVersion++;
+}
 
+// reusable: the buffer is kept and submitted again, so it cannot execute the recorder's one-time secondaries
+void MyVulkanApplication::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, bool reusable) {
 	VkCommandBufferBeginInfo beginInfo{};
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-	vkBeginCommandBuffer(commandBuffer, &beginInfo);
+	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+		throw std::runtime_error("failed to begin recording command buffer!");
 
-	return commandBuffer;
-}
+	{
+		std::lock_guard<std::mutex> lock(uploadLock);
+		uploadContext.RecordAcquires(commandBuffer);
+	}
 
-void MyVulkanApplication::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-	vkEndCommandBuffer(commandBuffer);
+	if (timestampPool != VK_NULL_HANDLE) {
+		vkCmdResetQueryPool(commandBuffer, timestampPool, 2 * currentFrame, 2);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, 2 * currentFrame);
+	}
 
-	VkSubmitInfo submitInfo{};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffer;
+	uint32_t jobCount = reusable ? 1 : static_cast<uint32_t>(drawList.size()) / RECORD_DRAWS_PER_JOB;
+	jobCount = std::clamp(jobCount, 1u, commandRecorder.GetMaxJobCount());
+	Timer timer;
+	recordDrawList(commandBuffer, imageIndex, jobCount);
+	if (recordFrames.size() <= jobCount) {
+		recordTime.resize(jobCount + 1, 0.0);
+		recordFrames.resize(jobCount + 1, 0);
+	}
+	recordTime[jobCount] += timer.elapsed() * 1000.0;
+	recordFrames[jobCount]++;
 
-	vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-	vkQueueWaitIdle(graphicsQueue);
+	if (timestampPool != VK_NULL_HANDLE)
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, 2 * currentFrame + 1);
 
-	vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+		throw std::runtime_error("failed to record command buffer!");
 }
 
-void MyVulkanApplication::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
-	VkCommandBufferBeginInfo beginInfo{};
-	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-
-	if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
-		throw std::runtime_error("failed to begin recording command buffer!");
-
+// the render pass instance with drawList in it, recorded by jobCount jobs in secondaries or inline when it is 1
+void MyVulkanApplication::recordDrawList(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t jobCount) {
 	VkRenderPassBeginInfo renderPassInfo{};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
 	renderPassInfo.renderPass = renderPass;
@@ -1242,168 +1485,248 @@ void MyVulkanApplication::recordCommandBuffer(VkCommandBuffer commandBuffer, uin
 	renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
 	renderPassInfo.pClearValues = clearValues.data();
 
-	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = (float)swapChainExtent.width;
-	viewport.height = (float)swapChainExtent.height;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+	DrawState state{};
+	state.renderPass = renderPass;
+	state.framebuffer = swapChainFramebuffers[imageIndex];
+	state.extent = swapChainExtent;
+	state.pipeline = drawPipeline;
+	state.layout = pipelineLayout;
+	state.descriptorSet = descriptorSets[currentFrame];
+	state.vertexBuffer = vertexBuffer;
+	state.indexBuffer = indexBuffer;
+	state.indexType = indexBufferType;
+
+	if (jobCount > 1) {
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		commandRecorder.Record(commandBuffer, currentFrame, state, drawList, jobCount);
+	}
+	else {
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+		CommandRecorder::RecordDraws(commandBuffer, state, drawList.data(), static_cast<uint32_t>(drawList.size()));
+	}
 
-	VkRect2D scissor{};
-	scissor.offset = { 0, 0 };
-	scissor.extent = swapChainExtent;
-	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+	vkCmdEndRenderPass(commandBuffer);
+}
 
-	VkBuffer vertexBuffers[] = { vertexBuffer };
-	VkDeviceSize offsets[] = { 0 };
-	vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+#ifdef RECORD_BENCHMARK
+// records the finest LOD's draws, repeated up to RECORD_BENCHMARK_DRAWS draws, with every job count; nothing is submitted
+void MyVulkanApplication::benchmarkRecording() {
+	const MeshLod& lod = meshLods[0];
+	drawList.clear();
+	while (drawList.size() < RECORD_BENCHMARK_DRAWS)
+		for (uint32_t i = lod.firstSubMesh; i < lod.firstSubMesh + lod.subMeshCount && drawList.size() < RECORD_BENCHMARK_DRAWS; i++)
+			drawList.push_back({ subMeshes[i].indexCount, subMeshes[i].firstIndex, subMeshes[i].vertexOffset });
 
-	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame], 0, nullptr);
+	drawPipeline = pipelineManager.Find(pipelineKey, basePipelineKey);
+
+	std::cout << "record benchmark: " << drawList.size() << " draws";
+	for (uint32_t jobCount = 1; jobCount <= commandRecorder.GetMaxJobCount(); jobCount++) {
+		Timer timer;
+		for (uint32_t run = 0; run < RECORD_BENCHMARK_RUNS; run++) {
+			vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+			if (vkBeginCommandBuffer(commandBuffers[currentFrame], &beginInfo) != VK_SUCCESS)
+				throw std::runtime_error("failed to begin recording command buffer!");
+			recordDrawList(commandBuffers[currentFrame], 0, jobCount);
+			if (vkEndCommandBuffer(commandBuffers[currentFrame]) != VK_SUCCESS)
+				throw std::runtime_error("failed to record command buffer!");
+		}
+		std::cout << ", " << jobCount << (jobCount == 1 ? " thread " : " threads ") << timer.elapsed() * 1000.0f / RECORD_BENCHMARK_RUNS << " ms";
+	}
+	std::cout << '\n';
+	vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+	drawList.clear();							// updateDrawList builds the real one
 
-	vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+}
+#endif
 
-	vkCmdEndRenderPass(commandBuffer);
+#ifdef ASYNC_BENCHMARK
+// what a loader does to each kind of asset before its upload: SPIR-V becomes a shader module (and the words are
+// uploaded), images are decoded to rgba8, OBJ text is parsed down to its positions
+void MyVulkanApplication::decodeAsset(const std::string& path, const std::vector<char>& file, std::vector<uint8_t>& data) {
+	std::string extension = path.substr(path.find_last_of('.') + 1);
+	if (extension == "spv") {
+		vkDestroyShaderModule(device, createShaderModule(file), nullptr);
+		data.assign(file.begin(), file.end());
+	}
+	else if (extension == "obj") {
+		ObjData obj;
+		if (!ParseObj(file.data(), file.size(), obj, 1))
+			throw std::runtime_error("failed to load model " + path + "!");
+		data.resize(obj.positions.size() * sizeof(float));
+		memcpy(data.data(), obj.positions.data(), data.size());
+	}
+	else {
+		int width, height, channels;
+		stbi_uc* pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(file.data()), static_cast<int>(file.size()), &width, &height, &channels, STBI_rgb_alpha);
+		if (!pixels)
+			throw std::runtime_error("failed to load texture image!");
+		data.assign(pixels, pixels + static_cast<size_t>(width) * height * 4);
+		stbi_image_free(pixels);
+	}
+}
 
-	if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
-		throw std::runtime_error("failed to record command buffer!");
+size_t MyVulkanApplication::loadAsset(const std::string& path, VkBuffer& buffer, VmaAllocation& allocation) {
+	std::vector<uint8_t> data;
+	decodeAsset(path, readFile(path), data);
+	createBuffer(data.size(), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 0, buffer, allocation);
+	uploadBuffer(buffer, data.data(), data.size());
+	std::lock_guard<std::mutex> lock(uploadLock);
+	uploadContext.Wait(uploadContext.Submit());
+	return data.size();
+}
+
+// loadAsset as a coroutine: the read waits on the async I/O thread and the code after it runs on a worker, the upload
+// resumes once its batch has completed
+Task<void> MyVulkanApplication::loadAssetAsync(std::string path, size_t& bytes, VkBuffer& buffer, VmaAllocation& allocation) {
+	std::vector<char> file = co_await ReadFileAsync(path);
+	std::vector<uint8_t> data;
+	decodeAsset(path, file, data);
+	createBuffer(data.size(), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 0, buffer, allocation);
+	co_await uploadBufferAsync(buffer, data.data(), data.size());
+	bytes = data.size();
+}
+
+// every asset ASYNC_BENCHMARK_COPIES times, first one after another on the main thread, then all at once as coroutines
+void MyVulkanApplication::benchmarkAsyncLoading() {
+	const std::string assets[] = { "assets/shaders/shader.vert.spv", "assets/shaders/shader.frag.spv", "assets/textures/texture.jpg", TEXTURE_PATH, MODEL_PATH };
+	std::vector<std::string> paths;
+	for (uint32_t i = 0; i < ASYNC_BENCHMARK_COPIES; i++)
+		paths.insert(paths.end(), std::begin(assets), std::end(assets));
+	std::vector<VkBuffer> buffers(paths.size() * 2);
+	std::vector<VmaAllocation> allocations(paths.size() * 2);
+
+	Timer timer;
+	size_t bytes = 0;
+	for (size_t i = 0; i < paths.size(); i++)
+		bytes += loadAsset(paths[i], buffers[i], allocations[i]);
+	float sequentialTime = timer.elapsed();
+
+	timer.reset();
+	std::vector<size_t> taskBytes(paths.size());
+	std::vector<Task<void>> tasks;
+	for (size_t i = 0; i < paths.size(); i++)
+		tasks.push_back(loadAssetAsync(paths[i], taskBytes[i], buffers[paths.size() + i], allocations[paths.size() + i]));
+	SyncWait(WhenAll(std::move(tasks)));
+	float coroutineTime = timer.elapsed();
+
+	std::cout << "async load benchmark: " << paths.size() << " assets, " << bytes / 1024 << " KB uploaded, one after another "
+		<< sequentialTime * 1000.0f << " ms, as coroutines " << coroutineTime * 1000.0f << " ms on " << JobManager::GetJobManager()->GetNumThreads() << " threads\n";
+
+	// on a transfer queue of its own the uploads released the buffers to the graphics queue, which has to acquire them
+	// before they can go
+	std::lock_guard<std::mutex> lock(uploadLock);
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	VkSemaphore semaphore;
+	if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS)
+		throw std::runtime_error("failed to create semaphore!");
+	uint64_t ticket = uploadContext.Submit(semaphore);
+	VkPipelineStageFlags acquireStages = uploadContext.GetAcquireStages();
+	if (acquireStages != 0) {
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = commandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+		VkCommandBuffer commandBuffer;
+		if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS)
+			throw std::runtime_error("failed to allocate command buffers!");
+
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		vkBeginCommandBuffer(commandBuffer, &beginInfo);
+		uploadContext.RecordAcquires(commandBuffer);
+		vkEndCommandBuffer(commandBuffer);
+
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.pWaitSemaphores = &semaphore;
+		submitInfo.pWaitDstStageMask = &acquireStages;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &commandBuffer;
+		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+			throw std::runtime_error("failed to submit draw command buffer!");
+		vkQueueWaitIdle(graphicsQueue);
+		queueIdleCount++;
+		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+	}
+	uploadContext.Wait(ticket);
+	vkDestroySemaphore(device, semaphore, nullptr);
+	for (size_t i = 0; i < buffers.size(); i++)
+		vmaDestroyBuffer(allocator, buffers[i], allocations[i]);
 }
+#endif
 
-void MyVulkanApplication::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+// memory comes from the allocator, usage picks the memory type: device local unless flags ask for host access
+void MyVulkanApplication::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaAllocationCreateFlags flags, VkBuffer& buffer, VmaAllocation& allocation, VmaAllocationInfo* allocationInfo) {
 	VkBufferCreateInfo bufferInfo{};
 	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferInfo.size = size;
 	bufferInfo.usage = usage;
 	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-	if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
-		throw std::runtime_error("failed to create buffer!");
-
-	VkMemoryRequirements memRequirements;
-	vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
-
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS)
-		throw std::runtime_error("failed to allocate buffer memory!");
-
-	vkBindBufferMemory(device, buffer, bufferMemory, 0);
-}
-
-void MyVulkanApplication::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-	VkBufferCopy copyRegion{};
-	copyRegion.size = size;
-	vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-
-	endSingleTimeCommands(commandBuffer);
-}
-
-void MyVulkanApplication::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-	VkBufferImageCopy region{};
-	region.bufferOffset = 0;
-	region.bufferRowLength = 0;
-	region.bufferImageHeight = 0;
-
-	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	region.imageSubresource.mipLevel = 0;
-	region.imageSubresource.baseArrayLayer = 0;
-	region.imageSubresource.layerCount = 1;
-
-	region.imageOffset = { 0, 0, 0 };
-	region.imageExtent = {
-		width,
-		height,
-		1
-	};
-
-	vkCmdCopyBufferToImage(
-		commandBuffer,
-		buffer,
-		image,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		1,
-		&region
-	);
+	VmaAllocationCreateInfo allocInfo{};
+	allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
+	allocInfo.flags = flags;
 
-	endSingleTimeCommands(commandBuffer);
+	if (vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &buffer, &allocation, allocationInfo) != VK_SUCCESS)
+		throw std::runtime_error("failed to create buffer!");
 }
 
-void MyVulkanApplication::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels) {
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+// records copies of data to dstBuffer into the open upload batch, through the staging ring in pieces of at most half
+// of it; dstBuffer is a vertex or index buffer, the barrier makes the copies visible to the vertex input of later draws
+void MyVulkanApplication::uploadBuffer(VkBuffer dstBuffer, const void* data, VkDeviceSize size) {
+	std::lock_guard<std::mutex> lock(uploadLock);
+	const VkDeviceSize chunkSize = uploadContext.GetSize() / 2;
+	for (VkDeviceSize done = 0; done < size;) {
+		VkDeviceSize chunk = std::min(size - done, chunkSize);
+		VkDeviceSize offset = uploadContext.Allocate(chunk, 16);
+		memcpy(uploadContext.GetData(offset), static_cast<const uint8_t*>(data) + done, static_cast<size_t>(chunk));
+
+		VkBufferCopy copyRegion{};
+		copyRegion.srcOffset = offset;
+		copyRegion.dstOffset = done;
+		copyRegion.size = chunk;
+		vkCmdCopyBuffer(uploadContext.GetCommandBuffer(), uploadContext.GetBuffer(), dstBuffer, 1, &copyRegion);
+		done += chunk;
+	}
 
-	VkImageMemoryBarrier barrier{};
-	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	barrier.oldLayout = oldLayout;
-	barrier.newLayout = newLayout;
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
 	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.image = image;
-	
-	if (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-		if (hasStencilComponent(format))
-			barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-	}
-	else barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-
-	barrier.subresourceRange.baseMipLevel = 0;
-	barrier.subresourceRange.levelCount = mipLevels;
-	barrier.subresourceRange.baseArrayLayer = 0;
-	barrier.subresourceRange.layerCount = 1;
-
-	VkPipelineStageFlags sourceStage;
-	VkPipelineStageFlags destinationStage;
-
-	if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-		barrier.srcAccessMask = 0;
-		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-		sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-		destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-	}
-	else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-		sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-		destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-	}
-	else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-		barrier.srcAccessMask = 0;
-		barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	barrier.buffer = dstBuffer;
+	barrier.offset = 0;
+	barrier.size = size;
+	uploadContext.ReleaseBuffer(barrier, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+}
 
-		sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-		destinationStage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+Task<void> MyVulkanApplication::uploadBufferAsync(VkBuffer dstBuffer, const void* data, VkDeviceSize size) {
+	uploadBuffer(dstBuffer, data, size);
+	uint64_t ticket;
+	{
+		std::lock_guard<std::mutex> lock(uploadLock);
+		ticket = uploadContext.Submit();
 	}
-	else throw std::invalid_argument("unsupported layout transition!");
-
-	vkCmdPipelineBarrier(
-		commandBuffer,
-		sourceStage, destinationStage,
-		0,
-		0, nullptr,
-		0, nullptr,
-		1, &barrier
-	);
+	co_await gpuFence(ticket);
+}
 
-	endSingleTimeCommands(commandBuffer);
+WaitAsync MyVulkanApplication::gpuFence(uint64_t ticket) {
+	return WaitAsync([this, ticket] {
+		std::lock_guard<std::mutex> lock(uploadLock);
+		return uploadContext.IsComplete(ticket);
+	});
 }
 
-void MyVulkanApplication::createImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
+void MyVulkanApplication::createImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VmaAllocationCreateFlags flags, VkImage& image, VmaAllocation& allocation) {
 	VkImageCreateInfo imageInfo{};
 	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1419,23 +1742,13 @@ void MyVulkanApplication::createImage(uint32_t width, uint32_t height, uint32_t
 	imageInfo.samples = numSamples;
 	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-	if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) {
-		throw std::runtime_error("failed to create image!");
-	}
-
-	VkMemoryRequirements memRequirements;
-	vkGetImageMemoryRequirements(device, image, &memRequirements);
-
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+	VmaAllocationCreateInfo allocInfo{};
+	allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+	allocInfo.flags = flags;
 
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate image memory!");
+	if (vmaCreateImage(allocator, &imageInfo, &allocInfo, &image, &allocation, nullptr) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create image!");
 	}
-
-	vkBindImageMemory(device, image, imageMemory, 0);
 }
 
 #pragma region private utils for initializing part
@@ -1537,6 +1850,26 @@ std::vector<const char*> MyVulkanApplication::getRequiredExtensions() {
 	return extensions;
 }
 
+// sampled with linear filtering from optimal tiling, block formats additionally need the textureCompressionBC feature
+bool MyVulkanApplication::isTextureFormatSupported(VkFormat format) {
+	if (IsBlockFormat(format) && !textureCompressionBC)
+		return false;
+
+	VkFormatProperties formatProperties;
+	vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+	const VkFormatFeatureFlags required = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+	return (formatProperties.optimalTilingFeatures & required) == required;
+}
+
+VkFormat MyVulkanApplication::selectTextureFormat(bool opaque) {
+	VkFormat format = GetTextureFormat(TEXTURE_COMPRESSION, opaque);
+	if (format == VK_FORMAT_BC1_RGB_SRGB_BLOCK && !isTextureFormatSupported(format))
+		format = GetTextureFormat(TextureCompression::BC7, opaque);
+	if (IsBlockFormat(format) && !isTextureFormatSupported(format))
+		format = VK_FORMAT_R8G8B8A8_SRGB;
+	return format;
+}
+
 bool MyVulkanApplication::isDeviceSuitable(VkPhysicalDevice device) {
 	QueueFamilyIndices indices = findQueueFamilies(device);
 	
@@ -1598,6 +1931,12 @@ QueueFamilyIndices MyVulkanApplication::findQueueFamilies(VkPhysicalDevice devic
 		i++;
 	}
 
+	for (uint32_t family = 0; family < queueFamilyCount; family++)
+		if ((queueFamilies[family].queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamilies[family].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+			indices.transferFamily = family;
+			break;
+		}
+
 	return indices;
 }
 
@@ -1704,15 +2043,63 @@ VkFormat MyVulkanApplication::findSupportedFormat(const std::vector<VkFormat>& c
 	throw std::runtime_error("failed to find supported format!");
 }
 
-uint32_t MyVulkanApplication::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+bool MyVulkanApplication::isInstanceExtensionSupported(const char* extension) {
+	uint32_t extensionCount;
+	vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+
+	std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+	vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, availableExtensions.data());
+
+	for (const auto& availableExtension : availableExtensions)
+		if (strcmp(availableExtension.extensionName, extension) == 0)
+			return true;
+	return false;
+}
+
+bool MyVulkanApplication::isDeviceExtensionSupported(const char* extension) {
+	uint32_t extensionCount;
+	vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+
+	std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+	vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, availableExtensions.data());
+
+	for (const auto& availableExtension : availableExtensions)
+		if (strcmp(availableExtension.extensionName, extension) == 0)
+			return true;
+	return false;
+}
+
+// per heap: memory blocks allocated from the driver, suballocations in them, and how the free space in the blocks
+// is split up. fragmentation is 1 - largest free range / free bytes, 0 when all free space is one range
+void MyVulkanApplication::printAllocatorStats(const char* label) {
 	VkPhysicalDeviceMemoryProperties memProperties;
 	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
 
-	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
-		if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
-			return i;
+	VmaTotalStatistics stats;
+	vmaCalculateStatistics(allocator, &stats);
+
+	std::cout << label << ": allocator " << stats.total.statistics.blockCount << " block(s), " << stats.total.statistics.allocationCount
+		<< " allocation(s), " << stats.total.statistics.allocationBytes / 1024 << " of " << stats.total.statistics.blockBytes / 1024 << " KB used\n";
+	for (uint32_t i = 0; i < memProperties.memoryHeapCount; i++) {
+		const VmaDetailedStatistics& heap = stats.memoryHeap[i];
+		if (heap.statistics.blockCount == 0)
+			continue;
+		VkDeviceSize freeBytes = heap.statistics.blockBytes - heap.statistics.allocationBytes;
+		float fragmentation = freeBytes > 0 && heap.unusedRangeCount > 0 ? 1.0f - (float)heap.unusedRangeSizeMax / freeBytes : 0.0f;
+		std::cout << "\theap " << i << ((memProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? " (device local)" : "")
+			<< ": " << heap.statistics.blockCount << " block(s), " << heap.statistics.allocationCount << " allocation(s), "
+			<< heap.statistics.allocationBytes / 1024 << " of " << heap.statistics.blockBytes / 1024 << " KB used, "
+			<< heap.unusedRangeCount << " free range(s), fragmentation " << fragmentation * 100.0f << "%\n";
+	}
 
-	throw std::runtime_error("failed to find suitable memory type!"); 
+#ifdef ALLOCATOR_STATS_JSON
+	// the full per-allocation map, for VMA's VmaDumpVis.py
+	char* json;
+	vmaBuildStatsString(allocator, &json, VK_TRUE);
+	std::ofstream file(std::string("vma_stats_") + label + ".json");
+	file << json;
+	vmaFreeStatsString(allocator, json);
+#endif
 }
 #pragma endregion
 
@@ -18,6 +18,12 @@
 #include <optional>
 #include <set>
 #include <array>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// coroutine tasks on the job system
+#include "async.h"
 
 // Vulkan define and include
 #define VMA_STATIC_VULKAN_FUNCTIONS 0
@@ -44,7 +50,58 @@ const uint32_t HEIGHT = 600;
 const std::string MODEL_PATH = "assets/models/viking_room.obj";
 const std::string TEXTURE_PATH = "assets/textures/viking_room.png";
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+// frames the CPU may run ahead of the GPU, unless --frames-in-flight says otherwise
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+
+// allocation flags of buffers the CPU only writes, sequentially (staging and uniform buffers): persistently mapped,
+// and written through vmaFlushAllocation, which does nothing for host coherent memory
+const VmaAllocationCreateFlags HOST_WRITE_ALLOCATION = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+// post-transform cache size the index buffer is optimized for
+const uint32_t VERTEX_CACHE_SIZE = 16;
+
+// split meshes with more than 65536 vertices into sub-meshes that fit 16 bit indices
+// instead of falling back to 32 bit indices
+const bool SPLIT_16BIT_INDICES = true;
+
+// LOD chain: every level aims for half the triangles of the previous one, up to MESH_LOD_COUNT levels, and
+// generation stops once the simplification error exceeds MESH_LOD_MAX_ERROR (relative to the mesh radius)
+const uint32_t MESH_LOD_COUNT = 5;
+const float MESH_LOD_MAX_ERROR = 0.05f;
+// the coarsest LOD whose error projects to at most this many pixels is drawn
+const float LOD_ERROR_PIXELS = 1.0f;
+
+// upload staging: one persistently mapped ring of this size, uploads larger than half of it are split into batches
+const VkDeviceSize STAGING_RING_SIZE = 64 * 1024 * 1024;
+
+// texture streaming: the smallest levels, up to TEXTURE_STREAM_TAIL_SIZE bytes, are uploaded before the first frame,
+// the larger ones follow at up to TEXTURE_STREAM_BUDGET bytes per frame (at least one level)
+const uint64_t TEXTURE_STREAM_TAIL_SIZE = 64 * 1024;
+const uint64_t TEXTURE_STREAM_BUDGET = 1024 * 1024;
+
+// command recording: the draw list is split over up to one job per job manager thread, each job taking at least
+// RECORD_DRAWS_PER_JOB draws; a list too short for two jobs is recorded inline into the primary
+const uint32_t RECORD_DRAWS_PER_JOB = 256;
+// keep the command buffer of every frame slot and swap chain image and submit it again while sceneVersion is unchanged,
+// instead of recording every frame (frames that acquire uploads are still recorded)
+const bool REUSE_COMMAND_BUFFERS = true;
+#ifdef RECORD_BENCHMARK
+const uint32_t RECORD_BENCHMARK_DRAWS = 16384;		// the draw list is repeated up to this many draws
+const uint32_t RECORD_BENCHMARK_RUNS = 50;
+#endif
+
+// the async I/O thread checks the conditions coroutines wait on (WaitAsync) this often while any are pending
+const std::chrono::microseconds ASYNC_POLL_INTERVAL(100);
+#ifdef ASYNC_BENCHMARK
+// every asset is loaded (read, decoded, uploaded) this many times, once one after another and once as coroutines
+const uint32_t ASYNC_BENCHMARK_COPIES = 8;
+#endif
+
+// pipeline cache: loaded before the pipelines are created, saved on shutdown (see pipelinecache.h)
+const std::string PIPELINE_CACHE_PATH = "pipeline.cache";
+// threads compiling pipeline permutations in the background; they run next to the job workers and the async I/O thread,
+// so they are kept few: the permutations are a handful, and the one the first frame needs is compiled by its caller
+const uint32_t PIPELINE_COMPILE_THREADS = 2;
 
 // validation layers
 const std::vector<const char*> validationLayers = {
@@ -66,6 +123,7 @@ const bool enableValidationLayers = false;
 struct QueueFamilyIndices {
 	std::optional<uint32_t> graphicsFamily;
 	std::optional<uint32_t> presentFamily;
+	std::optional<uint32_t> transferFamily;		// transfer only, without graphics and compute: the copy engine
 
 	bool isComplete() {
 		return graphicsFamily.has_value() && presentFamily.has_value();
@@ -79,38 +137,84 @@ struct SwapChainSupportDetails {
 	std::vector<VkPresentModeKHR> presentModes;
 };
 
-// vertex struct
+// vertex layouts the mesh can be uploaded in, none of them carries the (constant) color
+enum class VertexFormat : uint32_t {
+	Float,			// float3 position, float2 texcoord: 20 bytes
+	Half,			// half4 position, half2 texcoord: 12 bytes
+	Quantized		// snorm16x4 position in the mesh bounds, unorm16x2 texcoord in the texcoord bounds: 12 bytes
+};
+
+// vertex layout meshes are uploaded in, unless --vertex-format float|half|quantized picks another
+const VertexFormat DEFAULT_VERTEX_FORMAT = VertexFormat::Quantized;
+
+// GPU side vertex layouts, one per VertexFormat
+struct VertexFloat {
+	float pos[3];
+	float texCoord[2];
+};
+
+struct VertexHalf {
+	uint16_t pos[4];		// w is padding
+	uint16_t texCoord[2];
+};
+
+struct VertexQuantized {
+	int16_t pos[4];			// w is padding
+	uint16_t texCoord[2];
+};
+
+// vertex struct, the layout meshes are loaded and processed in
 struct Vertex {
 	glm::vec3 pos;
 	glm::vec3 color;
 	glm::vec2 texCoord;
 
-	static VkVertexInputBindingDescription getBindingDescription() {
+	static uint32_t getStride(VertexFormat format) {
+		switch (format) {
+		case VertexFormat::Half: return sizeof(VertexHalf);
+		case VertexFormat::Quantized: return sizeof(VertexQuantized);
+		default: return sizeof(VertexFloat);
+		}
+	}
+
+	static VkVertexInputBindingDescription getBindingDescription(VertexFormat format) {
 		VkVertexInputBindingDescription bindingDescription{};
 		bindingDescription.binding = 0;
-		bindingDescription.stride = sizeof(Vertex);
+		bindingDescription.stride = getStride(format);
 		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
 		return bindingDescription;
 	}
 
-	static std::array<VkVertexInputAttributeDescription, 3> getAttributeDescriptions() {
-		std::array<VkVertexInputAttributeDescription, 3> attributeDescriptions{};
+	static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions(VertexFormat format) {
+		std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
 
 		attributeDescriptions[0].binding = 0;
 		attributeDescriptions[0].location = 0;
-		attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-		attributeDescriptions[0].offset = offsetof(Vertex, pos);
 
 		attributeDescriptions[1].binding = 0;
 		attributeDescriptions[1].location = 1;
-		attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-		attributeDescriptions[1].offset = offsetof(Vertex, color);
 
-		attributeDescriptions[2].binding = 0;
-		attributeDescriptions[2].location = 2;
-		attributeDescriptions[2].format = VK_FORMAT_R32G32_SFLOAT;
-		attributeDescriptions[2].offset = offsetof(Vertex, texCoord);
+		switch (format) {
+		case VertexFormat::Half:
+			attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_SFLOAT;
+			attributeDescriptions[0].offset = offsetof(VertexHalf, pos);
+			attributeDescriptions[1].format = VK_FORMAT_R16G16_SFLOAT;
+			attributeDescriptions[1].offset = offsetof(VertexHalf, texCoord);
+			break;
+		case VertexFormat::Quantized:
+			attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_SNORM;
+			attributeDescriptions[0].offset = offsetof(VertexQuantized, pos);
+			attributeDescriptions[1].format = VK_FORMAT_R16G16_UNORM;
+			attributeDescriptions[1].offset = offsetof(VertexQuantized, texCoord);
+			break;
+		default:
+			attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+			attributeDescriptions[0].offset = offsetof(VertexFloat, pos);
+			attributeDescriptions[1].format = VK_FORMAT_R32G32_SFLOAT;
+			attributeDescriptions[1].offset = offsetof(VertexFloat, texCoord);
+			break;
+		}
 
 		return attributeDescriptions;
 	}
@@ -120,27 +224,407 @@ struct Vertex {
 	}
 };
 
+// maps stored attributes back to object space: value = offset + scale * stored
+struct VertexTransform {
+	float positionScale[3];
+	float positionOffset[3];
+	float texCoordScale[2];
+	float texCoordOffset[2];
+};
+
+// the attribute bits of a vertex (padding excluded, -0 folded into +0 so equal vertices have equal keys)
+struct VertexKey {
+	uint32_t bits[8];
+
+	static uint32_t floatBits(float f) {
+		uint32_t b;
+		memcpy(&b, &f, sizeof(b));
+		return b == 0x80000000u ? 0u : b;
+	}
+
+	static VertexKey fromVertex(const Vertex& vertex) {
+		return { {
+			floatBits(vertex.pos.x), floatBits(vertex.pos.y), floatBits(vertex.pos.z),
+			floatBits(vertex.color.x), floatBits(vertex.color.y), floatBits(vertex.color.z),
+			floatBits(vertex.texCoord.x), floatBits(vertex.texCoord.y)
+		} };
+	}
+
+	bool operator==(const VertexKey& other) const {
+		return memcmp(bits, other.bits, sizeof(bits)) == 0;
+	}
+};
+
+// 64 bit multiply-xorshift mix over the key words (murmur3 finalizer per lane)
+inline uint64_t hashVertexKey(const VertexKey& key) {
+	uint64_t h = 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < 8; i += 2) {
+		h ^= (uint64_t)key.bits[i] | ((uint64_t)key.bits[i + 1] << 32);
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 32;
+	}
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
 namespace std {
 	template<> struct hash<Vertex> {
 		size_t operator()(Vertex const& vertex) const {
-			return ((hash<glm::vec3>()(vertex.pos) ^
-				(hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
-				(hash<glm::vec2>()(vertex.texCoord) << 1);
+			return static_cast<size_t>(hashVertexKey(VertexKey::fromVertex(vertex)));
 		}
 	};
 }
 
+// range of the index buffer drawn by one vkCmdDrawIndexed, its indices are relative to vertexOffset
+struct SubMesh {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	int32_t vertexOffset;
+	uint32_t vertexCount;
+};
+
+// one level of detail: its triangles are drawn by subMeshCount sub-meshes starting at firstSubMesh,
+// error is the object space deviation from the full resolution mesh
+struct MeshLod {
+	uint32_t firstSubMesh;
+	uint32_t subMeshCount;
+	uint32_t triangleCount;
+	float error;
+};
+
+// mesh data as seen by the upload code: points either into the vectors filled by
+// loadModel() or straight into a memory mapped mesh cache
+struct MeshData {
+	VertexFormat vertexFormat = VertexFormat::Float;
+	VertexTransform vertexTransform{};
+	const void* vertices = nullptr;			// vertexCount * Vertex::getStride(vertexFormat) bytes
+	uint32_t vertexCount = 0;
+	VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+	const void* indices = nullptr;			// indexCount * GetIndexSize(indexType) bytes
+	uint32_t indexCount = 0;
+	const SubMesh* subMeshes = nullptr;
+	uint32_t subMeshCount = 0;
+	const MeshLod* lods = nullptr;			// lods[0] is the full resolution mesh
+	uint32_t lodCount = 0;
+	float boundsCenter[3] = {};				// object space bounding sphere
+	float boundsRadius = 0.0f;
+};
+
+// how textures are stored on the GPU; block compressed formats fall back to rgba8 when the device cannot sample them
+enum class TextureCompression : uint32_t {
+	None,			// rgba8, 4 bytes per texel
+	BC1,			// 0.5 bytes per texel, opaque images only (images with alpha use BC7)
+	BC7				// 1 byte per texel
+};
+
+// encoder effort for the block compressed formats, BenchmarkBlockCompression prints speed and PSNR of each
+enum class BlockQuality : uint32_t {
+	Fast,
+	Normal,
+	High
+};
+
+const TextureCompression TEXTURE_COMPRESSION = TextureCompression::BC7;
+const BlockQuality TEXTURE_BLOCK_QUALITY = BlockQuality::Normal;
+
+// one mip level of a baked texture, offset is relative to the start of the level data
+struct TextureLevel {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+};
+
+// baked texture as seen by the upload code, points into a memory mapped texture file
+struct TextureData {
+	VkFormat format = VK_FORMAT_UNDEFINED;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t mipCount = 0;
+	const TextureLevel* levels = nullptr;
+	const uint8_t* data = nullptr;			// all levels, dataSize bytes
+	uint64_t dataSize = 0;
+};
+
+// read-only memory mapped file (handles are HANDLEs on windows; elsewhere the descriptor is closed once mapped)
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile() { Close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	bool Open(const char* a_File);
+	void Close();
+	bool IsOpen() const { return m_Data != nullptr; }
+	const uint8_t* GetData() const { return m_Data; }
+	size_t GetSize() const { return m_Size; }
+protected:
+	void* m_File = nullptr;
+	void* m_Mapping = nullptr;
+	const uint8_t* m_Data = nullptr;
+	size_t m_Size = 0;
+};
+
+// CPU side of a streamed texture: the levels come from the baked file or, when there is no usable one, are decoded,
+// built and baked on a worker thread; the upload side takes them smallest first as they become resident
+class TextureStream
+{
+public:
+	~TextureStream() { Close(); }
+	// maps the baked texture of source if selectFormat (opaque -> format) could have picked its format, otherwise
+	// starts the worker, which encodes the image in selectFormat(IsOpaque())
+	void Open(const std::string& source, std::function<VkFormat(bool)> selectFormat);
+	// maps the baked texture of source and reads it in ahead of Open, which needs the device to pick the format
+	void Prefetch(const std::string& source);
+	bool IsReady() const { return m_Ready.load(std::memory_order_acquire); }
+	bool HasFailed() const { return m_Failed.load(std::memory_order_acquire); }
+	const TextureData& GetData() const { return m_Texture; }
+	// first of the smallest levels that fit into tailSize together (at least the last level)
+	uint32_t GetTailLevel(uint64_t tailSize) const;
+	// new first resident level after uploading the levels above resident that fit into budget (at least one)
+	uint32_t GetNextLevel(uint32_t resident, uint64_t budget) const;
+	// waits for the worker and releases the level data
+	void Close();
+protected:
+	void Build(std::string source, std::function<VkFormat(bool)> selectFormat);
+	MappedFile m_File;
+	bool m_Prefetched = false;						// m_File and m_Texture hold the baked texture, Open only checks its format
+	std::vector<uint8_t> m_Data;
+	std::vector<TextureLevel> m_Levels;
+	TextureData m_Texture;
+	std::thread m_Worker;
+	std::atomic<bool> m_Ready{ false };
+	std::atomic<bool> m_Failed{ false };
+};
+
+// batched uploads: copies and barriers are recorded into one open command buffer, which is submitted with a fence as
+// one batch; the source data lives in a persistently mapped staging ring, whose space comes back once the batch that
+// read it has completed. callers get a ticket per batch and only wait for it when they need the result on the CPU.
+// on a queue of another family than graphics, uploaded resources change owner: the batch releases them, and the
+// graphics submission that waits on the batch's semaphore acquires them
+class UploadContext
+{
+public:
+	void Create(VkDevice device, VmaAllocator allocator, VkQueue queue, uint32_t queueFamily, uint32_t graphicsFamily, VkDeviceSize ringSize);
+	void Destroy();
+	// reserves size (at most GetSize()) bytes, waits for the oldest batches while the ring is full and submits the open
+	// batch when it fills the ring itself, so get the command buffer after allocating; returns the offset in GetBuffer()
+	VkDeviceSize Allocate(VkDeviceSize size, VkDeviceSize alignment);
+	uint8_t* GetData(VkDeviceSize offset) const { return m_Data + offset; }
+	VkBuffer GetBuffer() const { return m_Buffer; }
+	VkDeviceSize GetSize() const { return m_Size; }
+	// command buffer of the open batch, begun on first use
+	VkCommandBuffer GetCommandBuffer();
+	// submits the open batch if there is one, returns the ticket that completes with the last submitted batch. when
+	// released resources are waiting for their acquire, the batch signals signal (if given): the next graphics
+	// submission then has to wait on it at GetAcquireStages() and run RecordAcquires() first
+	uint64_t Submit(VkSemaphore signal = VK_NULL_HANDLE);
+	// ends the upload of an image range or buffer with barrier, from the transfer stage to dstStage
+	void ReleaseImage(VkImageMemoryBarrier barrier, VkPipelineStageFlags dstStage);
+	void ReleaseBuffer(VkBufferMemoryBarrier barrier, VkPipelineStageFlags dstStage);
+	// stages the acquires of the signaled releases are for, 0 when there are none
+	VkPipelineStageFlags GetAcquireStages() const { return m_ReadyAcquireStages; }
+	void RecordAcquires(VkCommandBuffer commandBuffer);
+	bool IsComplete(uint64_t ticket);
+	void Wait(uint64_t ticket);
+	// retires the batches whose fence has signaled
+	void Reclaim();
+	// number of times the CPU had to wait for a batch
+	uint32_t GetWaitCount() const { return m_WaitCount; }
+protected:
+	struct Batch {
+		uint64_t ticket;
+		uint64_t end;							// ring position after the batch's data
+		VkFence fence;
+		VkCommandBuffer commandBuffer;
+	};
+	void WaitOldest();
+	void Retire();
+	VkDevice m_Device = VK_NULL_HANDLE;
+	VmaAllocator m_Allocator = VK_NULL_HANDLE;
+	VkQueue m_Queue = VK_NULL_HANDLE;
+	uint32_t m_QueueFamily = 0, m_GraphicsFamily = 0;
+	VkCommandPool m_CommandPool = VK_NULL_HANDLE;
+	VkCommandBuffer m_CommandBuffer = VK_NULL_HANDLE;	// the open batch
+	VkBuffer m_Buffer = VK_NULL_HANDLE;
+	VmaAllocation m_Allocation = VK_NULL_HANDLE;
+	uint8_t* m_Data = nullptr;
+	VkDeviceSize m_Size = 0;
+	// positions count every byte ever allocated, the offset in the buffer is position % m_Size
+	uint64_t m_Head = 0, m_Tail = 0;
+	uint64_t m_NextTicket = 1, m_Completed = 0;
+	uint32_t m_WaitCount = 0;
+	std::deque<Batch> m_Batches;				// submitted, oldest first
+	std::vector<VkFence> m_FreeFences;
+	std::vector<VkCommandBuffer> m_FreeCommandBuffers;
+	// acquire halves of the ownership transfers: released in batches not signaled yet, and ready for the graphics side
+	std::vector<VkImageMemoryBarrier> m_ImageAcquires, m_ReadyImageAcquires;
+	std::vector<VkBufferMemoryBarrier> m_BufferAcquires, m_ReadyBufferAcquires;
+	VkPipelineStageFlags m_AcquireStages = 0, m_ReadyAcquireStages = 0;
+};
+
+// graphics pipeline permutation; all members are 32 bit, so the key hashes and compares as plain bytes
+enum PipelineBlendMode : uint32_t { BLEND_OPAQUE, BLEND_ALPHA };
+
+struct PipelineKey {
+	PipelineBlendMode blendMode = BLEND_OPAQUE;
+	VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+	VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+	bool operator==(const PipelineKey& other) const { return memcmp(this, &other, sizeof(PipelineKey)) == 0; }
+};
+
+struct PipelineKeyHasher {
+	size_t operator()(const PipelineKey& key) const;
+};
+
+// state the permutations share; the manager owns the shader modules from Create on
+struct PipelineState {
+	VkShaderModule vertShader;
+	VkShaderModule fragShader;
+	VkPipelineLayout layout;
+	VkRenderPass renderPass;
+	VertexFormat vertexFormat;
+};
+
+// graphics pipelines by permutation: requested keys are compiled once each, by worker threads, into one shared
+// pipeline cache (vkCreateGraphicsPipelines is thread safe on it); a request for a key that is already known only
+// shares the result. Get blocks for a pipeline (and compiles it on the calling thread when no worker has started it
+// yet), Find never blocks and hands out a fallback until the requested permutation is ready (the fallback is not waited
+// for, Get has to have built it).
+// the workers are threads of their own rather than job manager jobs: a thread in RunJobs runs other batches' jobs
+// while it waits for its own, so a compile (tens of milliseconds) queued as a job could stall the render thread's frame
+class PipelineManager
+{
+public:
+	void Create(VkDevice device, VkPipelineCache cache, const PipelineState& state, uint32_t threadCount);
+	// stops the workers (after the pipelines they are compiling) and destroys every pipeline and the shader modules
+	void Destroy();
+	void Request(const PipelineKey& key);
+	// throws when key fails to compile
+	VkPipeline Get(const PipelineKey& key);
+	// the pipeline of key when it is compiled, otherwise the one of fallback, which must be compiled already (Get);
+	// requests key if it is new. VK_NULL_HANDLE (and an assert) when fallback is not ready
+	VkPipeline Find(const PipelineKey& key, const PipelineKey& fallback);
+	// blocks until every requested pipeline is compiled or has failed
+	void WaitIdle();
+	uint32_t GetCompiledCount();
+protected:
+	enum EntryState { PIPELINE_QUEUED, PIPELINE_COMPILING, PIPELINE_READY, PIPELINE_FAILED };
+	struct Entry {
+		PipelineKey key;
+		EntryState state = PIPELINE_QUEUED;
+		VkPipeline pipeline = VK_NULL_HANDLE;
+	};
+	// adds key if it is new, queued for the workers; m_Mutex is held
+	Entry& Insert(const PipelineKey& key);
+	// compiles entry on the calling thread; m_Mutex is held by lock and released while compiling
+	void Compile(Entry& entry, std::unique_lock<std::mutex>& lock);
+	VkPipeline CreatePipeline(const PipelineKey& key) const;
+	void Worker();
+	VkDevice m_Device = VK_NULL_HANDLE;
+	VkPipelineCache m_Cache = VK_NULL_HANDLE;
+	PipelineState m_State{};
+	std::mutex m_Mutex;
+	std::condition_variable m_Queued, m_Compiled;
+	std::unordered_map<PipelineKey, Entry, PipelineKeyHasher> m_Entries;	// nodes are stable, the queue points into it
+	std::deque<Entry*> m_Queue;
+	std::vector<std::thread> m_Workers;
+	uint32_t m_Compiling = 0;
+	bool m_Stop = false;
+};
+
+// one indexed draw of the draw list
+struct DrawCommand {
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+};
+
+// everything a draw list is recorded with; a secondary command buffer inherits nothing but the render pass, so each
+// one binds all of it again
+struct DrawState {
+	VkRenderPass renderPass;
+	VkFramebuffer framebuffer;
+	VkExtent2D extent;
+	VkPipeline pipeline;
+	VkPipelineLayout layout;
+	VkDescriptorSet descriptorSet;
+	VkBuffer vertexBuffer;
+	VkBuffer indexBuffer;
+	VkIndexType indexType;
+};
+
+// parallel recording of a draw list: it is split into contiguous ranges, one per job, and every job records its range
+// into a secondary command buffer from a pool of its own (one per job and frame slot, reset as a whole by the job that
+// owns it), so the jobs share nothing. the primary executes the secondaries in range order. the jobs run on the job
+// manager
+class CommandRecorder
+{
+public:
+	void Create(VkDevice device, uint32_t queueFamily, uint32_t frameCount, uint32_t jobCount);
+	void Destroy();
+	uint32_t GetMaxJobCount() const { return m_JobCount; }
+	// records draws with jobCount (2..GetMaxJobCount()) jobs into frame's secondaries and executes them on primary, in
+	// the render pass instance begun with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+	void Record(VkCommandBuffer primary, uint32_t frame, const DrawState& state, const std::vector<DrawCommand>& draws, uint32_t jobCount);
+	// binds state and records draws, inline in a primary or in a secondary
+	static void RecordDraws(VkCommandBuffer commandBuffer, const DrawState& state, const DrawCommand* draws, uint32_t drawCount);
+protected:
+	VkDevice m_Device = VK_NULL_HANDLE;
+	uint32_t m_JobCount = 0;
+	std::vector<VkCommandPool> m_Pools;				// [frame * m_JobCount + job]
+	std::vector<VkCommandBuffer> m_CommandBuffers;	// one secondary per pool
+};
+
+// completion of the graphics submissions as one increasing value: the n-th Submit signals n once it has executed, so
+// anything that has to outlive a frame only needs to remember the value of that frame and ask IsComplete / Wait.
+// runs on a timeline semaphore (VK_KHR_timeline_semaphore), or on a fence per slot on devices without one; then
+// at most slotCount submissions can be pending and only the last slotCount values can be waited for individually
+class FrameTimeline
+{
+public:
+	void Create(VkDevice device, bool timelineSemaphore, uint32_t slotCount);
+	void Destroy();
+	// submits submitInfo with the signal of the next value added, returns that value
+	uint64_t Submit(VkQueue queue, VkSubmitInfo submitInfo);
+	uint64_t GetSubmittedValue() const { return m_Submitted; }
+	uint64_t GetCompletedValue();
+	bool IsComplete(uint64_t value) { return value <= m_Completed || value <= GetCompletedValue(); }
+	// value has to be submitted already
+	void Wait(uint64_t value);
+	bool IsTimelineSemaphore() const { return m_Semaphore != VK_NULL_HANDLE; }
+protected:
+	VkDevice m_Device = VK_NULL_HANDLE;
+	VkSemaphore m_Semaphore = VK_NULL_HANDLE;
+	PFN_vkWaitSemaphoresKHR m_WaitSemaphores = nullptr;
+	PFN_vkGetSemaphoreCounterValueKHR m_GetSemaphoreCounterValue = nullptr;
+	std::vector<VkFence> m_Fences;				// fallback: the fence of value v is m_Fences[v % size]
+	std::vector<uint64_t> m_FenceValues;
+	uint64_t m_Submitted = 0, m_Completed = 0;
+	std::vector<VkSemaphore> m_SignalSemaphores;	// Submit's signal list, kept to not allocate every frame
+	std::vector<uint64_t> m_SignalValues;
+};
+
+
 // descriptor struct UBO
 struct UniformBufferObject {
-	glm::mat4 model;
+	glm::mat4 model;								// includes the position dequantization of the mesh
 	glm::mat4 view;
 	glm::mat4 proj;
+	glm::vec4 texCoordTransform;					// xy scale, zw offset
 };
 
 // Vulkan app class
 class MyVulkanApplication {
 public:
 	void run();
+	// before run: frames the CPU may record ahead of the GPU (at least 1)
+	void setFramesInFlight(uint32_t count) { framesInFlight = std::max(count, 1u); }
+	// before run: the layout loadModel encodes (or takes from the mesh cache) and the pipelines read
+	void setVertexFormat(VertexFormat format) { vertexFormat = format; }
 private:
 	GLFWwindow* window;
 	VkInstance instance;
@@ -149,9 +633,18 @@ private:
 	VkDebugUtilsMessengerEXT debugMessenger;
 	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
 	VkDevice device;
+	VmaAllocator allocator;
+	UploadContext uploadContext;
+	std::mutex uploadLock;						// uploadContext is shared with the loader coroutines
+	uint32_t queueIdleCount = 0;				// vkQueueWaitIdle / vkDeviceWaitIdle calls, reported with the first frame
+	bool dedicatedAllocation = false;		// VK_KHR_dedicated_allocation is enabled, the allocator follows its hints
+	bool physicalDeviceProperties2 = false;	// VK_KHR_get_physical_device_properties2 is enabled on the instance
+	bool timelineSemaphore = false;			// VK_KHR_timeline_semaphore is enabled, frameTimeline runs on it
 
 	VkQueue graphicsQueue;
 	VkQueue presentQueue;
+	VkQueue transferQueue;							// graphicsQueue when there is no transfer family
+	uint32_t transferFamily;
 
 	VkSwapchainKHR swapChain;
 	std::vector<VkImage> swapChainImages;
@@ -163,44 +656,90 @@ private:
 
 	VkDescriptorSetLayout descriptorSetLayout;
 	VkPipelineLayout pipelineLayout;
-	VkPipeline graphicsPipeline;
+	PipelineManager pipelineManager;
+	PipelineKey basePipelineKey;					// compiled at startup, the fallback of every other permutation
+	PipelineKey pipelineKey;						// the permutation the model is drawn with
+	VkPipelineCache pipelineCache;
+	bool pipelineCacheWarm = false;				// pipelineCache was filled from PIPELINE_CACHE_PATH
+	std::vector<char> vertShaderCode;				// read ahead by the startup graph, released once the modules exist
+	std::vector<char> fragShaderCode;
 
 	std::vector<VkFramebuffer> swapChainFramebuffers;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> commandBuffers;
+	CommandRecorder commandRecorder;
+	std::vector<DrawCommand> drawList;				// rebuilt by updateDrawList when the LOD or pipeline changes
+	uint32_t drawLod = 0;
+	VkPipeline drawPipeline = VK_NULL_HANDLE;
+	// moves on with every change to what the recorded command buffers contain: draw list, pipeline, descriptor sets
+	uint64_t sceneVersion = 1;
+	std::vector<VkCommandBuffer> cachedCommandBuffers;	// [frame slot * swap chain image count + image]
+	std::vector<uint64_t> cachedVersions;			// sceneVersion each one was recorded at
+	uint64_t reusedFrames = 0;
+	std::vector<double> recordTime;					// ms spent recording, by job count (1: inline)
+	std::vector<uint64_t> recordFrames;
 
 	std::vector<VkSemaphore> imageAvailableSemaphores;
 	std::vector<VkSemaphore> renderFinishedSemaphores;
-	std::vector<VkFence> inFlightFences;
-	uint32_t currentFrame = 0;
+	std::vector<VkSemaphore> uploadSemaphores;		// upload batch to frame handover on a transfer queue
+	FrameTimeline frameTimeline;
+	uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+	VertexFormat vertexFormat = DEFAULT_VERTEX_FORMAT;
+	uint32_t currentFrame = 0;						// frameTimeline.GetSubmittedValue() % framesInFlight
+	uint64_t frameCount = 0;
+	// frame pacing: time the CPU blocked on the frame that used the slot before, and the time the graphics queue sat
+	// idle between two frames (from the timestamps at the start and end of every frame's command buffer)
+	VkQueryPool timestampPool = VK_NULL_HANDLE;
+	float timestampPeriod = 0.0f;					// ns per tick
+	std::vector<uint64_t> timestampValues;			// frame value each slot's timestamps were written by, 0 when read
+	uint64_t lastFrameEnd = 0;
+	double cpuWaitTime = 0.0, gpuWaitTime = 0.0;	// ms, summed over all frames
+	uint64_t gpuWaitSamples = 0;
+	Timer startupTimer;
 
 	bool framebufferResized = false;
 
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
+	std::vector<uint8_t> vertexData;			// vertices encoded in mesh.vertexFormat
+	std::vector<uint8_t> indexData;			// indices narrowed to mesh.indexType
+	std::vector<SubMesh> subMeshes;
+	std::vector<MeshLod> meshLods;
+	uint32_t currentLod = 0;
+	// object transform of the current frame (without the vertex dequantization), used to pick the LOD
+	glm::mat4 modelMatrix, viewMatrix, projMatrix;
+	MappedFile modelCache;
+	MeshData mesh;
 
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	VmaAllocation vertexBufferAllocation;
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	VmaAllocation indexBufferAllocation;
+	VkIndexType indexBufferType;
 
 	uint32_t mipLevels;
+	VkFormat textureFormat = VK_FORMAT_R8G8B8A8_SRGB;
+	bool textureCompressionBC = false;		// enabled on the logical device when supported
+	TextureStream textureStream;
+	bool texturePlaceholder = false;			// a 1x1 texture stands in until the worker has built the real one
+	uint32_t textureResidentLevel = 0;			// finest level uploaded so far, the sampler minLod
 	VkImage textureImage;
-	VkDeviceMemory textureImageMemory;
+	VmaAllocation textureImageAllocation;
 	VkImageView textureImageView;
-	VkSampler textureSampler;
+	std::vector<VkSampler> textureSamplers;		// one per minLod
+	std::vector<uint32_t> descriptorTextureLevel;	// minLod each frame's descriptor set was written with
 	
 	VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 	VkImage colorImage;
-	VkDeviceMemory colorImageMemory;
+	VmaAllocation colorImageAllocation;
 	VkImageView colorImageView;
 
 	VkImage depthImage;
-	VkDeviceMemory depthImageMemory;
+	VmaAllocation depthImageAllocation;
 	VkImageView depthImageView;
 
 	std::vector<VkBuffer> uniformBuffers;
-	std::vector<VkDeviceMemory> uniformBuffersMemory;
+	std::vector<VmaAllocation> uniformBuffersAllocation;
 	std::vector<void*> uniformBuffersMapped;
 	VkDescriptorPool descriptorPool;
 	std::vector<VkDescriptorSet> descriptorSets;
@@ -213,21 +752,30 @@ private:
 	void setupDebugMessenger();
 	void pickPhysicalDevice();
 	void createLogicalDevice();
+	void createAllocator();
 
 	void createSwapChain();
 	void createImageViews();
 	void createRenderPass();
 	void createDescriptorSetLayout();
+	void createPipelineCache();
+	void savePipelineCache();
+	Task<void> loadShaderFiles();
 	void createGraphicsPipeline();
 
 	void createDepthResources();
 	void createColorResources();
 	void createTextureImage();
+	void createStreamedTextureImage();
+	void createPlaceholderTextureImage();
+	void uploadTextureLevels(const TextureData& source, uint32_t firstLevel, uint32_t endLevel, bool initial);
 	void createTextureImageView();
 	void createTextureSampler();
+	void destroyTextureImage();
 	void createFramebuffers();
 
 	void loadModel();
+	void optimizeModel();
 	void createVertexBuffer();
 	void createIndexBuffer();
 	void createUniformBuffers();
@@ -240,6 +788,9 @@ private:
 
 	void mainLoop();
 	void drawFrame();
+	void readFrameTimestamps(uint32_t frame);
+	void updateTextureStreaming();
+	void updateTextureDescriptor(uint32_t frame);
 	void cleanupSwapChain();
 	void recreateSwapChain();
 
@@ -248,17 +799,29 @@ private:
 private:
 	// command
 	void updateUniformBuffer(uint32_t currentImage);
+	uint32_t selectLod();
 
-	void generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels);
 	VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels);
-	VkCommandBuffer beginSingleTimeCommands();
-	void endSingleTimeCommands(VkCommandBuffer commandBuffer);
-	void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
-	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
-	void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
-	void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels);
-	void createImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory);
+	void updateDrawList();
+	void createCachedCommandBuffers();
+	void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, bool reusable);
+	void recordDrawList(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t jobCount);
+#ifdef RECORD_BENCHMARK
+	void benchmarkRecording();
+#endif
+#ifdef ASYNC_BENCHMARK
+	void decodeAsset(const std::string& path, const std::vector<char>& file, std::vector<uint8_t>& data);
+	size_t loadAsset(const std::string& path, VkBuffer& buffer, VmaAllocation& allocation);
+	Task<void> loadAssetAsync(std::string path, size_t& bytes, VkBuffer& buffer, VmaAllocation& allocation);
+	void benchmarkAsyncLoading();
+#endif
+	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaAllocationCreateFlags flags, VkBuffer& buffer, VmaAllocation& allocation, VmaAllocationInfo* allocationInfo = nullptr);
+	void uploadBuffer(VkBuffer dstBuffer, const void* data, VkDeviceSize size);
+	// uploadBuffer for coroutines: submits the batch and resumes once the GPU has done the copies
+	Task<void> uploadBufferAsync(VkBuffer dstBuffer, const void* data, VkDeviceSize size);
+	// resumes once the upload batch ticket stands for has completed
+	WaitAsync gpuFence(uint64_t ticket);
+	void createImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VmaAllocationCreateFlags flags, VkImage& image, VmaAllocation& allocation);
 
 private:
 	// debug message
@@ -268,8 +831,12 @@ private:
 
 	// support check
 	VkSampleCountFlagBits getMaxUsableSampleCount();
+	bool isTextureFormatSupported(VkFormat format);
+	VkFormat selectTextureFormat(bool opaque);
 	bool checkValidationLayerSupport();
 	bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+	bool isDeviceExtensionSupported(const char* extension);
+	bool isInstanceExtensionSupported(const char* extension);
 	std::vector<const char*> getRequiredExtensions();
 	bool isDeviceSuitable(VkPhysicalDevice device);
 	int rateDeviceSuitability(VkPhysicalDevice device);
@@ -293,7 +860,7 @@ private:
 		app->framebufferResized = true;
 	}
 	// memory allocator
-	uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
+	void printAllocatorStats(const char* label);
 };
 
 // Utils